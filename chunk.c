@@ -12,12 +12,20 @@ void chunk_init(chunk_t* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   value_array_init(&chunk->constants);
+  chunk->cache_count = 0;
+  chunk->cache_capacity = 0;
+  chunk->caches = NULL;
+  chunk->loop_count = 0;
+  chunk->loop_capacity = 0;
+  chunk->loops = NULL;
 }
 
 void chunk_free(chunk_t* chunk) {
-  free(chunk->lines);
-  free(chunk->code);
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   value_array_free(&chunk->constants);
+  FREE_ARRAY(inline_cache_t, chunk->caches, chunk->cache_capacity);
+  FREE_ARRAY(loop_t, chunk->loops, chunk->loop_capacity);
   chunk_init(chunk);
 }
 
@@ -39,3 +47,123 @@ int chunk_add_constant(chunk_t* chunk, value_t value) {
   stack_pop();
   return chunk->constants.count - 1;
 }
+
+int chunk_add_cache(chunk_t* chunk) {
+  if (chunk->cache_count + 1 > chunk->cache_capacity) {
+    int old_capacity = chunk->cache_capacity;
+    chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+    chunk->caches = GROW_ARRAY(inline_cache_t, chunk->caches, old_capacity, chunk->cache_capacity);
+  }
+  chunk->caches[chunk->cache_count].count = 0;
+  // Compiled code checks the first entry without looking at count.
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    chunk->caches[chunk->cache_count].entries[i].klass = NULL;
+  }
+  return chunk->cache_count++;
+}
+
+int chunk_add_loop(chunk_t* chunk) {
+  if (chunk->loop_count + 1 > chunk->loop_capacity) {
+    int old_capacity = chunk->loop_capacity;
+    chunk->loop_capacity = GROW_CAPACITY(old_capacity);
+    chunk->loops = GROW_ARRAY(loop_t, chunk->loops, old_capacity, chunk->loop_capacity);
+  }
+  loop_t* loop = &chunk->loops[chunk->loop_count];
+  loop->hotness = 0;
+  loop->aborts = 0;
+  loop->trace = NULL;
+  loop->trace_size = 0;
+  return chunk->loop_count++;
+}
+
+// Returns the size in bytes of the instruction at offset, operands included.
+int chunk_instruction_length(chunk_t* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NEGATE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_BIT_NOT:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_RETURN:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+      return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+      return 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_ADD_LOCALS:
+    case OP_MOVE:
+    case OP_LOAD_CONSTANT:
+      return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+      return 4;
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+      return 5;
+    case OP_CLOSURE: {
+      obj_function_t* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+      return 2 + 2 * function->upvalue_count;
+    }
+  }
+  return 1;
+}
+
+// Returns the instruction that a quickened instruction was rewritten from,
+// or op itself if it is not quickened.
+uint8_t chunk_generic_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      return OP_ADD;
+    case OP_EQUAL_NUM:
+      return OP_EQUAL;
+    default:
+      return op;
+  }
+}
@@ -1,6 +1,7 @@
 #ifndef _CLOX_CHUNK_H
 #define _CLOX_CHUNK_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "value.h"
@@ -19,6 +20,13 @@ typedef enum {
   OP_MULTIPLY,
   OP_DIVIDE,
   OP_MODULO,
+  // Bitwise operators, on numbers that are integers fitting in 32 bits.
+  OP_BIT_AND,
+  OP_BIT_OR,
+  OP_BIT_XOR,
+  OP_SHIFT_LEFT,
+  OP_SHIFT_RIGHT,
+  OP_BIT_NOT,
   OP_NOT,
   OP_PRINT,
   OP_POP,
@@ -35,6 +43,9 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  // OP_CALL in tail position, followed by OP_RETURN: reuses the caller's
+  // frame when the callee is a Lox function.
+  OP_TAIL_CALL,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_CLASS,
@@ -43,20 +54,89 @@ typedef enum {
   OP_METHOD,
   OP_INVOKE,
   OP_SUPER_INVOKE,
+  // OP_INVOKE and OP_SUPER_INVOKE in tail position, as with OP_TAIL_CALL.
+  OP_TAIL_INVOKE,
+  OP_TAIL_SUPER_INVOKE,
   OP_INHERIT,
+
+  // Superinstructions emitted by the compiler's peephole pass.
+  OP_GET_LOCAL_PROPERTY,
+  OP_ADD_LOCALS,
+  OP_ADD_CONSTANT,
+  OP_SUBTRACT_CONSTANT,
+  OP_LESS_CONSTANT,
+  OP_POP_JUMP_IF_FALSE,
+  // Three-address instructions operating directly on frame slots, emitted in
+  // register mode. Operands: destination slot, then source slots/constants.
+  OP_MOVE,
+  OP_LOAD_CONSTANT,
+  OP_ADD_RR,
+  OP_ADD_RK,
+  OP_SUBTRACT_RK,
+  OP_JUMP_IF_NOT_LESS_RR,
+  OP_JUMP_IF_NOT_LESS_RK,
+  // Quickened instructions, never emitted by the compiler: the interpreter
+  // rewrites a generic instruction in place to one of these once it has seen
+  // its operand types, and back when they no longer match.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_EQUAL_NUM,
 } opcode_t;
 
+// Up to this many receiver types are cached per site; beyond that the site
+// is megamorphic and always takes the slow path.
+#define INLINE_CACHE_WAYS 4
+
+// One cached receiver type of a property access or invocation site. Entries
+// are keyed on the receiver's class and shape (shape is NULL for
+// OP_SUPER_INVOKE, which is keyed on the superclass alone).
+typedef struct {
+  struct obj_class_t* klass;
+  int version; // klass->method_version when the entry was filled
+  struct obj_shape_t* shape;
+  struct obj_shape_t* new_shape; // shape after the store, for OP_SET_PROPERTY
+  int slot; // field slot, or -1 if the name resolved to a method
+  struct obj_closure_t* method;
+} cache_entry_t;
+
+typedef struct {
+  int count;
+  cache_entry_t entries[INLINE_CACHE_WAYS];
+} inline_cache_t;
+
+// Per-loop state of the tracing JIT, indexed by the two-byte operand that
+// follows OP_LOOP's jump offset.
+typedef struct {
+  int hotness; // back-edges taken so far
+  int aborts; // recordings that failed
+  void* trace; // native code of the loop's trace, or NULL
+  size_t trace_size;
+} loop_t;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
   int* lines;
   value_array_t constants;
+  // Inline caches, indexed by the two-byte operand that follows the other
+  // operands of OP_GET_PROPERTY, OP_SET_PROPERTY, OP_INVOKE,
+  // OP_SUPER_INVOKE and OP_GET_LOCAL_PROPERTY.
+  int cache_count;
+  int cache_capacity;
+  inline_cache_t* caches;
+  int loop_count;
+  int loop_capacity;
+  loop_t* loops;
 } chunk_t;
 
 void chunk_init(chunk_t *chunk);
 void chunk_free(chunk_t *chunk);
 void chunk_write(chunk_t *chunk, uint8_t byte, int line);
 int chunk_add_constant(chunk_t *chunk, value_t value);
+int chunk_add_cache(chunk_t *chunk);
+int chunk_add_loop(chunk_t *chunk);
+int chunk_instruction_length(chunk_t *chunk, int offset);
+uint8_t chunk_generic_op(uint8_t op);
 
 #endif // _CLOX_CHUNK_H
@@ -7,9 +7,11 @@
 #include <string.h>
 
 #include "debug.h"
+#include "ir.h"
 #include "limits.h"
 #include "memory.h"
 #include "scanner.h"
+#include "vm.h"
 #include "value.h"
 
 typedef struct {
@@ -26,6 +28,10 @@ typedef enum {
   PREC_AND,
   PREC_EQUALITY,
   PREC_COMPARISON,
+  PREC_BIT_OR,
+  PREC_BIT_XOR,
+  PREC_BIT_AND,
+  PREC_SHIFT,
   PREC_TERM,
   PREC_FACTOR,
   PREC_UNARY,
@@ -59,6 +65,8 @@ typedef struct {
   bool is_local;
 } upvalue_t;
 
+#define RECENT_INSTRUCTIONS 3
+
 typedef struct compiler_t {
   struct compiler_t* enclosing;
   obj_function_t* function;
@@ -68,6 +76,13 @@ typedef struct compiler_t {
   int local_count;
   upvalue_t upvalues[UINT8_COUNT];
   int scope_depth;
+
+  // Offsets of the most recent instructions emitted since the last jump
+  // target, newest first, or -1. Used by the peephole pass.
+  int recent[RECENT_INSTRUCTIONS];
+  // Set after code that never falls through, such as a return, until a jump
+  // emitted before it lands. Nothing is emitted while it is set.
+  bool unreachable;
 } compiler_t;
 
 typedef struct class_compiler_t {
@@ -79,6 +94,8 @@ typedef struct class_compiler_t {
 // Forward declarations.
 static void compiler_init(compiler_t* compiler, function_type_t type);
 static obj_function_t* compiler_end();
+static void recognize_inline(obj_function_t* function);
+static bool inline_operand(const uint8_t* instruction, uint16_t* operand);
 static void advance();
 static void consume(token_type_t type, const char* message);
 static bool match(token_type_t type);
@@ -88,17 +105,33 @@ static void error(const char* message);
 static void error_at(token_t* token, const char* message);
 static chunk_t* current_chunk();
 static void emit_byte(uint8_t byte);
-static void emit_bytes(uint8_t byte1, uint8_t byte2);
+static void emit_op(uint8_t op);
+static void emit_bytes(uint8_t op, uint8_t operand);
+static int recent_op(int n);
+static uint8_t recent_operand(int n, int i);
+static void replace_recent(int n, const uint8_t* bytes, int length, int line);
+static void drop_recent(int n);
+static bool recent_constant(int n, value_t* value);
+static bool fold_constants(uint8_t op);
+static int constant_condition();
+static void unreachable_statement();
+static bool peephole(uint8_t op);
+static bool lower_store();
+static bool lower_branch();
 static void emit_return();
 static void emit_constant(value_t value);
 static int emit_jump(uint8_t instruction);
 static void patch_jump(int offset);
 static void emit_loop(int loop_start);
+static int mark_jump_target();
+static void emit_cache();
 static uint8_t make_constant(value_t value);
 static uint8_t identifier_constant(token_t* name);
-static uint8_t parse_variable(const char* error_message);
+static int parse_variable(const char* error_message);
+static int global_variable(token_t* name);
+static void emit_global(uint8_t op, int slot);
 static uint8_t argument_list();
-static void define_variable(uint8_t global);
+static void define_variable(int global);
 static void declare_variable();
 static void mark_initialized();
 static void add_local(token_t name);
@@ -142,6 +175,11 @@ static void scope_begin();
 static void scope_end();
 static token_t synthetic_token(const char* text);
 
+compiler_options_t compiler_options = {
+  .register_code = true,
+  .optimize = false,
+};
+
 parser_t parser;
 compiler_t* current = NULL;
 class_compiler_t* current_class = NULL;
@@ -159,6 +197,10 @@ parse_rule_t rules[] = {
   [TOKEN_SEMICOLON]     = { NULL,     NULL,   PREC_NONE },
   [TOKEN_SLASH]         = { NULL,     binary, PREC_FACTOR },
   [TOKEN_PERCENT]       = { NULL,     binary, PREC_FACTOR },
+  [TOKEN_AMPERSAND]     = { NULL,     binary, PREC_BIT_AND },
+  [TOKEN_PIPE]          = { NULL,     binary, PREC_BIT_OR },
+  [TOKEN_CARET]         = { NULL,     binary, PREC_BIT_XOR },
+  [TOKEN_TILDE]         = { unary,    NULL,   PREC_NONE },
   [TOKEN_STAR]          = { NULL,     binary, PREC_FACTOR },
   [TOKEN_BANG]          = { unary,    NULL,   PREC_NONE },
   [TOKEN_BANG_EQUAL]    = { NULL,     binary, PREC_EQUALITY },
@@ -166,8 +208,10 @@ parse_rule_t rules[] = {
   [TOKEN_EQUAL_EQUAL]   = { NULL,     binary, PREC_EQUALITY },
   [TOKEN_GREATER]       = { NULL,     binary, PREC_COMPARISON },
   [TOKEN_GREATER_EQUAL] = { NULL,     binary, PREC_COMPARISON },
+  [TOKEN_GREATER_GREATER] = { NULL,   binary, PREC_SHIFT },
   [TOKEN_LESS]          = { NULL,     binary, PREC_COMPARISON },
   [TOKEN_LESS_EQUAL]    = { NULL,     binary, PREC_COMPARISON },
+  [TOKEN_LESS_LESS]     = { NULL,     binary, PREC_SHIFT },
   [TOKEN_IDENTIFIER]    = { variable, NULL,   PREC_NONE },
   [TOKEN_STRING]        = { string,   NULL,   PREC_NONE },
   [TOKEN_NUMBER]        = { number,   NULL,   PREC_NONE },
@@ -224,11 +268,18 @@ static void compiler_init(compiler_t* compiler, function_type_t type) {
   compiler->type = type;
   compiler->local_count = 0;
   compiler->scope_depth = 0;
+  for (int i = 0; i < RECENT_INSTRUCTIONS; i++) {
+    compiler->recent[i] = -1;
+  }
+  compiler->unreachable = false;
   compiler->function = function_new();
   current = compiler;
 
   if (type != TYPE_SCRIPT) {
-    current->function->name = string_copy(parser.previous.start, parser.previous.length);
+    obj_string_t* name = string_copy(parser.previous.start, parser.previous.length);
+    write_barrier_prepare(&current->function->obj);
+    current->function->name = name;
+    write_barrier_object(&current->function->obj, &current->function->name->obj);
   }
 
   local_t* local = &current->locals[current->local_count++];
@@ -246,6 +297,11 @@ static void compiler_init(compiler_t* compiler, function_type_t type) {
 static obj_function_t* compiler_end() {
   emit_return();
   obj_function_t* function = current->function;
+  if (compiler_options.optimize && !parser.had_error) {
+    write_barrier_prepare(&function->obj);
+    ir_optimize(function);
+  }
+  recognize_inline(function);
 #ifdef DEBUG_PRINT_CODE
   if (!parser.had_error) {
     disasm_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
@@ -255,6 +311,101 @@ static obj_function_t* compiler_end() {
   return function;
 }
 
+// Fills in function->inline_body if the function's code is one of the
+// patterns below, each ending with the only OP_RETURN.
+static void recognize_inline(obj_function_t* function) {
+  chunk_t* chunk = &function->chunk;
+  uint8_t* code[4];
+  int count = 0;
+  for (int offset = 0; offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+    if (count == 4) {
+      return;
+    }
+    code[count++] = &chunk->code[offset];
+  }
+  if (*code[count - 1] != OP_RETURN) {
+    return;
+  }
+
+  inline_body_t body = {.kind = INLINE_NONE};
+  switch (count) {
+    case 2:
+      // return a; return a + b; return this.field;
+      if (inline_operand(code[0], &body.a)) {
+        body.kind = INLINE_OPERAND;
+      } else if (*code[0] == OP_ADD_LOCALS) {
+        body = (inline_body_t){.kind = INLINE_BINARY, .op = OP_ADD, .a = code[0][1], .b = code[0][2]};
+      } else if (*code[0] == OP_GET_LOCAL_PROPERTY) {
+        body = (inline_body_t){
+            .kind = INLINE_FIELD, .a = code[0][1], .b = code[0][2], .cache = (code[0][3] << 8) | code[0][4]};
+      }
+      break;
+    case 3:
+      // return a.field; return a + constant;
+      if (*code[0] != OP_GET_LOCAL && *code[0] != OP_CONSTANT) {
+        break;
+      }
+      inline_operand(code[0], &body.a);
+      switch (*code[1]) {
+        case OP_GET_PROPERTY:
+          if (*code[0] == OP_GET_LOCAL) {
+            body.kind = INLINE_FIELD;
+            body.b = code[1][1];
+            body.cache = (code[1][2] << 8) | code[1][3];
+          }
+          break;
+        case OP_ADD_CONSTANT:
+          body = (inline_body_t){.kind = INLINE_BINARY, .op = OP_ADD, .a = body.a, .b = code[1][1] | INLINE_CONSTANT};
+          break;
+        case OP_SUBTRACT_CONSTANT:
+          body = (inline_body_t){.kind = INLINE_BINARY, .op = OP_SUBTRACT, .a = body.a, .b = code[1][1] | INLINE_CONSTANT};
+          break;
+        case OP_LESS_CONSTANT:
+          body = (inline_body_t){.kind = INLINE_BINARY, .op = OP_LESS, .a = body.a, .b = code[1][1] | INLINE_CONSTANT};
+          break;
+      }
+      break;
+    case 4:
+      // return a op b;
+      if (!inline_operand(code[0], &body.a) || !inline_operand(code[1], &body.b)) {
+        break;
+      }
+      switch (*code[2]) {
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+          body.kind = INLINE_BINARY;
+          body.op = *code[2];
+          break;
+      }
+      break;
+  }
+  // Any other slot would be a local, which these bodies never assign.
+  if ((!(body.a & INLINE_CONSTANT) && body.a > function->arity) ||
+      (body.kind == INLINE_BINARY && !(body.b & INLINE_CONSTANT) && body.b > function->arity)) {
+    return;
+  }
+  function->inline_body = body;
+}
+
+// Reads the operand an OP_GET_LOCAL or OP_CONSTANT pushes.
+static bool inline_operand(const uint8_t* instruction, uint16_t* operand) {
+  switch (instruction[0]) {
+    case OP_GET_LOCAL:
+      *operand = instruction[1];
+      return true;
+    case OP_CONSTANT:
+      *operand = instruction[1] | INLINE_CONSTANT;
+      return true;
+    default:
+      return false;
+  }
+}
+
 static void advance() {
   parser.previous = parser.current;
   for (;;) {
@@ -316,37 +467,363 @@ static chunk_t* current_chunk() {
 }
 
 static void emit_byte(uint8_t byte) {
+  if (current->unreachable) {
+    return;
+  }
   chunk_write(current_chunk(), byte, parser.previous.line);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2) {
-  emit_byte(byte1);
-  emit_byte(byte2);
+static void emit_op(uint8_t op) {
+  if (current->unreachable || peephole(op)) {
+    return;
+  }
+  for (int i = RECENT_INSTRUCTIONS - 1; i > 0; i--) {
+    current->recent[i] = current->recent[i - 1];
+  }
+  current->recent[0] = current_chunk()->count;
+  emit_byte(op);
+}
+
+static void emit_bytes(uint8_t op, uint8_t operand) {
+  emit_op(op);
+  emit_byte(operand);
+}
+
+// Opcode of the n-th most recent instruction, or -1 if there is none since
+// the last jump target.
+static int recent_op(int n) {
+  int offset = current->recent[n];
+  return offset == -1 ? -1 : current_chunk()->code[offset];
+}
+
+// Operand byte i of the n-th most recent instruction.
+static uint8_t recent_operand(int n, int i) {
+  return current_chunk()->code[current->recent[n] + 1 + i];
+}
+
+// Replaces the n-th most recent instruction and everything after it with a
+// single instruction, attributed to the given source line.
+static void replace_recent(int n, const uint8_t* bytes, int length, int line) {
+  chunk_t* chunk = current_chunk();
+  int start = current->recent[n];
+  for (int i = 0; i < length; i++) {
+    chunk->code[start + i] = bytes[i];
+    chunk->lines[start + i] = line;
+  }
+  chunk->count = start + length;
+
+  current->recent[0] = start;
+  for (int i = 1; i < RECENT_INSTRUCTIONS; i++) {
+    current->recent[i] = n + i < RECENT_INSTRUCTIONS ? current->recent[n + i] : -1;
+  }
+}
+
+// Removes the n most recent instructions, along with their constants if
+// those are the last ones in the pool.
+static void drop_recent(int n) {
+  chunk_t* chunk = current_chunk();
+  for (int i = 0; i < n; i++) {
+    if (recent_op(i) == OP_CONSTANT && recent_operand(i, 0) == chunk->constants.count - 1) {
+      chunk->constants.count--;
+    }
+  }
+  chunk->count = current->recent[n - 1];
+
+  for (int i = 0; i < RECENT_INSTRUCTIONS; i++) {
+    current->recent[i] = n + i < RECENT_INSTRUCTIONS ? current->recent[n + i] : -1;
+  }
+}
+
+// Returns true and the value if the n-th most recent instruction pushes a
+// constant.
+static bool recent_constant(int n, value_t* value) {
+  switch (recent_op(n)) {
+    case OP_CONSTANT:
+      *value = current_chunk()->constants.values[recent_operand(n, 0)];
+      return true;
+    case OP_NIL:
+      *value = NIL_VAL;
+      return true;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Evaluates op at compile time if the instructions just emitted push
+// constants for all of its operands, and replaces them with the result.
+// Operations that would raise a runtime error are left to the VM.
+static bool fold_constants(uint8_t op) {
+  value_t a, b, result;
+  switch (op) {
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_BIT_NOT:
+      if (!recent_constant(0, &a)) {
+        return false;
+      }
+      if (op == OP_NOT) {
+        result = BOOL_VAL(IS_NIL(a) || (IS_BOOL(a) && !AS_BOOL(a)));
+      } else if (!IS_NUMBER(a)) {
+        return false;
+      } else if (op == OP_NEGATE) {
+        result = num_to_narrow_value(-AS_NUMBER(a));
+      } else if (num_is_int32(AS_NUMBER(a))) {
+        result = INT_VAL(~(int32_t)AS_NUMBER(a));
+      } else {
+        return false;
+      }
+      drop_recent(1);
+      break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+      if (!recent_constant(1, &a) || !recent_constant(0, &b)) {
+        return false;
+      }
+      if (op == OP_EQUAL) {
+        result = BOOL_VAL(values_equal(a, b));
+      } else if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        result = OBJ_VAL(string_concatenate(AS_STRING(a), AS_STRING(b)));
+      } else if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+      } else {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (op) {
+          case OP_GREATER:  result = BOOL_VAL(x > y); break;
+          case OP_LESS:     result = BOOL_VAL(x < y); break;
+          case OP_ADD:      result = num_to_narrow_value(x + y); break;
+          case OP_SUBTRACT: result = num_to_narrow_value(x - y); break;
+          case OP_MULTIPLY: result = num_to_narrow_value(x * y); break;
+          case OP_DIVIDE:   result = num_to_narrow_value(x / y); break;
+          default:
+            // The VM truncates the operands of % to ints. Leave anything
+            // that does not fit, or that would trap, to it.
+            if (!(x > -2147483648.0 && x < 2147483648.0) ||
+                !(y > -2147483648.0 && y < 2147483648.0) || (int)y == 0) {
+              return false;
+            }
+            result = INT_VAL((int)x % (int)y);
+            break;
+        }
+      }
+      // The result, if it is a new string, is not reachable until it is
+      // added to the pool, but dropping the operands allocates nothing.
+      drop_recent(2);
+      break;
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT: {
+      if (!recent_constant(1, &a) || !recent_constant(0, &b) || !IS_NUMBER(a) || !IS_NUMBER(b) ||
+          !num_is_int32(AS_NUMBER(a)) || !num_is_int32(AS_NUMBER(b))) {
+        return false;
+      }
+      int32_t x = (int32_t)AS_NUMBER(a);
+      int32_t y = (int32_t)AS_NUMBER(b);
+      switch (op) {
+        case OP_BIT_AND:    result = INT_VAL(x & y); break;
+        case OP_BIT_OR:     result = INT_VAL(x | y); break;
+        case OP_BIT_XOR:    result = INT_VAL(x ^ y); break;
+        case OP_SHIFT_LEFT: result = INT_VAL((int32_t)((uint32_t)x << (y & 31))); break;
+        default:            result = INT_VAL(x >> (y & 31)); break;
+      }
+      drop_recent(2);
+      break;
+    }
+    default:
+      return false;
+  }
+
+  if (IS_NIL(result)) {
+    emit_op(OP_NIL);
+  } else if (IS_BOOL(result)) {
+    emit_op(AS_BOOL(result) ? OP_TRUE : OP_FALSE);
+  } else {
+    emit_constant(result);
+  }
+  return true;
+}
+
+// If the condition just compiled is a constant, removes it and returns 1 if
+// it is truthy and 0 if it is falsey. Returns -1 otherwise.
+static int constant_condition() {
+  value_t value;
+  if (current->unreachable || !recent_constant(0, &value)) {
+    return -1;
+  }
+  drop_recent(1);
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)) ? 0 : 1;
+}
+
+// Compiles a statement that can never run, checking it for errors without
+// emitting any code.
+static void unreachable_statement() {
+  bool unreachable = current->unreachable;
+  current->unreachable = true;
+  statement();
+  current->unreachable = unreachable;
+}
+
+// Folds op into the instructions just emitted if together they form a
+// superinstruction or, in register mode, a three-address instruction, or
+// if op can be evaluated at compile time.
+// Returns true if op was absorbed; any operand bytes of op are still emitted
+// by the caller and land after the fused instruction.
+static bool peephole(uint8_t op) {
+  if (fold_constants(op)) {
+    return true;
+  }
+  int line = parser.previous.line;
+  switch (op) {
+    case OP_ADD:
+      if (recent_op(1) == OP_GET_LOCAL && recent_op(0) == OP_GET_LOCAL) {
+        // GET_LOCAL a, GET_LOCAL b, ADD => ADD_LOCALS a b
+        uint8_t fused[] = {OP_ADD_LOCALS, recent_operand(1, 0), recent_operand(0, 0)};
+        replace_recent(1, fused, 3, line);
+        return true;
+      }
+      if (recent_op(0) == OP_CONSTANT) {
+        uint8_t fused[] = {OP_ADD_CONSTANT, recent_operand(0, 0)};
+        replace_recent(0, fused, 2, line);
+        return true;
+      }
+      return false;
+    case OP_SUBTRACT:
+    case OP_LESS:
+      if (recent_op(0) == OP_CONSTANT) {
+        // CONSTANT k, op => op_CONSTANT k
+        uint8_t fused[] = {op == OP_LESS ? OP_LESS_CONSTANT : OP_SUBTRACT_CONSTANT, recent_operand(0, 0)};
+        replace_recent(0, fused, 2, line);
+        return true;
+      }
+      return false;
+    case OP_GET_PROPERTY:
+      if (recent_op(0) == OP_GET_LOCAL) {
+        // GET_LOCAL slot, GET_PROPERTY name => GET_LOCAL_PROPERTY slot name
+        uint8_t fused[] = {OP_GET_LOCAL_PROPERTY, recent_operand(0, 0)};
+        replace_recent(0, fused, 2, line);
+        return true;
+      }
+      return false;
+    case OP_POP:
+      return compiler_options.register_code && lower_store();
+    case OP_POP_JUMP_IF_FALSE:
+      return compiler_options.register_code && lower_branch();
+    default:
+      return false;
+  }
+}
+
+// SET_LOCAL dst, POP after an expression whose operands are all locals or
+// constants => one three-address instruction writing straight to dst.
+static bool lower_store() {
+  if (recent_op(0) != OP_SET_LOCAL) {
+    return false;
+  }
+  uint8_t dst = recent_operand(0, 0);
+  int line = current_chunk()->lines[current->recent[0]];
+
+  switch (recent_op(1)) {
+    case OP_GET_LOCAL: {
+      uint8_t lowered[] = {OP_MOVE, dst, recent_operand(1, 0)};
+      replace_recent(1, lowered, 3, line);
+      return true;
+    }
+    case OP_CONSTANT: {
+      uint8_t lowered[] = {OP_LOAD_CONSTANT, dst, recent_operand(1, 0)};
+      replace_recent(1, lowered, 3, line);
+      return true;
+    }
+    case OP_ADD_LOCALS: {
+      line = current_chunk()->lines[current->recent[1]];
+      uint8_t lowered[] = {OP_ADD_RR, dst, recent_operand(1, 0), recent_operand(1, 1)};
+      replace_recent(1, lowered, 4, line);
+      return true;
+    }
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT: {
+      if (recent_op(2) != OP_GET_LOCAL) {
+        return false;
+      }
+      line = current_chunk()->lines[current->recent[1]];
+      uint8_t lowered[] = {
+        recent_op(1) == OP_ADD_CONSTANT ? OP_ADD_RK : OP_SUBTRACT_RK,
+        dst, recent_operand(2, 0), recent_operand(1, 0),
+      };
+      replace_recent(2, lowered, 4, line);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// A local compared against a local or constant followed by a conditional
+// jump => one compare-and-branch instruction. The caller appends the jump
+// offset.
+static bool lower_branch() {
+  if (recent_op(0) == OP_LESS_CONSTANT && recent_op(1) == OP_GET_LOCAL) {
+    int line = current_chunk()->lines[current->recent[0]];
+    uint8_t lowered[] = {OP_JUMP_IF_NOT_LESS_RK, recent_operand(1, 0), recent_operand(0, 0)};
+    replace_recent(1, lowered, 3, line);
+    return true;
+  }
+  if (recent_op(0) == OP_LESS && recent_op(1) == OP_GET_LOCAL && recent_op(2) == OP_GET_LOCAL) {
+    int line = current_chunk()->lines[current->recent[0]];
+    uint8_t lowered[] = {OP_JUMP_IF_NOT_LESS_RR, recent_operand(2, 0), recent_operand(1, 0)};
+    replace_recent(2, lowered, 3, line);
+    return true;
+  }
+  return false;
 }
 
 static void emit_return() {
   if (current->type == TYPE_INITIALIZER) {
     emit_bytes(OP_GET_LOCAL, 0);
   } else {
-    emit_byte(OP_NIL);
+    emit_op(OP_NIL);
   }
-  emit_byte(OP_RETURN);
+  emit_op(OP_RETURN);
 }
 
 static void emit_constant(value_t value) {
   emit_bytes(OP_CONSTANT, make_constant(value));
 }
 
+// Returns the offset of the jump's operand, or -1 if it is unreachable and
+// was not emitted.
 static int emit_jump(uint8_t instruction) {
-  emit_byte(instruction);
+  if (current->unreachable) {
+    return -1;
+  }
+  emit_op(instruction);
   emit_byte(0xff);
   emit_byte(0xff);
   return current_chunk()->count - 2;
 }
 
+// Points the jump at offset to the next instruction, which is reachable
+// through it.
 static void patch_jump(int offset) {
+  if (offset == -1) {
+    return;
+  }
+  current->unreachable = false;
   // -2 adjusts for bytecode of the jump offset itself
-  int jump = current_chunk()->count - offset - 2;
+  int jump = mark_jump_target() - offset - 2;
   if (jump > UINT16_MAX) {
     error("too much code to jump over");
   }
@@ -355,16 +832,52 @@ static void patch_jump(int offset) {
   current_chunk()->code[offset + 1] = jump & 0xff;
 }
 
+// Allocates an inline cache for the instruction just emitted and emits its
+// index.
+static void emit_cache() {
+  if (current->unreachable) {
+    return;
+  }
+  write_barrier_prepare(&current->function->obj);
+  int index = chunk_add_cache(current_chunk());
+  if (index > UINT16_MAX) {
+    error("too many property accesses in one chunk");
+  }
+  emit_byte((index >> 8) & 0xff);
+  emit_byte(index & 0xff);
+}
+
+// Emits the back-edge of a loop. The jump offset is relative to the end of
+// the instruction, after the loop index operand.
 static void emit_loop(int loop_start) {
-  emit_byte(OP_LOOP);
+  if (current->unreachable) {
+    return;
+  }
+  emit_op(OP_LOOP);
 
-  int offset = current_chunk()->count - loop_start + 2;
+  int offset = current_chunk()->count - loop_start + 4;
   if (offset > UINT16_MAX) {
     error("loop body too large");
   }
 
   emit_byte((offset >> 8) & 0xff);
   emit_byte(offset & 0xff);
+
+  int index = chunk_add_loop(current_chunk());
+  if (index > UINT16_MAX) {
+    error("too many loops in one chunk");
+  }
+  emit_byte((index >> 8) & 0xff);
+  emit_byte(index & 0xff);
+}
+
+// Returns the offset of the next instruction and makes sure the peephole pass
+// never fuses across it, since a jump may land there.
+static int mark_jump_target() {
+  for (int i = 0; i < RECENT_INSTRUCTIONS; i++) {
+    current->recent[i] = -1;
+  }
+  return current_chunk()->count;
 }
 
 static uint8_t identifier_constant(token_t* name) {
@@ -372,7 +885,13 @@ static uint8_t identifier_constant(token_t* name) {
 }
 
 static uint8_t make_constant(value_t value) {
+  if (current->unreachable) {
+    // Nothing will refer to it.
+    return 0;
+  }
+  write_barrier_prepare(&current->function->obj);
   int index = chunk_add_constant(current_chunk(), value);
+  write_barrier(&current->function->obj, value);
   if (index > UINT8_MAX) {
     error("too many constants in one chunk");
     return 0;
@@ -380,7 +899,8 @@ static uint8_t make_constant(value_t value) {
   return (uint8_t)index;
 }
 
-static uint8_t parse_variable(const char* error_message) {
+// Returns the global slot of the variable, or 0 for a local.
+static int parse_variable(const char* error_message) {
   consume(TOKEN_IDENTIFIER, error_message);
 
   declare_variable();
@@ -388,7 +908,22 @@ static uint8_t parse_variable(const char* error_message) {
     return 0;
   }
 
-  return identifier_constant(&parser.previous);
+  return global_variable(&parser.previous);
+}
+
+static int global_variable(token_t* name) {
+  int slot = global_slot(string_copy(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("too many global variables");
+    return 0;
+  }
+  return slot;
+}
+
+static void emit_global(uint8_t op, int slot) {
+  emit_op(op);
+  emit_byte((slot >> 8) & 0xff);
+  emit_byte(slot & 0xff);
 }
 
 static uint8_t argument_list() {
@@ -406,13 +941,13 @@ static uint8_t argument_list() {
   return arg_count;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(int global) {
   if (current->scope_depth > 0) {
     mark_initialized();
     return;
   }
 
-  emit_bytes(OP_DEFINE_GLOBAL, global);
+  emit_global(OP_DEFINE_GLOBAL, global);
 }
 
 static void declare_variable() {
@@ -546,13 +1081,13 @@ static void expression() {
 static void number(bool can_assign) {
   (void)can_assign; // unused
   double value = strtod(parser.previous.start, NULL);
-  emit_constant(NUMBER_VAL(value));
+  emit_constant(num_to_narrow_value(value));
 }
 
 static void and_(bool can_assign) {
   (void)can_assign; // unused
   int end_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
   parse_precedence(PREC_AND);
   patch_jump(end_jump);
 }
@@ -563,7 +1098,7 @@ static void or_(bool can_assign) {
   int end_jump = emit_jump(OP_JUMP);
 
   patch_jump(else_jump);
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
 
   parse_precedence(PREC_OR);
   patch_jump(end_jump);
@@ -580,8 +1115,9 @@ static void unary(bool can_assign) {
   token_type_t operator_type = parser.previous.type;
   parse_precedence(PREC_UNARY);
   switch (operator_type) {
-    case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
-    case TOKEN_BANG: emit_byte(OP_NOT); break;
+    case TOKEN_MINUS: emit_op(OP_NEGATE); break;
+    case TOKEN_BANG: emit_op(OP_NOT); break;
+    case TOKEN_TILDE: emit_op(OP_BIT_NOT); break;
     default: return;
   }
 }
@@ -592,17 +1128,22 @@ static void binary(bool can_assign) {
   parse_rule_t* rule = get_rule(operator_type);
   parse_precedence((precedence_t)(rule->precedence + 1));
   switch (operator_type) {
-    case TOKEN_PLUS:          emit_byte(OP_ADD); break;
-    case TOKEN_MINUS:         emit_byte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emit_byte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emit_byte(OP_DIVIDE); break;
-    case TOKEN_PERCENT:       emit_byte(OP_MODULO); break;
-    case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emit_bytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emit_byte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emit_bytes(OP_GREATER, OP_NOT); break;
+    case TOKEN_PLUS:          emit_op(OP_ADD); break;
+    case TOKEN_MINUS:         emit_op(OP_SUBTRACT); break;
+    case TOKEN_STAR:          emit_op(OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emit_op(OP_DIVIDE); break;
+    case TOKEN_PERCENT:       emit_op(OP_MODULO); break;
+    case TOKEN_AMPERSAND:     emit_op(OP_BIT_AND); break;
+    case TOKEN_PIPE:          emit_op(OP_BIT_OR); break;
+    case TOKEN_CARET:         emit_op(OP_BIT_XOR); break;
+    case TOKEN_LESS_LESS:     emit_op(OP_SHIFT_LEFT); break;
+    case TOKEN_GREATER_GREATER: emit_op(OP_SHIFT_RIGHT); break;
+    case TOKEN_BANG_EQUAL:    emit_op(OP_EQUAL); emit_op(OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL:   emit_op(OP_EQUAL); break;
+    case TOKEN_GREATER:       emit_op(OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emit_op(OP_LESS); emit_op(OP_NOT); break;
+    case TOKEN_LESS:          emit_op(OP_LESS); break;
+    case TOKEN_LESS_EQUAL:    emit_op(OP_GREATER); emit_op(OP_NOT); break;
     default: return;
   }
 }
@@ -610,9 +1151,9 @@ static void binary(bool can_assign) {
 static void literal(bool can_assign) {
   (void)can_assign; // unused
   switch (parser.previous.type) {
-    case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-    case TOKEN_TRUE: emit_byte(OP_TRUE); break;
-    case TOKEN_NIL: emit_byte(OP_NIL); break;
+    case TOKEN_FALSE: emit_op(OP_FALSE); break;
+    case TOKEN_TRUE: emit_op(OP_TRUE); break;
+    case TOKEN_NIL: emit_op(OP_NIL); break;
     default: return;
   }
 }
@@ -635,12 +1176,15 @@ static void dot(bool can_assign) {
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
     emit_bytes(OP_SET_PROPERTY, name);
+    emit_cache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list();
     emit_bytes(OP_INVOKE, name);
     emit_byte(arg_count);
+    emit_cache();
   } else {
     emit_bytes(OP_GET_PROPERTY, name);
+    emit_cache();
   }
 }
 
@@ -673,6 +1217,7 @@ static void super_(bool can_assign) {
     named_variable(synthetic_token("super"), false);
     emit_bytes(OP_SUPER_INVOKE, name);
     emit_byte(argument_count);
+    emit_cache();
   } else {
     named_variable(synthetic_token("super"), false);
     emit_bytes(OP_GET_SUPER, name);
@@ -700,9 +1245,10 @@ static void class_declaration() {
   token_t class_name = parser.previous;
   uint8_t name_constant = identifier_constant(&parser.previous);
   declare_variable();
+  int global = current->scope_depth > 0 ? 0 : global_variable(&parser.previous);
 
   emit_bytes(OP_CLASS, name_constant);
-  define_variable(name_constant);
+  define_variable(global);
 
   class_compiler_t class_compiler;
   class_compiler.name = parser.previous;
@@ -723,7 +1269,7 @@ static void class_declaration() {
     define_variable(0);
 
     named_variable(class_name, false);
-    emit_byte(OP_INHERIT);
+    emit_op(OP_INHERIT);
     class_compiler.has_superclass = true;
   }
 
@@ -733,7 +1279,7 @@ static void class_declaration() {
     method();
   }
   consume(TOKEN_RIGHT_BRACE, "expected } after class body");
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
 
   if (class_compiler.has_superclass) {
     scope_end();
@@ -755,7 +1301,7 @@ static void method() {
 }
 
 static void fun_declaration() {
-  uint8_t global = parse_variable("expected function name");
+  int global = parse_variable("expected function name");
   mark_initialized();
   function(TYPE_FUNCTION);
   define_variable(global);
@@ -784,7 +1330,7 @@ static void statement() {
 static void print_statement() {
   expression();
   consume(TOKEN_SEMICOLON, "expected ; after value in print statement");
-  emit_byte(OP_PRINT);
+  emit_op(OP_PRINT);
 }
 
 static void if_statement() {
@@ -792,14 +1338,30 @@ static void if_statement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "expected ) after condition in if");
 
-  int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  int condition = constant_condition();
+  if (condition != -1) {
+    // Only one branch can ever run.
+    if (condition) {
+      statement();
+    } else {
+      unreachable_statement();
+    }
+    if (match(TOKEN_ELSE)) {
+      if (condition) {
+        unreachable_statement();
+      } else {
+        statement();
+      }
+    }
+    return;
+  }
+
+  int then_jump = emit_jump(OP_POP_JUMP_IF_FALSE);
   statement();
 
   int else_jump = emit_jump(OP_JUMP);
 
   patch_jump(then_jump);
-  emit_byte(OP_POP);
 
   if (match(TOKEN_ELSE)) {
     statement();
@@ -808,19 +1370,27 @@ static void if_statement() {
 }
 
 static void while_statement() {
-  int loop_start = current_chunk()->count;
+  int loop_start = mark_jump_target();
 
   consume(TOKEN_LEFT_PAREN, "expected ( after while");
   expression();
   consume(TOKEN_RIGHT_PAREN, "expected ) after conidtion in while");
 
-  int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  int condition = constant_condition();
+  if (condition == 0) {
+    unreachable_statement();
+    return;
+  }
+
+  int exit_jump = condition == 1 ? -1 : emit_jump(OP_POP_JUMP_IF_FALSE);
   statement();
   emit_loop(loop_start);
 
+  if (exit_jump == -1) {
+    // There is no break, so an endless loop can only be left by returning.
+    current->unreachable = true;
+  }
   patch_jump(exit_jump);
-  emit_byte(OP_POP);
 }
 
 static void for_statement() {
@@ -835,21 +1405,36 @@ static void for_statement() {
     expression_statement();
   }
 
-  int loop_start = current_chunk()->count;
+  int loop_start = mark_jump_target();
   int exit_jump = -1;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "expected ; after loop condition");
 
-    exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP); // condition
+    int condition = constant_condition();
+    if (condition == 0) {
+      // Neither the increment nor the body can ever run.
+      bool unreachable = current->unreachable;
+      current->unreachable = true;
+      if (!match(TOKEN_RIGHT_PAREN)) {
+        expression();
+        consume(TOKEN_RIGHT_PAREN, "expect ) after for clauses");
+      }
+      statement();
+      current->unreachable = unreachable;
+      scope_end();
+      return;
+    }
+    if (condition == -1) {
+      exit_jump = emit_jump(OP_POP_JUMP_IF_FALSE);
+    }
   }
 
   if (!match(TOKEN_RIGHT_PAREN)) {
     int body_jump = emit_jump(OP_JUMP);
-    int increment_start = current_chunk()->count;
+    int increment_start = mark_jump_target();
     expression();
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     consume(TOKEN_RIGHT_PAREN, "expect ) after for clauses");
 
     emit_loop(loop_start);
@@ -862,7 +1447,9 @@ static void for_statement() {
 
   if (exit_jump != -1) {
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
+  } else {
+    // There is no break, so an endless loop can only be left by returning.
+    current->unreachable = true;
   }
 
   scope_end();
@@ -881,14 +1468,26 @@ static void return_statement() {
     }
     expression();
     consume(TOKEN_SEMICOLON, "expected ; after return value");
-    emit_byte(OP_RETURN);
+    int op = current->unreachable ? -1 : recent_op(0);
+    if (op == OP_CALL) {
+      uint8_t tail_call[] = {OP_TAIL_CALL, recent_operand(0, 0)};
+      replace_recent(0, tail_call, 2, current_chunk()->lines[current->recent[0]]);
+    } else if (op == OP_INVOKE || op == OP_SUPER_INVOKE) {
+      uint8_t tail_invoke[] = {
+        op == OP_INVOKE ? OP_TAIL_INVOKE : OP_TAIL_SUPER_INVOKE,
+        recent_operand(0, 0), recent_operand(0, 1), recent_operand(0, 2), recent_operand(0, 3),
+      };
+      replace_recent(0, tail_invoke, 5, current_chunk()->lines[current->recent[0]]);
+    }
+    emit_op(OP_RETURN);
   }
+  current->unreachable = true;
 }
 
 static void expression_statement() {
   expression();
   consume(TOKEN_SEMICOLON, "expected ; after expression");
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
 }
 
 static void function(function_type_t type) {
@@ -903,7 +1502,7 @@ static void function(function_type_t type) {
       if (current->function->arity > 255) {
         error_at_current("function can't have more than 255 parameter");
       }
-      uint8_t constant = parse_variable("expected parameter name");
+      int constant = parse_variable("expected parameter name");
       define_variable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -947,12 +1546,12 @@ static void synchronize() {
 }
 
 static void var_declaration() {
-  uint8_t global = parse_variable("expected variable name after var");
+  int global = parse_variable("expected variable name after var");
 
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
-    emit_byte(OP_NIL);
+    emit_op(OP_NIL);
   }
 
   consume(TOKEN_SEMICOLON, "expected ; after variable declaration");
@@ -975,9 +1574,14 @@ static void named_variable(token_t name, bool can_assign) {
     get_op = OP_GET_UPVALUE;
     set_op = OP_SET_UPVALUE;
   } else {
-    arg = identifier_constant(&name);
-    get_op = OP_GET_GLOBAL;
-    set_op = OP_SET_GLOBAL;
+    arg = global_variable(&name);
+    if (can_assign && match(TOKEN_EQUAL)) {
+      expression();
+      emit_global(OP_SET_GLOBAL, arg);
+    } else {
+      emit_global(OP_GET_GLOBAL, arg);
+    }
+    return;
   }
 
   if (can_assign && match(TOKEN_EQUAL)) {
@@ -1005,9 +1609,9 @@ static void scope_end() {
   while (current->local_count > 0 &&
          current->locals[current->local_count - 1].depth > current->scope_depth) {
     if (current->locals[current->local_count - 1].is_captured) {
-      emit_byte(OP_CLOSE_UPVALUE);
+      emit_op(OP_CLOSE_UPVALUE);
     } else {
-      emit_byte(OP_POP);
+      emit_op(OP_POP);
     }
     current->local_count--;
   }
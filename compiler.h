@@ -6,6 +6,16 @@
 #include "chunk.h"
 #include "object.h"
 
+typedef struct {
+  // Lower statements whose operands are locals and constants to
+  // three-address instructions on frame slots instead of stack code.
+  bool register_code;
+  // Rebuild each function through the SSA IR in ir.c and optimize it.
+  bool optimize;
+} compiler_options_t;
+
+extern compiler_options_t compiler_options;
+
 obj_function_t* compile(const char* source);
 void mark_compiler_roots();
 
@@ -3,12 +3,19 @@
 #include <stdio.h>
 
 #include "object.h"
+#include "vm.h"
 
 static int disasm_constant(const char* name, chunk_t* chunk, int offset);
 static int disasm_simple(const char* name, int offset);
 static int disasm_byte_instruction(const char* name, chunk_t* chunk, int offset);
 static int disasm_jump_instruction(const char* name, int sign, chunk_t* chunk, int offset);
+static int disasm_loop_instruction(const char* name, chunk_t* chunk, int offset);
 static int disasm_invoke_instruction(const char* name, chunk_t* chunk, int offset);
+static int disasm_two_byte_instruction(const char* name, chunk_t* chunk, int offset);
+static int disasm_global_instruction(const char* name, chunk_t* chunk, int offset);
+static int disasm_property_instruction(const char* name, chunk_t* chunk, int offset);
+static int disasm_local_property_instruction(const char* name, chunk_t* chunk, int offset);
+static int disasm_register_instruction(const char* name, const char* operands, chunk_t* chunk, int offset);
 
 void disasm_chunk(chunk_t* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -36,6 +43,12 @@ int disasm_instruction(chunk_t* chunk, int offset) {
     case OP_MULTIPLY: return disasm_simple("OP_MULTIPLY", offset);
     case OP_DIVIDE:   return disasm_simple("OP_DIVIDE", offset);
     case OP_MODULO:   return disasm_simple("OP_MODULO", offset);
+    case OP_BIT_AND:  return disasm_simple("OP_BIT_AND", offset);
+    case OP_BIT_OR:   return disasm_simple("OP_BIT_OR", offset);
+    case OP_BIT_XOR:  return disasm_simple("OP_BIT_XOR", offset);
+    case OP_SHIFT_LEFT:  return disasm_simple("OP_SHIFT_LEFT", offset);
+    case OP_SHIFT_RIGHT: return disasm_simple("OP_SHIFT_RIGHT", offset);
+    case OP_BIT_NOT:  return disasm_simple("OP_BIT_NOT", offset);
     case OP_NOT:      return disasm_simple("OP_NOT", offset);
     case OP_EQUAL:    return disasm_simple("OP_EQUAL", offset);
     case OP_GREATER:  return disasm_simple("OP_GREATER", offset);
@@ -43,11 +56,11 @@ int disasm_instruction(chunk_t* chunk, int offset) {
     case OP_PRINT:    return disasm_simple("OP_PRINT", offset);
     case OP_POP:      return disasm_simple("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-      return disasm_constant("OP_DEFINE_GLOBAL", chunk, offset);
+      return disasm_global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return disasm_constant("OP_GET_GLOBAL", chunk, offset);
+      return disasm_global_instruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return disasm_constant("OP_SET_GLOBAL", chunk, offset);
+      return disasm_global_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
       return disasm_byte_instruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -64,9 +77,11 @@ int disasm_instruction(chunk_t* chunk, int offset) {
     case OP_JUMP_IF_FALSE:
       return disasm_jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
-      return disasm_jump_instruction("OP_LOOP", -1, chunk, offset);
+      return disasm_loop_instruction("OP_LOOP", chunk, offset);
     case OP_CALL:
       return disasm_byte_instruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return disasm_byte_instruction("OP_TAIL_CALL", chunk, offset);
     case OP_CLOSURE: {
       offset++;
       uint8_t constant = chunk->code[offset++];
@@ -91,15 +106,48 @@ int disasm_instruction(chunk_t* chunk, int offset) {
     case OP_METHOD:
       return disasm_constant("OP_METHOD", chunk, offset);
     case OP_SET_PROPERTY:
-      return disasm_constant("OP_SET_PROPERTY", chunk, offset);
+      return disasm_property_instruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_PROPERTY:
-      return disasm_constant("OP_GET_PROPERTY", chunk, offset);
+      return disasm_property_instruction("OP_GET_PROPERTY", chunk, offset);
     case OP_INVOKE:
       return disasm_invoke_instruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return disasm_invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_TAIL_INVOKE:
+      return disasm_invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
+    case OP_TAIL_SUPER_INVOKE:
+      return disasm_invoke_instruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
     case OP_INHERIT:
       return disasm_simple("OP_INHERIT", offset);
+    case OP_GET_LOCAL_PROPERTY:
+      return disasm_local_property_instruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+    case OP_ADD_LOCALS:
+      return disasm_two_byte_instruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_ADD_CONSTANT:
+      return disasm_constant("OP_ADD_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_CONSTANT:
+      return disasm_constant("OP_SUBTRACT_CONSTANT", chunk, offset);
+    case OP_LESS_CONSTANT:
+      return disasm_constant("OP_LESS_CONSTANT", chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+      return disasm_jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_MOVE:
+      return disasm_register_instruction("OP_MOVE", "rr", chunk, offset);
+    case OP_LOAD_CONSTANT:
+      return disasm_register_instruction("OP_LOAD_CONSTANT", "rk", chunk, offset);
+    case OP_ADD_RR:
+      return disasm_register_instruction("OP_ADD_RR", "rrr", chunk, offset);
+    case OP_ADD_RK:
+      return disasm_register_instruction("OP_ADD_RK", "rrk", chunk, offset);
+    case OP_SUBTRACT_RK:
+      return disasm_register_instruction("OP_SUBTRACT_RK", "rrk", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_RR:
+      return disasm_register_instruction("OP_JUMP_IF_NOT_LESS_RR", "rrj", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_RK:
+      return disasm_register_instruction("OP_JUMP_IF_NOT_LESS_RK", "rkj", chunk, offset);
+    case OP_ADD_NUM:   return disasm_simple("OP_ADD_NUM", offset);
+    case OP_ADD_STR:   return disasm_simple("OP_ADD_STR", offset);
+    case OP_EQUAL_NUM: return disasm_simple("OP_EQUAL_NUM", offset);
     default:
       printf("unknown instruction %02x\n", instruction);
       return offset + 1;
@@ -132,11 +180,85 @@ static int disasm_jump_instruction(const char* name, int sign, chunk_t* chunk, i
   return offset + 3;
 }
 
+static int disasm_loop_instruction(const char* name, chunk_t* chunk, int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+  jump |= chunk->code[offset + 2];
+  int loop = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s %4d -> %d loop%d\n", name, offset, offset + 5 - jump, loop);
+  return offset + 5;
+}
+
 static int disasm_invoke_instruction(const char* name, chunk_t* chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t arg_count = chunk->code[offset + 2];
+  int cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
   printf("%-16s (%d args) %4d '", name, arg_count, constant);
   value_print(chunk->constants.values[constant]);
+  printf("' ic%d\n", cache);
+  return offset + 5;
+}
+
+static int disasm_two_byte_instruction(const char* name, chunk_t* chunk, int offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+static int disasm_global_instruction(const char* name, chunk_t* chunk, int offset) {
+  int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  value_print(vm.global_names.values[slot]);
   printf("'\n");
   return offset + 3;
 }
+
+static int disasm_property_instruction(const char* name, chunk_t* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("' ic%d\n", cache);
+  return offset + 4;
+}
+
+static int disasm_local_property_instruction(const char* name, chunk_t* chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  int cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("' ic%d\n", cache);
+  return offset + 5;
+}
+
+// Prints a three-address instruction. Each character of operands describes
+// one operand: 'r' is a frame slot, 'k' a constant index and 'j' a forward
+// two-byte jump offset.
+static int disasm_register_instruction(const char* name, const char* operands, chunk_t* chunk, int offset) {
+  printf("%-16s", name);
+  int next = offset + 1;
+  for (const char* operand = operands; *operand != '\0'; operand++) {
+    switch (*operand) {
+      case 'r':
+        printf(" r%d", chunk->code[next++]);
+        break;
+      case 'k': {
+        uint8_t constant = chunk->code[next++];
+        printf(" k%d '", constant);
+        value_print(chunk->constants.values[constant]);
+        printf("'");
+        break;
+      }
+      case 'j': {
+        uint16_t jump = (uint16_t)(chunk->code[next] << 8);
+        jump |= chunk->code[next + 1];
+        next += 2;
+        printf(" -> %d", next + jump);
+        break;
+      }
+    }
+  }
+  printf("\n");
+  return next;
+}
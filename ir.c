@@ -0,0 +1,2603 @@
+#include "ir.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "limits.h"
+#include "memory.h"
+#include "value.h"
+
+// Optimizing middle layer between the compiler and the VM. The compiler is
+// single-pass and emits bytecode as it parses, so the IR is built from a
+// function's finished bytecode: the frame slots and the operand stack are
+// interpreted abstractly, turning every value an instruction computes into
+// an SSA value and every slot, in each block, into a name for the value it
+// holds there. Locals and the copies between them disappear on the way, and
+// the passes see across statements:
+//
+// - copy propagation removes phis that only merge a value with itself;
+// - global value numbering reuses pure computations available in a
+//   dominating block, folds operations on constants, and forwards stores
+//   and loads of globals and upvalues within a block;
+// - dead store elimination drops stores to globals and upvalues that are
+//   overwritten before anything could observe them;
+// - dead code elimination removes values nothing uses;
+// - loop-invariant code motion moves computations whose operands do not
+//   change in a loop to its preheader, unless that could raise an error the
+//   loop would not have raised.
+//
+// Lowering goes back to bytecode. A value used once, by a later instruction
+// of its block that finds it on top of the stack, stays on the operand
+// stack; constants are rematerialized at each use; every other value lives
+// in a frame slot picked by a graph-coloring register allocator, with the
+// slots past the parameters reserved on entry. The register-mode and
+// superinstructions of the compiler's peephole pass are selected wherever
+// their operands allow.
+
+// Operations of values that are not computed by a bytecode instruction. All
+// others use the opcode_t of the generic instruction computing them.
+#define IR_PARAM 256 // frame slot a on entry
+#define IR_PHI 257
+
+// Functions with more values that need a frame slot than this are left
+// alone, bounding the interference matrix.
+#define IR_MAX_SLOT_VALUES 4096
+
+typedef enum {
+  TERM_JUMP, // to succs[0]
+  TERM_BRANCH, // to succs[0] if cond is truthy, otherwise to succs[1]
+  TERM_RETURN, // of cond
+} terminator_t;
+
+typedef struct {
+  int op;
+  int block;
+  int line;
+  int a; // constant, slot, global, upvalue or argument count
+  int b; // argument count of OP_INVOKE, OP_SUPER_INVOKE and their tail forms
+  int cache; // inline cache, or -1
+  int orig; // offset of the instruction it was built from, or -1
+  int args; // index of its first argument in ir_t.args
+  int arg_count;
+  int forward; // value that replaced it, or -1
+  bool dead;
+  bool number; // always a number when computed
+  // Lowering.
+  int uses;
+  int user; // only user if uses is 1: a value, -1 for a phi, -2 - b for block b
+  bool on_stack; // left on the operand stack for its user
+  int preload; // first of the values pushed right before it, or -1
+  int position; // in its block
+  int reg; // frame slot, or -1
+  int live_index; // index among the values that need a slot, or -1
+} ir_value_t;
+
+typedef struct {
+  int start; // offset of its first instruction, or -1 for added blocks
+  int end;
+  int* values; // in order; phis first
+  int value_count;
+  int value_capacity;
+  int* preds;
+  int pred_count;
+  int pred_capacity;
+  int succs[2];
+  int succ_count;
+  terminator_t term;
+  int cond;
+  int loop; // loop index of the OP_LOOP ending it, or -1
+  int line;
+  int rpo; // position in reverse postorder, or -1 if unreachable
+  int idom;
+  int* exit; // values of the slots at its end
+  int depth;
+  int prelude; // first of the added blocks laid out right before it, or -1
+  int prelude_next;
+  uint64_t* live_in;
+  uint64_t* live_out;
+  int offset; // offset of its lowered code, or -1
+} ir_block_t;
+
+typedef struct {
+  int header;
+  bool* body; // indexed by block
+  int size;
+} ir_loop_t;
+
+typedef struct {
+  int value;
+  int next; // or -1
+} ir_preload_t;
+
+typedef struct {
+  int at; // offset of a two-byte forward jump operand
+  int block;
+} ir_fixup_t;
+
+typedef struct {
+  obj_function_t* function;
+  chunk_t* chunk;
+  const char* failure; // why the function cannot be optimized, or NULL
+  ir_value_t* values;
+  int value_count;
+  int value_capacity;
+  int* args;
+  int arg_count;
+  int arg_capacity;
+  ir_block_t* blocks;
+  int block_count;
+  int block_capacity;
+  int code_blocks; // blocks built from the bytecode, in order of offset
+  int* block_at; // offset -> block starting there, or -1
+  int* order; // reachable blocks in reverse postorder, added ones included
+  int order_count;
+  int order_capacity;
+  // Lowering.
+  int* slot_values; // values that need a frame slot, by live_index
+  int slot_value_count;
+  int words; // per liveness set
+  uint64_t* interference;
+  int frame_size; // highest slot used
+  ir_preload_t* preloads;
+  int preload_count;
+  int preload_capacity;
+  int* layout;
+  int layout_count;
+  uint8_t* code;
+  int* lines;
+  int count;
+  int capacity;
+  ir_fixup_t* fixups;
+  int fixup_count;
+  int fixup_capacity;
+} ir_t;
+
+typedef struct {
+  int* buckets; // newest entry per hash, or -1
+  int mask;
+  int* entries; // value of each entry
+  int* hashes;
+  int* next; // older entry with the same hash
+  int count;
+  // Known contents of globals (kind 0) and upvalues (kind 1) in the block
+  // being numbered.
+  int* known_kinds;
+  int* known_indexes;
+  int* known_values;
+  int known_count;
+  int* first_child; // in the dominator tree
+  int* next_sibling;
+} value_table_t;
+
+static void ir_init(ir_t* ir, obj_function_t* function);
+static void ir_free(ir_t* ir);
+static void* reserve(void* array, int count, int* capacity, size_t size);
+static int add_block(ir_t* ir, int start);
+static void add_pred(ir_t* ir, int block, int pred);
+static void append_value(ir_t* ir, int block, int value);
+static int add_value(ir_t* ir, int block, int op, int line, int orig);
+static int add_op(ir_t* ir, int block, int op, int offset, int arg_count, const int* args);
+static void reserve_args(ir_t* ir, int value, int count);
+static int* value_args(ir_t* ir, int value);
+static uint16_t read_short(uint8_t* ip);
+static int jump_target(chunk_t* chunk, int offset);
+static bool build_blocks(ir_t* ir);
+static void finish_block(ir_t* ir, int block, int last, int end);
+static void order_blocks(ir_t* ir);
+static void insert_order(ir_t* ir, int block, int before);
+static bool build_ssa(ir_t* ir);
+static int add_constant_value(ir_t* ir, int block, int offset, int constant);
+static void interpret(ir_t* ir, int block, int* slots, int* depth);
+static int find(ir_t* ir, int value);
+static void replace(ir_t* ir, int value, int by);
+static void resolve(ir_t* ir);
+static void propagate_copies(ir_t* ir);
+static bool is_constant(ir_t* ir, int value);
+static bool is_pure(int op);
+static bool can_fault(ir_t* ir, int value);
+static bool has_effects(ir_t* ir, int value);
+static bool compute_number(ir_t* ir, int value);
+static void infer_numbers(ir_t* ir);
+static int intersect(ir_t* ir, int a, int b);
+static void compute_dominators(ir_t* ir);
+static bool dominates(ir_t* ir, int a, int b);
+static uint32_t value_hash(ir_t* ir, int value);
+static bool same_value(ir_t* ir, int value, int other);
+static int find_known(value_table_t* table, int kind, int index);
+static void set_known(value_table_t* table, int kind, int index, int value);
+static bool constant_of(ir_t* ir, int value, value_t* constant);
+static void fold(ir_t* ir, int value);
+static void number_block(ir_t* ir, value_table_t* table, int block);
+static void number_values(ir_t* ir);
+static void eliminate_dead_stores(ir_t* ir);
+static void eliminate_dead_code(ir_t* ir);
+static bool is_invariant(ir_t* ir, ir_loop_t* loop, int value);
+static int add_preheader(ir_t* ir, ir_loop_t* loops, int loop_count, int index);
+static void hoist_loop(ir_t* ir, ir_loop_t* loops, int loop_count, int index);
+static void hoist_invariants(ir_t* ir);
+static bool has_phis(ir_t* ir, int block);
+static void split_critical_edges(ir_t* ir);
+static bool in_slot(ir_t* ir, int value);
+static void count_uses(ir_t* ir);
+static int ready_operands(ir_t* ir, int* args, int count);
+static int subtree_start(ir_t* ir, int value);
+static bool plan_preloads(ir_t* ir, int block, int* args, int count);
+static bool take_operands(ir_t* ir, int* stack, int* depth, int* args, int count);
+static void stackify(ir_t* ir, int block);
+static void scan_block(ir_t* ir, int block, uint64_t* live, bool interfere);
+static bool compute_liveness(ir_t* ir);
+static bool color_slots(ir_t* ir);
+static void place_block(ir_t* ir, int block);
+static void emit_byte(ir_t* ir, uint8_t byte, int line);
+static void emit_short(ir_t* ir, int value, int line);
+static void emit_load(ir_t* ir, int value, int line);
+static void emit_result(ir_t* ir, int value, int line);
+static void emit_binary(ir_t* ir, int value);
+static void emit_value(ir_t* ir, int value);
+static void emit_moves(ir_t* ir, int block, int succ, int line);
+static void emit_jump_to(ir_t* ir, int target, int next, int loop, int line);
+static bool can_fuse_branch(ir_t* ir, int value);
+static void emit_block(ir_t* ir, int index);
+static void lower(ir_t* ir);
+
+void ir_optimize(obj_function_t* function) {
+  ir_t ir;
+  ir_init(&ir, function);
+#ifdef DEBUG_LOG_IR
+  int old_count = function->chunk.count;
+#endif
+
+  if (build_blocks(&ir) && build_ssa(&ir)) {
+    propagate_copies(&ir);
+    infer_numbers(&ir);
+    compute_dominators(&ir);
+    number_values(&ir);
+    propagate_copies(&ir);
+    eliminate_dead_stores(&ir);
+    eliminate_dead_code(&ir);
+    hoist_invariants(&ir);
+    lower(&ir);
+  }
+
+#ifdef DEBUG_LOG_IR
+  const char* name = function->name != NULL ? function->name->chars : "<script>";
+  if (ir.failure != NULL) {
+    printf("-- ir: %s left alone: %s\n", name, ir.failure);
+  } else {
+    printf("-- ir: %s %d -> %d bytes, %d slots\n", name, old_count, function->chunk.count, ir.frame_size + 1);
+  }
+#endif
+  ir_free(&ir);
+}
+
+static void ir_init(ir_t* ir, obj_function_t* function) {
+  memset(ir, 0, sizeof(*ir));
+  ir->function = function;
+  ir->chunk = &function->chunk;
+}
+
+static void ir_free(ir_t* ir) {
+  for (int i = 0; i < ir->block_count; i++) {
+    ir_block_t* block = &ir->blocks[i];
+    free(block->values);
+    free(block->preds);
+    free(block->exit);
+    free(block->live_in);
+    free(block->live_out);
+  }
+  free(ir->blocks);
+  free(ir->values);
+  free(ir->args);
+  free(ir->block_at);
+  free(ir->order);
+  free(ir->slot_values);
+  free(ir->interference);
+  free(ir->preloads);
+  free(ir->layout);
+  free(ir->code);
+  free(ir->lines);
+  free(ir->fixups);
+}
+
+// Makes room for one more element in an array grown with realloc.
+static void* reserve(void* array, int count, int* capacity, size_t size) {
+  if (count + 1 > *capacity) {
+    *capacity = GROW_CAPACITY(*capacity);
+    array = realloc(array, size * *capacity);
+    if (array == NULL) {
+      exit(1);
+    }
+  }
+  return array;
+}
+
+static int add_block(ir_t* ir, int start) {
+  ir->blocks = reserve(ir->blocks, ir->block_count, &ir->block_capacity, sizeof(ir_block_t));
+  int index = ir->block_count++;
+  ir_block_t* block = &ir->blocks[index];
+  memset(block, 0, sizeof(*block));
+  block->start = start;
+  block->end = start;
+  block->term = TERM_JUMP;
+  block->cond = -1;
+  block->loop = -1;
+  block->rpo = -1;
+  block->idom = -1;
+  block->prelude = -1;
+  block->prelude_next = -1;
+  block->offset = -1;
+  if (start >= 0) {
+    block->line = ir->chunk->lines[start];
+  }
+  return index;
+}
+
+static void add_pred(ir_t* ir, int block, int pred) {
+  ir_block_t* b = &ir->blocks[block];
+  b->preds = reserve(b->preds, b->pred_count, &b->pred_capacity, sizeof(int));
+  b->preds[b->pred_count++] = pred;
+}
+
+static void append_value(ir_t* ir, int block, int value) {
+  ir_block_t* b = &ir->blocks[block];
+  b->values = reserve(b->values, b->value_count, &b->value_capacity, sizeof(int));
+  b->values[b->value_count++] = value;
+}
+
+static int add_value(ir_t* ir, int block, int op, int line, int orig) {
+  ir->values = reserve(ir->values, ir->value_count, &ir->value_capacity, sizeof(ir_value_t));
+  int index = ir->value_count++;
+  ir_value_t* value = &ir->values[index];
+  memset(value, 0, sizeof(*value));
+  value->op = op;
+  value->block = block;
+  value->line = line;
+  value->cache = -1;
+  value->orig = orig;
+  value->args = ir->arg_count;
+  value->forward = -1;
+  value->user = -1;
+  value->reg = -1;
+  value->live_index = -1;
+  value->preload = -1;
+  append_value(ir, block, index);
+  return index;
+}
+
+// Adds the value computed by the instruction at offset from arguments.
+static int add_op(ir_t* ir, int block, int op, int offset, int arg_count, const int* args) {
+  int value = add_value(ir, block, op, ir->chunk->lines[offset], offset);
+  reserve_args(ir, value, arg_count);
+  if (arg_count > 0) {
+    memcpy(value_args(ir, value), args, sizeof(int) * arg_count);
+  }
+  return value;
+}
+
+// Gives value count new arguments, all -1.
+static void reserve_args(ir_t* ir, int value, int count) {
+  ir->values[value].args = ir->arg_count;
+  ir->values[value].arg_count = count;
+  for (int i = 0; i < count; i++) {
+    ir->args = reserve(ir->args, ir->arg_count, &ir->arg_capacity, sizeof(int));
+    ir->args[ir->arg_count++] = -1;
+  }
+}
+
+static int* value_args(ir_t* ir, int value) {
+  return &ir->args[ir->values[value].args];
+}
+
+static uint16_t read_short(uint8_t* ip) {
+  return (uint16_t)((ip[0] << 8) | ip[1]);
+}
+
+// Offset the jump at offset goes to, or -1 if it is not a jump.
+static int jump_target(chunk_t* chunk, int offset) {
+  uint8_t* ip = &chunk->code[offset];
+  switch (*ip) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      return offset + 3 + read_short(ip + 1);
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+      return offset + 5 + read_short(ip + 3);
+    case OP_LOOP:
+      return offset + 5 - read_short(ip + 1);
+    default:
+      return -1;
+  }
+}
+
+// Splits the bytecode into basic blocks. Block 0 is an empty entry block
+// defining the parameters, so that the first instruction can start a loop.
+static bool build_blocks(ir_t* ir) {
+  chunk_t* chunk = ir->chunk;
+  bool* leader = calloc(chunk->count + 1, sizeof(bool));
+  leader[0] = true;
+  for (int offset = 0; offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+    uint8_t* ip = &chunk->code[offset];
+    int next = offset + chunk_instruction_length(chunk, offset);
+    if (*ip == OP_CLOSURE) {
+      obj_function_t* closed = AS_FUNCTION(chunk->constants.values[ip[1]]);
+      for (int i = 0; i < closed->upvalue_count; i++) {
+        if (ip[2 + 2 * i]) {
+          ir->failure = "locals captured by closures";
+        }
+      }
+    } else if (*ip == OP_CLOSE_UPVALUE) {
+      ir->failure = "locals captured by closures";
+    } else if (*ip >= OP_ADD_NUM) {
+      ir->failure = "quickened instructions";
+    } else if (*ip == OP_RETURN) {
+      leader[next] = true;
+    } else if (jump_target(chunk, offset) != -1) {
+      int target = jump_target(chunk, offset);
+      if (target < 0 || target >= chunk->count) {
+        ir->failure = "jump out of the function";
+      } else {
+        leader[target] = true;
+        leader[next] = true;
+      }
+    }
+  }
+
+  ir->block_at = malloc(sizeof(int) * (chunk->count + 1));
+  add_block(ir, -1);
+  for (int offset = 0; offset <= chunk->count; offset++) {
+    ir->block_at[offset] = -1;
+    if (offset < chunk->count && leader[offset]) {
+      ir->block_at[offset] = add_block(ir, offset);
+    }
+  }
+  free(leader);
+  ir->code_blocks = ir->block_count;
+
+  ir_block_t* entry = &ir->blocks[0];
+  entry->succs[0] = 1;
+  entry->succ_count = 1;
+  entry->line = chunk->count > 0 ? chunk->lines[0] : 0;
+
+  int block = -1;
+  int last = -1;
+  for (int offset = 0; offset < chunk->count && ir->failure == NULL;
+       offset += chunk_instruction_length(chunk, offset)) {
+    if (ir->block_at[offset] != -1) {
+      if (block != -1) {
+        finish_block(ir, block, last, offset);
+      }
+      block = ir->block_at[offset];
+    }
+    last = offset;
+  }
+  if (block != -1 && ir->failure == NULL) {
+    finish_block(ir, block, last, chunk->count);
+  }
+  if (ir->failure != NULL) {
+    return false;
+  }
+
+  order_blocks(ir);
+  return true;
+}
+
+// Sets up the edges of the block that spans [start, end) and whose last
+// instruction is at last.
+static void finish_block(ir_t* ir, int block, int last, int end) {
+  chunk_t* chunk = ir->chunk;
+  ir_block_t* b = &ir->blocks[block];
+  b->end = end;
+  int fallthrough = ir->block_at[end];
+  switch (chunk->code[last]) {
+    case OP_RETURN:
+      b->term = TERM_RETURN;
+      return;
+    case OP_JUMP:
+      b->succs[b->succ_count++] = ir->block_at[jump_target(chunk, last)];
+      return;
+    case OP_LOOP:
+      b->succs[b->succ_count++] = ir->block_at[jump_target(chunk, last)];
+      b->loop = read_short(&chunk->code[last + 3]);
+      return;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+      b->term = TERM_BRANCH;
+      b->succs[b->succ_count++] = fallthrough;
+      b->succs[b->succ_count++] = ir->block_at[jump_target(chunk, last)];
+      break;
+    default:
+      b->succs[b->succ_count++] = fallthrough;
+      break;
+  }
+  if (fallthrough == -1) {
+    ir->failure = "code falls off the end";
+  }
+}
+
+// Orders the blocks reachable from the entry in reverse postorder and
+// records their predecessors.
+static void order_blocks(ir_t* ir) {
+  int count = ir->block_count;
+  int* stack = malloc(sizeof(int) * count);
+  int* next = calloc(count, sizeof(int));
+  int* postorder = malloc(sizeof(int) * count);
+  bool* seen = calloc(count, sizeof(bool));
+  int top = 0;
+  int post_count = 0;
+  stack[top++] = 0;
+  seen[0] = true;
+  while (top > 0) {
+    ir_block_t* block = &ir->blocks[stack[top - 1]];
+    if (next[stack[top - 1]] < block->succ_count) {
+      int succ = block->succs[next[stack[top - 1]]++];
+      if (!seen[succ]) {
+        seen[succ] = true;
+        stack[top++] = succ;
+      }
+    } else {
+      postorder[post_count++] = stack[--top];
+    }
+  }
+
+  for (int i = post_count - 1; i >= 0; i--) {
+    insert_order(ir, postorder[i], -1);
+    ir->blocks[postorder[i]].rpo = post_count - 1 - i;
+  }
+  for (int i = 0; i < ir->order_count; i++) {
+    ir_block_t* block = &ir->blocks[ir->order[i]];
+    for (int j = 0; j < block->succ_count; j++) {
+      add_pred(ir, block->succs[j], ir->order[i]);
+    }
+  }
+
+  free(stack);
+  free(next);
+  free(postorder);
+  free(seen);
+}
+
+// Adds block to the order right before block before, or at the end if
+// before is -1.
+static void insert_order(ir_t* ir, int block, int before) {
+  ir->order = reserve(ir->order, ir->order_count, &ir->order_capacity, sizeof(int));
+  int at = ir->order_count;
+  for (int i = 0; i < ir->order_count && before != -1; i++) {
+    if (ir->order[i] == before) {
+      at = i;
+      break;
+    }
+  }
+  memmove(&ir->order[at + 1], &ir->order[at], sizeof(int) * (ir->order_count - at));
+  ir->order[at] = block;
+  ir->order_count++;
+}
+
+// Interprets the blocks in reverse postorder, so that at least one
+// predecessor of each has been seen, creating a phi for every slot at each
+// join and filling in their arguments at the end.
+static bool build_ssa(ir_t* ir) {
+  int arity = ir->function->arity;
+  int* slots = malloc(sizeof(int) * (arity + 2 + ir->chunk->count));
+
+  for (int i = 0; i < ir->order_count; i++) {
+    int b = ir->order[i];
+    int depth = 0;
+    if (b == 0) {
+      depth = arity + 1;
+      for (int slot = 0; slot < depth; slot++) {
+        slots[slot] = add_value(ir, 0, IR_PARAM, ir->blocks[0].line, -1);
+        ir->values[slots[slot]].a = slot;
+      }
+    } else {
+      ir_block_t* block = &ir->blocks[b];
+      int first = block->preds[0];
+      for (int j = 1; j < block->pred_count; j++) {
+        if (ir->blocks[block->preds[j]].rpo < ir->blocks[first].rpo) {
+          first = block->preds[j];
+        }
+      }
+      depth = ir->blocks[first].depth;
+      if (block->pred_count == 1) {
+        memcpy(slots, ir->blocks[first].exit, sizeof(int) * depth);
+      } else {
+        for (int slot = 0; slot < depth; slot++) {
+          slots[slot] = add_value(ir, b, IR_PHI, block->line, -1);
+          ir->values[slots[slot]].a = slot;
+          reserve_args(ir, slots[slot], block->pred_count);
+        }
+      }
+      interpret(ir, b, slots, &depth);
+    }
+
+    ir_block_t* block = &ir->blocks[b];
+    block->exit = malloc(sizeof(int) * (depth + 1));
+    memcpy(block->exit, slots, sizeof(int) * depth);
+    block->depth = depth;
+  }
+  free(slots);
+
+  for (int i = 0; i < ir->order_count; i++) {
+    ir_block_t* block = &ir->blocks[ir->order[i]];
+    for (int j = 0; j < block->value_count; j++) {
+      int phi = block->values[j];
+      if (ir->values[phi].op != IR_PHI) {
+        break;
+      }
+      for (int k = 0; k < block->pred_count; k++) {
+        ir_block_t* pred = &ir->blocks[block->preds[k]];
+        if (pred->depth <= ir->values[phi].a) {
+          ir->failure = "stack depths differ at a join";
+          return false;
+        }
+        value_args(ir, phi)[k] = pred->exit[ir->values[phi].a];
+      }
+    }
+  }
+  return true;
+}
+
+// Adds a value loading the constant operand of the instruction at offset.
+static int add_constant_value(ir_t* ir, int block, int offset, int constant) {
+  int value = add_op(ir, block, OP_CONSTANT, offset, 0, NULL);
+  ir->values[value].a = constant;
+  return value;
+}
+
+// Runs the instructions of block on slots, whose first depth entries hold
+// the values in the frame's slots and operand stack when it starts.
+static void interpret(ir_t* ir, int block, int* slots, int* depth_pointer) {
+  chunk_t* chunk = ir->chunk;
+  ir_block_t* b = &ir->blocks[block];
+  int depth = *depth_pointer;
+
+#define PUSH(value) (slots[depth++] = (value))
+#define POP() (slots[--depth])
+#define TOP(count) (&slots[depth - (count)])
+
+  for (int offset = b->start; offset < b->end; offset += chunk_instruction_length(chunk, offset)) {
+    uint8_t* ip = &chunk->code[offset];
+    int args[2];
+    int value;
+    switch (*ip) {
+      case OP_CONSTANT:
+        PUSH(add_constant_value(ir, block, offset, ip[1]));
+        break;
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+        PUSH(add_op(ir, block, *ip, offset, 0, NULL));
+        break;
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_MODULO:
+      case OP_BIT_AND:
+      case OP_BIT_OR:
+      case OP_BIT_XOR:
+      case OP_SHIFT_LEFT:
+      case OP_SHIFT_RIGHT:
+        value = add_op(ir, block, *ip, offset, 2, TOP(2));
+        depth -= 2;
+        PUSH(value);
+        break;
+      case OP_NEGATE:
+      case OP_NOT:
+      case OP_BIT_NOT:
+        *TOP(1) = add_op(ir, block, *ip, offset, 1, TOP(1));
+        break;
+      case OP_PRINT:
+        add_op(ir, block, *ip, offset, 1, TOP(1));
+        depth--;
+        break;
+      case OP_POP:
+        depth--;
+        break;
+      case OP_DEFINE_GLOBAL:
+        value = add_op(ir, block, *ip, offset, 1, TOP(1));
+        ir->values[value].a = read_short(ip + 1);
+        depth--;
+        break;
+      case OP_GET_GLOBAL:
+        value = add_op(ir, block, *ip, offset, 0, NULL);
+        ir->values[value].a = read_short(ip + 1);
+        PUSH(value);
+        break;
+      case OP_SET_GLOBAL:
+        value = add_op(ir, block, *ip, offset, 1, TOP(1));
+        ir->values[value].a = read_short(ip + 1);
+        break;
+      case OP_GET_LOCAL:
+        PUSH(slots[ip[1]]);
+        break;
+      case OP_SET_LOCAL:
+        slots[ip[1]] = *TOP(1);
+        break;
+      case OP_GET_UPVALUE:
+        value = add_op(ir, block, *ip, offset, 0, NULL);
+        ir->values[value].a = ip[1];
+        PUSH(value);
+        break;
+      case OP_SET_UPVALUE:
+        value = add_op(ir, block, *ip, offset, 1, TOP(1));
+        ir->values[value].a = ip[1];
+        break;
+      case OP_GET_SUPER:
+        value = add_op(ir, block, *ip, offset, 2, TOP(2));
+        ir->values[value].a = ip[1];
+        depth -= 2;
+        PUSH(value);
+        break;
+      case OP_RETURN:
+        b->cond = POP();
+        break;
+      case OP_JUMP:
+      case OP_LOOP:
+        break;
+      case OP_JUMP_IF_FALSE:
+        b->cond = *TOP(1);
+        break;
+      case OP_POP_JUMP_IF_FALSE:
+        b->cond = POP();
+        break;
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        value = add_op(ir, block, *ip, offset, ip[1] + 1, TOP(ip[1] + 1));
+        ir->values[value].a = ip[1];
+        depth -= ip[1] + 1;
+        PUSH(value);
+        break;
+      case OP_CLOSURE:
+      case OP_CLASS:
+        value = add_op(ir, block, *ip, offset, 0, NULL);
+        ir->values[value].a = ip[1];
+        PUSH(value);
+        break;
+      case OP_SET_PROPERTY:
+        value = add_op(ir, block, *ip, offset, 2, TOP(2));
+        ir->values[value].a = ip[1];
+        ir->values[value].cache = read_short(ip + 2);
+        // The assigned value is the result of the assignment.
+        slots[depth - 2] = slots[depth - 1];
+        depth--;
+        break;
+      case OP_GET_PROPERTY:
+        value = add_op(ir, block, *ip, offset, 1, TOP(1));
+        ir->values[value].a = ip[1];
+        ir->values[value].cache = read_short(ip + 2);
+        *TOP(1) = value;
+        break;
+      case OP_METHOD:
+        value = add_op(ir, block, *ip, offset, 2, TOP(2));
+        ir->values[value].a = ip[1];
+        depth--;
+        break;
+      case OP_INVOKE:
+      case OP_SUPER_INVOKE:
+      case OP_TAIL_INVOKE:
+      case OP_TAIL_SUPER_INVOKE: {
+        int count = ip[2] + (*ip == OP_INVOKE || *ip == OP_TAIL_INVOKE ? 1 : 2);
+        value = add_op(ir, block, *ip, offset, count, TOP(count));
+        ir->values[value].a = ip[1];
+        ir->values[value].b = ip[2];
+        ir->values[value].cache = read_short(ip + 3);
+        depth -= count;
+        PUSH(value);
+        break;
+      }
+      case OP_INHERIT:
+        add_op(ir, block, *ip, offset, 2, TOP(2));
+        depth--;
+        break;
+      case OP_GET_LOCAL_PROPERTY:
+        value = add_op(ir, block, OP_GET_PROPERTY, offset, 1, &slots[ip[1]]);
+        ir->values[value].a = ip[2];
+        ir->values[value].cache = read_short(ip + 3);
+        PUSH(value);
+        break;
+      case OP_ADD_LOCALS:
+        args[0] = slots[ip[1]];
+        args[1] = slots[ip[2]];
+        PUSH(add_op(ir, block, OP_ADD, offset, 2, args));
+        break;
+      case OP_ADD_CONSTANT:
+      case OP_SUBTRACT_CONSTANT:
+      case OP_LESS_CONSTANT:
+        args[0] = *TOP(1);
+        args[1] = add_constant_value(ir, block, offset, ip[1]);
+        *TOP(1) = add_op(ir, block, *ip == OP_ADD_CONSTANT ? OP_ADD : *ip == OP_LESS_CONSTANT ? OP_LESS : OP_SUBTRACT,
+                         offset, 2, args);
+        break;
+      case OP_MOVE:
+        slots[ip[1]] = slots[ip[2]];
+        break;
+      case OP_LOAD_CONSTANT:
+        slots[ip[1]] = add_constant_value(ir, block, offset, ip[2]);
+        break;
+      case OP_ADD_RR:
+        args[0] = slots[ip[2]];
+        args[1] = slots[ip[3]];
+        slots[ip[1]] = add_op(ir, block, OP_ADD, offset, 2, args);
+        break;
+      case OP_ADD_RK:
+      case OP_SUBTRACT_RK:
+        args[0] = slots[ip[2]];
+        args[1] = add_constant_value(ir, block, offset, ip[3]);
+        slots[ip[1]] = add_op(ir, block, *ip == OP_ADD_RK ? OP_ADD : OP_SUBTRACT, offset, 2, args);
+        break;
+      case OP_JUMP_IF_NOT_LESS_RR:
+        args[0] = slots[ip[1]];
+        args[1] = slots[ip[2]];
+        b->cond = add_op(ir, block, OP_LESS, offset, 2, args);
+        break;
+      case OP_JUMP_IF_NOT_LESS_RK:
+        args[0] = slots[ip[1]];
+        args[1] = add_constant_value(ir, block, offset, ip[2]);
+        b->cond = add_op(ir, block, OP_LESS, offset, 2, args);
+        break;
+    }
+  }
+  *depth_pointer = depth;
+
+#undef TOP
+#undef POP
+#undef PUSH
+}
+
+static int find(ir_t* ir, int value) {
+  while (ir->values[value].forward != -1) {
+    value = ir->values[value].forward;
+  }
+  return value;
+}
+
+static void replace(ir_t* ir, int value, int by) {
+  ir->values[value].forward = by;
+  ir->values[value].dead = true;
+}
+
+// Points arguments and terminators at the values that replaced them.
+static void resolve(ir_t* ir) {
+  for (int i = 0; i < ir->value_count; i++) {
+    if (ir->values[i].dead) {
+      continue;
+    }
+    int* args = value_args(ir, i);
+    for (int j = 0; j < ir->values[i].arg_count; j++) {
+      args[j] = find(ir, args[j]);
+    }
+  }
+  for (int i = 0; i < ir->order_count; i++) {
+    ir_block_t* block = &ir->blocks[ir->order[i]];
+    if (block->cond != -1) {
+      block->cond = find(ir, block->cond);
+    }
+  }
+}
+
+// Replaces every phi whose arguments are all the same value, or the phi
+// itself, with that value. This is where copies between locals go away.
+static void propagate_copies(ir_t* ir) {
+  bool changed;
+  do {
+    changed = false;
+    for (int i = 0; i < ir->value_count; i++) {
+      if (ir->values[i].dead || ir->values[i].op != IR_PHI) {
+        continue;
+      }
+      int same = -1;
+      bool trivial = true;
+      int* args = value_args(ir, i);
+      for (int j = 0; j < ir->values[i].arg_count; j++) {
+        int arg = find(ir, args[j]);
+        if (arg == i || arg == same) {
+          continue;
+        }
+        if (same != -1) {
+          trivial = false;
+          break;
+        }
+        same = arg;
+      }
+      if (trivial && same != -1) {
+        replace(ir, i, same);
+        changed = true;
+      }
+    }
+  } while (changed);
+  resolve(ir);
+}
+
+// Whether value pushes a constant, and is rematerialized instead of kept.
+static bool is_constant(ir_t* ir, int value) {
+  switch (ir->values[value].op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether op always computes the same result from the same arguments,
+// without side effects.
+static bool is_pure(int op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NEGATE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_BIT_NOT:
+    case OP_NOT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether computing value can raise a runtime error.
+static bool can_fault(ir_t* ir, int value) {
+  int* args = value_args(ir, value);
+  switch (ir->values[value].op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_EQUAL:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case IR_PARAM:
+    case IR_PHI:
+      return false;
+    case OP_NEGATE:
+      return !ir->values[args[0]].number;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return !ir->values[args[0]].number || !ir->values[args[1]].number;
+    default:
+      // Including %, which truncates its operands to ints: that traps on
+      // zero and is undefined out of range.
+      return true;
+  }
+}
+
+// Whether value does anything besides computing its result, so that it
+// must be kept even if unused.
+static bool has_effects(ir_t* ir, int value) {
+  switch (ir->values[value].op) {
+    case IR_PARAM:
+    case IR_PHI:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+      return false;
+    default:
+      return !is_pure(ir->values[value].op) || can_fault(ir, value);
+  }
+}
+
+static bool compute_number(ir_t* ir, int value) {
+  int* args = value_args(ir, value);
+  switch (ir->values[value].op) {
+    case OP_CONSTANT:
+      return IS_NUMBER(ir->chunk->constants.values[ir->values[value].a]);
+    case OP_NEGATE:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_BIT_NOT:
+      return true;
+    case OP_ADD:
+      return ir->values[args[0]].number && ir->values[args[1]].number;
+    case IR_PHI:
+      for (int i = 0; i < ir->values[value].arg_count; i++) {
+        if (!ir->values[args[i]].number) {
+          return false;
+        }
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Finds the values that are always numbers, starting from the optimistic
+// assumption that all are, so that loop phis can be numbers too.
+static void infer_numbers(ir_t* ir) {
+  for (int i = 0; i < ir->value_count; i++) {
+    ir->values[i].number = true;
+  }
+  bool changed;
+  do {
+    changed = false;
+    for (int i = 0; i < ir->value_count; i++) {
+      if (ir->values[i].dead) {
+        continue;
+      }
+      bool number = compute_number(ir, i);
+      if (number != ir->values[i].number) {
+        ir->values[i].number = number;
+        changed = true;
+      }
+    }
+  } while (changed);
+}
+
+static int intersect(ir_t* ir, int a, int b) {
+  while (a != b) {
+    while (ir->blocks[a].rpo > ir->blocks[b].rpo) {
+      a = ir->blocks[a].idom;
+    }
+    while (ir->blocks[b].rpo > ir->blocks[a].rpo) {
+      b = ir->blocks[b].idom;
+    }
+  }
+  return a;
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm.
+static void compute_dominators(ir_t* ir) {
+  ir->blocks[0].idom = 0;
+  bool changed;
+  do {
+    changed = false;
+    for (int i = 1; i < ir->order_count; i++) {
+      ir_block_t* block = &ir->blocks[ir->order[i]];
+      int idom = -1;
+      for (int j = 0; j < block->pred_count; j++) {
+        int pred = block->preds[j];
+        if (ir->blocks[pred].idom != -1) {
+          idom = idom == -1 ? pred : intersect(ir, pred, idom);
+        }
+      }
+      if (block->idom != idom) {
+        block->idom = idom;
+        changed = true;
+      }
+    }
+  } while (changed);
+}
+
+static bool dominates(ir_t* ir, int a, int b) {
+  while (b != a && b != 0) {
+    b = ir->blocks[b].idom;
+  }
+  return b == a;
+}
+
+static uint32_t value_hash(ir_t* ir, int value) {
+  ir_value_t* v = &ir->values[value];
+  uint32_t hash = (uint32_t)v->op * 31u + (uint32_t)v->a;
+  if (v->op == IR_PHI) {
+    hash = hash * 31u + (uint32_t)v->block;
+  }
+  int* args = value_args(ir, value);
+  for (int i = 0; i < v->arg_count; i++) {
+    hash = hash * 31u + (uint32_t)args[i];
+  }
+  return hash;
+}
+
+static bool same_value(ir_t* ir, int value, int other) {
+  ir_value_t* a = &ir->values[value];
+  ir_value_t* b = &ir->values[other];
+  if (a->op != b->op || a->a != b->a || a->arg_count != b->arg_count ||
+      (a->op == IR_PHI && a->block != b->block)) {
+    return false;
+  }
+  return memcmp(value_args(ir, value), value_args(ir, other), sizeof(int) * a->arg_count) == 0;
+}
+
+static int find_known(value_table_t* table, int kind, int index) {
+  for (int i = 0; i < table->known_count; i++) {
+    if (table->known_kinds[i] == kind && table->known_indexes[i] == index) {
+      return table->known_values[i];
+    }
+  }
+  return -1;
+}
+
+static void set_known(value_table_t* table, int kind, int index, int value) {
+  for (int i = 0; i < table->known_count; i++) {
+    if (table->known_kinds[i] == kind && table->known_indexes[i] == index) {
+      table->known_values[i] = value;
+      return;
+    }
+  }
+  table->known_kinds[table->known_count] = kind;
+  table->known_indexes[table->known_count] = index;
+  table->known_values[table->known_count] = value;
+  table->known_count++;
+}
+
+static bool constant_of(ir_t* ir, int value, value_t* constant) {
+  switch (ir->values[value].op) {
+    case OP_CONSTANT:
+      *constant = ir->chunk->constants.values[ir->values[value].a];
+      return true;
+    case OP_NIL:
+      *constant = NIL_VAL;
+      return true;
+    case OP_TRUE:
+      *constant = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *constant = BOOL_VAL(false);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Turns value into a constant if its arguments are constants that it
+// cannot fail on. Numbers are looked up in the constant pool, and only
+// added to it while there is room.
+static void fold(ir_t* ir, int value) {
+  ir_value_t* v = &ir->values[value];
+  int* args = value_args(ir, value);
+  value_t x, y, result;
+  if (v->arg_count < 1 || !constant_of(ir, args[0], &x) ||
+      (v->arg_count > 1 && !constant_of(ir, args[1], &y))) {
+    return;
+  }
+  switch (v->op) {
+    case OP_NOT:
+      result = BOOL_VAL(IS_NIL(x) || (IS_BOOL(x) && !AS_BOOL(x)));
+      break;
+    case OP_EQUAL:
+      result = BOOL_VAL(values_equal(x, y));
+      break;
+    case OP_NEGATE:
+      if (!IS_NUMBER(x)) {
+        return;
+      }
+      result = num_to_narrow_value(-AS_NUMBER(x));
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE: {
+      if (!IS_NUMBER(x) || !IS_NUMBER(y)) {
+        return;
+      }
+      double a = AS_NUMBER(x);
+      double b = AS_NUMBER(y);
+      switch (v->op) {
+        case OP_GREATER:  result = BOOL_VAL(a > b); break;
+        case OP_LESS:     result = BOOL_VAL(a < b); break;
+        case OP_ADD:      result = num_to_narrow_value(a + b); break;
+        case OP_SUBTRACT: result = num_to_narrow_value(a - b); break;
+        case OP_MULTIPLY: result = num_to_narrow_value(a * b); break;
+        default:          result = num_to_narrow_value(a / b); break;
+      }
+      break;
+    }
+    default:
+      return;
+  }
+
+  if (IS_BOOL(result)) {
+    v->op = AS_BOOL(result) ? OP_TRUE : OP_FALSE;
+  } else {
+    value_array_t* constants = &ir->chunk->constants;
+    double number = AS_NUMBER(result);
+    int constant = -1;
+    for (int i = 0; i < constants->count && constant == -1; i++) {
+      if (IS_NUMBER(constants->values[i]) && IS_INT(constants->values[i]) == IS_INT(result)) {
+        double other = AS_NUMBER(constants->values[i]);
+        if (memcmp(&number, &other, sizeof(double)) == 0) {
+          constant = i;
+        }
+      }
+    }
+    if (constant == -1) {
+      if (constants->count > UINT8_MAX) {
+        return;
+      }
+      constant = chunk_add_constant(ir->chunk, result);
+    }
+    v->op = OP_CONSTANT;
+    v->a = constant;
+  }
+  v->arg_count = 0;
+  v->number = IS_NUMBER(result);
+}
+
+// Numbers the values of block and, with its values still available, the
+// blocks it dominates.
+static void number_block(ir_t* ir, value_table_t* table, int block) {
+  int mark = table->count;
+  table->known_count = 0;
+
+  for (int i = 0; i < ir->blocks[block].value_count; i++) {
+    int value = ir->blocks[block].values[i];
+    ir_value_t* v = &ir->values[value];
+    if (v->dead || v->block != block) {
+      continue;
+    }
+    int* args = value_args(ir, value);
+    for (int j = 0; j < v->arg_count; j++) {
+      args[j] = find(ir, args[j]);
+    }
+
+    int kind = v->op == OP_GET_UPVALUE || v->op == OP_SET_UPVALUE ? 1 : 0;
+    switch (v->op) {
+      case OP_GET_GLOBAL:
+      case OP_GET_UPVALUE: {
+        int known = find_known(table, kind, v->a);
+        if (known != -1) {
+          replace(ir, value, known);
+        } else {
+          set_known(table, kind, v->a, value);
+        }
+        continue;
+      }
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_SET_UPVALUE:
+        set_known(table, kind, v->a, args[0]);
+        continue;
+      case OP_CALL:
+      case OP_TAIL_CALL:
+      case OP_INVOKE:
+      case OP_SUPER_INVOKE:
+      case OP_TAIL_INVOKE:
+      case OP_TAIL_SUPER_INVOKE:
+        // The callee can assign any global or upvalue.
+        table->known_count = 0;
+        continue;
+      default:
+        if (!is_pure(v->op) && v->op != IR_PHI) {
+          continue;
+        }
+        break;
+    }
+
+    fold(ir, value);
+    if ((v->op == OP_EQUAL || v->op == OP_MULTIPLY) && args[0] > args[1]) {
+      int swap = args[0];
+      args[0] = args[1];
+      args[1] = swap;
+    }
+    uint32_t hash = value_hash(ir, value);
+    int entry = table->buckets[hash & table->mask];
+    while (entry != -1 && !(table->hashes[entry] == (int)hash && same_value(ir, table->entries[entry], value))) {
+      entry = table->next[entry];
+    }
+    if (entry != -1) {
+      replace(ir, value, table->entries[entry]);
+      continue;
+    }
+    table->entries[table->count] = value;
+    table->hashes[table->count] = (int)hash;
+    table->next[table->count] = table->buckets[hash & table->mask];
+    table->buckets[hash & table->mask] = table->count;
+    table->count++;
+  }
+
+  for (int child = table->first_child[block]; child != -1; child = table->next_sibling[child]) {
+    number_block(ir, table, child);
+  }
+
+  while (table->count > mark) {
+    table->count--;
+    table->buckets[table->hashes[table->count] & table->mask] = table->next[table->count];
+  }
+}
+
+// Global value numbering over the dominator tree.
+static void number_values(ir_t* ir) {
+  value_table_t table;
+  int size = 1;
+  while (size < ir->value_count * 2) {
+    size *= 2;
+  }
+  table.buckets = malloc(sizeof(int) * size);
+  for (int i = 0; i < size; i++) {
+    table.buckets[i] = -1;
+  }
+  table.mask = size - 1;
+  table.entries = malloc(sizeof(int) * ir->value_count);
+  table.hashes = malloc(sizeof(int) * ir->value_count);
+  table.next = malloc(sizeof(int) * ir->value_count);
+  table.count = 0;
+  table.known_kinds = malloc(sizeof(int) * ir->value_count);
+  table.known_indexes = malloc(sizeof(int) * ir->value_count);
+  table.known_values = malloc(sizeof(int) * ir->value_count);
+  table.known_count = 0;
+  table.first_child = malloc(sizeof(int) * ir->block_count);
+  table.next_sibling = malloc(sizeof(int) * ir->block_count);
+  for (int i = 0; i < ir->block_count; i++) {
+    table.first_child[i] = -1;
+    table.next_sibling[i] = -1;
+  }
+  for (int i = ir->order_count - 1; i > 0; i--) {
+    int block = ir->order[i];
+    int idom = ir->blocks[block].idom;
+    table.next_sibling[block] = table.first_child[idom];
+    table.first_child[idom] = block;
+  }
+
+  number_block(ir, &table, 0);
+
+  free(table.buckets);
+  free(table.entries);
+  free(table.hashes);
+  free(table.next);
+  free(table.known_kinds);
+  free(table.known_indexes);
+  free(table.known_values);
+  free(table.first_child);
+  free(table.next_sibling);
+}
+
+// Removes stores to a global or upvalue that are overwritten later in the
+// same block, with nothing in between that could read it or end the
+// program with an error. A store to a global is only removed if the global
+// is known to be defined, since otherwise the store itself raises an error.
+static void eliminate_dead_stores(ir_t* ir) {
+  int* pending = malloc(sizeof(int) * (ir->value_count + 1));
+  int* defined = malloc(sizeof(int) * (ir->value_count + 1));
+  for (int i = 0; i < ir->order_count; i++) {
+    ir_block_t* block = &ir->blocks[ir->order[i]];
+    int pending_count = 0;
+    int defined_count = 0;
+    for (int j = 0; j < block->value_count; j++) {
+      int value = block->values[j];
+      ir_value_t* v = &ir->values[value];
+      if (v->dead || v->block != ir->order[i]) {
+        continue;
+      }
+      switch (v->op) {
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE: {
+          bool global = v->op != OP_GET_UPVALUE && v->op != OP_SET_UPVALUE;
+          bool store = v->op != OP_GET_GLOBAL && v->op != OP_GET_UPVALUE;
+          bool is_defined = !global;
+          for (int k = 0; k < defined_count; k++) {
+            is_defined = is_defined || defined[k] == v->a;
+          }
+          for (int k = 0; k < pending_count; k++) {
+            ir_value_t* other = &ir->values[pending[k]];
+            if (other->a == v->a && (other->op == OP_SET_UPVALUE) == !global) {
+              if (store) {
+                other->dead = true;
+              }
+              pending[k--] = pending[--pending_count];
+            }
+          }
+          if (v->op == OP_GET_GLOBAL && is_defined) {
+            // Fails, unless it was defined before.
+            pending_count = 0;
+          }
+          if (store && is_defined && v->op != OP_DEFINE_GLOBAL) {
+            pending[pending_count++] = value;
+          }
+          if (global && !is_defined) {
+            defined[defined_count++] = v->a;
+          }
+          break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+          pending_count = 0;
+          break;
+        default:
+          if (can_fault(ir, value)) {
+            pending_count = 0;
+          }
+          break;
+      }
+    }
+  }
+  free(pending);
+  free(defined);
+}
+
+// Removes the values that have no effects and are not used by anything that
+// does.
+static void eliminate_dead_code(ir_t* ir) {
+  bool* live = calloc(ir->value_count, sizeof(bool));
+  int* worklist = malloc(sizeof(int) * ir->value_count);
+  int count = 0;
+  for (int i = 0; i < ir->value_count; i++) {
+    if (!ir->values[i].dead && has_effects(ir, i)) {
+      live[i] = true;
+      worklist[count++] = i;
+    }
+  }
+  for (int i = 0; i < ir->order_count; i++) {
+    int cond = ir->blocks[ir->order[i]].cond;
+    if (cond != -1 && !live[cond]) {
+      live[cond] = true;
+      worklist[count++] = cond;
+    }
+  }
+  while (count > 0) {
+    int value = worklist[--count];
+    int* args = value_args(ir, value);
+    for (int i = 0; i < ir->values[value].arg_count; i++) {
+      if (!live[args[i]]) {
+        live[args[i]] = true;
+        worklist[count++] = args[i];
+      }
+    }
+  }
+  for (int i = 0; i < ir->value_count; i++) {
+    if (!live[i]) {
+      ir->values[i].dead = true;
+    }
+  }
+  free(live);
+  free(worklist);
+}
+
+// Whether value computes the same result in every iteration of loop.
+static bool is_invariant(ir_t* ir, ir_loop_t* loop, int value) {
+  if (!is_pure(ir->values[value].op) || is_constant(ir, value)) {
+    return false;
+  }
+  int* args = value_args(ir, value);
+  for (int i = 0; i < ir->values[value].arg_count; i++) {
+    if (!is_constant(ir, args[i]) && loop->body[ir->values[args[i]].block]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the block that all entries into the loop go through before its
+// header, adding one if there is none.
+static int add_preheader(ir_t* ir, ir_loop_t* loops, int loop_count, int index) {
+  ir_loop_t* loop = &loops[index];
+  int header = loop->header;
+  int outside = -1;
+  int outside_count = 0;
+  for (int i = 0; i < ir->blocks[header].pred_count; i++) {
+    int pred = ir->blocks[header].preds[i];
+    if (!loop->body[pred]) {
+      outside = pred;
+      outside_count++;
+    }
+  }
+  if (outside_count == 1 && ir->blocks[outside].succ_count == 1) {
+    return outside;
+  }
+
+  int preheader = add_block(ir, -1);
+  ir_block_t* pre = &ir->blocks[preheader];
+  ir_block_t* head = &ir->blocks[header];
+  pre->succs[pre->succ_count++] = header;
+  pre->line = head->line;
+  pre->rpo = head->rpo;
+  pre->idom = head->idom;
+  head->idom = preheader;
+  pre->prelude_next = head->prelude;
+  head->prelude = preheader;
+
+  int old_count = head->pred_count;
+  int* old_preds = head->preds;
+  head->preds = NULL;
+  head->pred_count = 0;
+  head->pred_capacity = 0;
+  add_pred(ir, header, preheader);
+  for (int i = 0; i < old_count; i++) {
+    int pred = old_preds[i];
+    if (loop->body[pred]) {
+      add_pred(ir, header, pred);
+      continue;
+    }
+    add_pred(ir, preheader, pred);
+    for (int j = 0; j < ir->blocks[pred].succ_count; j++) {
+      if (ir->blocks[pred].succs[j] == header) {
+        ir->blocks[pred].succs[j] = preheader;
+      }
+    }
+  }
+
+  // Phis of the header take the values from outside the loop from the
+  // preheader, merging them there if they differ.
+  for (int i = 0; i < ir->blocks[header].value_count; i++) {
+    int phi = ir->blocks[header].values[i];
+    if (ir->values[phi].op != IR_PHI) {
+      break;
+    }
+    if (ir->values[phi].dead) {
+      continue;
+    }
+    int entry = -1;
+    bool same = true;
+    for (int j = 0; j < old_count; j++) {
+      int arg = value_args(ir, phi)[j];
+      if (!loop->body[old_preds[j]]) {
+        same = same && (entry == -1 || entry == arg);
+        entry = arg;
+      }
+    }
+    if (!same) {
+      int merge = add_value(ir, preheader, IR_PHI, ir->values[phi].line, -1);
+      ir->values[merge].a = ir->values[phi].a;
+      reserve_args(ir, merge, outside_count);
+      int k = 0;
+      bool number = true;
+      for (int j = 0; j < old_count; j++) {
+        if (!loop->body[old_preds[j]]) {
+          int arg = value_args(ir, phi)[j];
+          value_args(ir, merge)[k++] = arg;
+          number = number && ir->values[arg].number;
+        }
+      }
+      ir->values[merge].number = number;
+      entry = merge;
+    }
+
+    int old_args = ir->values[phi].args;
+    reserve_args(ir, phi, ir->blocks[header].pred_count);
+    int k = 0;
+    value_args(ir, phi)[k++] = entry;
+    for (int j = 0; j < old_count; j++) {
+      if (loop->body[old_preds[j]]) {
+        value_args(ir, phi)[k++] = ir->args[old_args + j];
+      }
+    }
+  }
+  free(old_preds);
+
+  insert_order(ir, preheader, header);
+  for (int i = 0; i < loop_count; i++) {
+    if (i != index && loops[i].body[header]) {
+      loops[i].body[preheader] = true;
+      loops[i].size++;
+    }
+  }
+  return preheader;
+}
+
+static void hoist_loop(ir_t* ir, ir_loop_t* loops, int loop_count, int index) {
+  ir_loop_t* loop = &loops[index];
+  int preheader = -1;
+  // Whether nothing that could fail or has effects runs in the header
+  // before the value being looked at, so that hoisting it cannot change
+  // which error, if any, is raised first.
+  bool clean = true;
+  for (int i = 0; i < ir->order_count; i++) {
+    int block = ir->order[i];
+    if (!loop->body[block]) {
+      continue;
+    }
+    for (int j = 0; j < ir->blocks[block].value_count; j++) {
+      int value = ir->blocks[block].values[j];
+      if (ir->values[value].dead || ir->values[value].block != block) {
+        continue;
+      }
+      bool fault = can_fault(ir, value);
+      if (is_invariant(ir, loop, value) && (!fault || (block == loop->header && clean))) {
+        if (preheader == -1) {
+          preheader = add_preheader(ir, loops, loop_count, index);
+          if (ir->order[i] != block) {
+            i++;
+          }
+        }
+        ir->values[value].block = preheader;
+        append_value(ir, preheader, value);
+        continue;
+      }
+      if (block == loop->header && has_effects(ir, value)) {
+        clean = false;
+      }
+    }
+  }
+}
+
+// Moves loop-invariant values out of natural loops, innermost loops first so
+// that what they hoist can move further out.
+static void hoist_invariants(ir_t* ir) {
+  int capacity = ir->block_count * 2 + 1;
+  ir_loop_t* loops = malloc(sizeof(ir_loop_t) * ir->block_count);
+  int loop_count = 0;
+  int* stack = malloc(sizeof(int) * capacity);
+
+  compute_dominators(ir);
+  for (int i = 0; i < ir->order_count; i++) {
+    int tail = ir->order[i];
+    for (int j = 0; j < ir->blocks[tail].succ_count; j++) {
+      int header = ir->blocks[tail].succs[j];
+      if (!dominates(ir, header, tail)) {
+        continue;
+      }
+      int index = 0;
+      while (index < loop_count && loops[index].header != header) {
+        index++;
+      }
+      if (index == loop_count) {
+        loops[loop_count].header = header;
+        loops[loop_count].body = calloc(capacity, sizeof(bool));
+        loops[loop_count].body[header] = true;
+        loops[loop_count].size = 1;
+        loop_count++;
+      }
+      ir_loop_t* loop = &loops[index];
+      int top = 0;
+      if (!loop->body[tail]) {
+        loop->body[tail] = true;
+        loop->size++;
+        stack[top++] = tail;
+      }
+      while (top > 0) {
+        ir_block_t* block = &ir->blocks[stack[--top]];
+        for (int k = 0; k < block->pred_count; k++) {
+          if (!loop->body[block->preds[k]]) {
+            loop->body[block->preds[k]] = true;
+            loop->size++;
+            stack[top++] = block->preds[k];
+          }
+        }
+      }
+    }
+  }
+
+  for (int i = 1; i < loop_count; i++) {
+    for (int j = i; j > 0 && loops[j].size < loops[j - 1].size; j--) {
+      ir_loop_t swap = loops[j];
+      loops[j] = loops[j - 1];
+      loops[j - 1] = swap;
+    }
+  }
+  for (int i = 0; i < loop_count; i++) {
+    hoist_loop(ir, loops, loop_count, i);
+  }
+
+  for (int i = 0; i < loop_count; i++) {
+    free(loops[i].body);
+  }
+  free(loops);
+  free(stack);
+}
+
+static bool has_phis(ir_t* ir, int block) {
+  for (int i = 0; i < ir->blocks[block].value_count; i++) {
+    int value = ir->blocks[block].values[i];
+    if (ir->values[value].op != IR_PHI) {
+      return false;
+    }
+    if (!ir->values[value].dead && ir->values[value].block == block) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Gives every edge from a branch to a join with phis a block of its own,
+// where the phis' moves go.
+static void split_critical_edges(ir_t* ir) {
+  int count = ir->order_count;
+  for (int i = 0; i < count; i++) {
+    int block = ir->order[i];
+    if (ir->blocks[block].succ_count != 2) {
+      continue;
+    }
+    for (int j = 0; j < 2; j++) {
+      int succ = ir->blocks[block].succs[j];
+      if (ir->blocks[succ].pred_count < 2 || !has_phis(ir, succ)) {
+        continue;
+      }
+      int edge = add_block(ir, -1);
+      ir_block_t* e = &ir->blocks[edge];
+      ir_block_t* s = &ir->blocks[succ];
+      e->succs[e->succ_count++] = succ;
+      e->line = ir->blocks[block].line;
+      e->rpo = s->rpo;
+      e->prelude_next = s->prelude;
+      s->prelude = edge;
+      add_pred(ir, edge, block);
+      for (int k = 0; k < s->pred_count; k++) {
+        if (s->preds[k] == block) {
+          s->preds[k] = edge;
+          break;
+        }
+      }
+      ir->blocks[block].succs[j] = edge;
+      insert_order(ir, edge, -1);
+    }
+  }
+}
+
+// Whether value lives in a frame slot.
+static bool in_slot(ir_t* ir, int value) {
+  return ir->values[value].reg != -1;
+}
+
+static void count_uses(ir_t* ir) {
+  for (int i = 0; i < ir->order_count; i++) {
+    int block = ir->order[i];
+    for (int j = 0; j < ir->blocks[block].value_count; j++) {
+      int value = ir->blocks[block].values[j];
+      if (ir->values[value].dead || ir->values[value].block != block) {
+        continue;
+      }
+      int* args = value_args(ir, value);
+      for (int k = 0; k < ir->values[value].arg_count; k++) {
+        ir->values[args[k]].uses++;
+        ir->values[args[k]].user = ir->values[value].op == IR_PHI ? -1 : value;
+      }
+    }
+    int cond = ir->blocks[block].cond;
+    if (cond != -1) {
+      ir->values[cond].uses++;
+      ir->values[cond].user = -2 - block;
+    }
+  }
+
+  for (int i = 0; i < ir->value_count; i++) {
+    ir_value_t* v = &ir->values[i];
+    if (v->dead || is_constant(ir, i) || v->op == IR_PHI || v->op == IR_PARAM || v->uses != 1) {
+      continue;
+    }
+    v->on_stack = v->user == -2 - v->block || (v->user >= 0 && ir->values[v->user].block == v->block);
+  }
+}
+
+// Number of leading arguments of an instruction that are on the stack when
+// it runs: all up to its last argument left there by another instruction.
+static int ready_operands(ir_t* ir, int* args, int count) {
+  int ready = 0;
+  for (int i = 0; i < count; i++) {
+    if (ir->values[args[i]].on_stack) {
+      ready = i + 1;
+    }
+  }
+  return ready;
+}
+
+// First value of block emitted for value, which is on the stack: the bottom
+// of the tree of stack values it is computed from.
+static int subtree_start(ir_t* ir, int value) {
+  for (;;) {
+    int* args = value_args(ir, value);
+    int first = -1;
+    for (int i = 0; i < ir->values[value].arg_count && first == -1; i++) {
+      if (ir->values[args[i]].on_stack) {
+        first = args[i];
+      }
+    }
+    if (first == -1) {
+      return value;
+    }
+    value = first;
+  }
+}
+
+// Arranges for the arguments of an instruction that come before one of its
+// stack arguments, but are not on the stack themselves, to be pushed right
+// before the code computing that argument starts, as the compiler does with
+// the locals in `a + b * c`. Returns false, having moved a stack argument
+// to a slot, if such an argument is computed too late in the block.
+static bool plan_preloads(ir_t* ir, int block, int* args, int count) {
+  int ready = ready_operands(ir, args, count);
+  int from = 0;
+  for (int j = 0; j < ready; j++) {
+    if (!ir->values[args[j]].on_stack) {
+      continue;
+    }
+    if (from < j) {
+      int start = subtree_start(ir, args[j]);
+      for (int i = from; i < j; i++) {
+        ir_value_t* early = &ir->values[args[i]];
+        if (!is_constant(ir, args[i]) && early->block == block && early->op != IR_PHI && early->op != IR_PARAM &&
+            early->position > ir->values[start].position) {
+          ir->values[args[j]].on_stack = false;
+          return false;
+        }
+      }
+      int head = ir->values[start].preload;
+      for (int i = j - 1; i >= from; i--) {
+        ir->preloads = reserve(ir->preloads, ir->preload_count, &ir->preload_capacity, sizeof(ir_preload_t));
+        ir->preloads[ir->preload_count].value = args[i];
+        ir->preloads[ir->preload_count].next = head;
+        head = ir->preload_count++;
+      }
+      ir->values[start].preload = head;
+    }
+    from = j + 1;
+  }
+  return true;
+}
+
+// Pops the leading arguments of an instruction that are on the stack,
+// which must be on top in order. Otherwise moves its stack arguments to
+// slots and returns false.
+static bool take_operands(ir_t* ir, int* stack, int* depth, int* args, int count) {
+  int ready = ready_operands(ir, args, count);
+  bool on_top = ready <= *depth;
+  for (int i = 0; i < ready && on_top; i++) {
+    on_top = stack[*depth - ready + i] == args[i];
+  }
+  if (!on_top) {
+    for (int i = 0; i < ready; i++) {
+      ir->values[args[i]].on_stack = false;
+    }
+    return false;
+  }
+  *depth -= ready;
+  return true;
+}
+
+// Plans the operand stack of block, then simulates it as lowered, moving
+// the values that would not be on top when needed to slots until all are.
+static void stackify(ir_t* ir, int block) {
+  ir_block_t* b = &ir->blocks[block];
+  // Values hoisted out of a loop stay listed in their old block, but belong
+  // to the preheader now, which plans them.
+  int size = 1;
+  for (int i = 0; i < b->value_count; i++) {
+    if (ir->values[b->values[i]].block == block) {
+      ir->values[b->values[i]].position = i;
+    }
+    size += 1 + ir->values[b->values[i]].arg_count;
+  }
+  int* stack = malloc(sizeof(int) * size);
+  bool retry;
+  do {
+    retry = false;
+    for (int i = 0; i < b->value_count; i++) {
+      if (ir->values[b->values[i]].block == block) {
+        ir->values[b->values[i]].preload = -1;
+      }
+    }
+    for (int i = 0; i < b->value_count && !retry; i++) {
+      int value = b->values[i];
+      ir_value_t* v = &ir->values[value];
+      if (!v->dead && v->block == block && v->op != IR_PHI) {
+        retry = !plan_preloads(ir, block, value_args(ir, value), v->arg_count);
+      }
+    }
+
+    int depth = 0;
+    for (int i = 0; i < b->value_count && !retry; i++) {
+      int value = b->values[i];
+      ir_value_t* v = &ir->values[value];
+      if (v->dead || v->block != block || v->op == IR_PHI || v->op == IR_PARAM || is_constant(ir, value)) {
+        continue;
+      }
+      for (int preload = v->preload; preload != -1; preload = ir->preloads[preload].next) {
+        stack[depth++] = ir->preloads[preload].value;
+      }
+      if (!take_operands(ir, stack, &depth, value_args(ir, value), v->arg_count)) {
+        retry = true;
+      } else if (v->on_stack) {
+        stack[depth++] = value;
+      }
+    }
+    if (!retry && b->cond != -1 && !take_operands(ir, stack, &depth, &b->cond, 1)) {
+      retry = true;
+    }
+  } while (retry);
+  free(stack);
+}
+
+// Computes the values live at the start of block from those live at its
+// end, in live. With interfere set, also records which values in slots are
+// live at the same time.
+static void scan_block(ir_t* ir, int block, uint64_t* live, bool interfere) {
+  ir_block_t* b = &ir->blocks[block];
+  int words = ir->words;
+
+#define SLOT_VALUE(value) (ir->values[value].live_index)
+#define LIVE_SET(set, index) ((set)[(index) / 64] |= 1ull << ((index) % 64))
+#define LIVE_CLEAR(set, index) ((set)[(index) / 64] &= ~(1ull << ((index) % 64)))
+#define INTERFERE(index, live) \
+  do { \
+    for (int w = 0; w < words; w++) { \
+      ir->interference[(index) * words + w] |= (live)[w]; \
+    } \
+  } while (false)
+
+  if (b->cond != -1 && SLOT_VALUE(b->cond) != -1) {
+    LIVE_SET(live, SLOT_VALUE(b->cond));
+  }
+  for (int i = b->value_count - 1; i >= 0; i--) {
+    int value = b->values[i];
+    ir_value_t* v = &ir->values[value];
+    if (v->dead || v->block != block || v->op == IR_PHI) {
+      continue;
+    }
+    if (SLOT_VALUE(value) != -1) {
+      LIVE_CLEAR(live, SLOT_VALUE(value));
+      if (interfere) {
+        INTERFERE(SLOT_VALUE(value), live);
+      }
+    }
+    int* args = value_args(ir, value);
+    for (int j = 0; j < v->arg_count; j++) {
+      if (SLOT_VALUE(args[j]) != -1) {
+        LIVE_SET(live, SLOT_VALUE(args[j]));
+      }
+    }
+  }
+
+  // Phis are all defined on entry, at the same time.
+  for (int i = 0; i < b->value_count; i++) {
+    int value = b->values[i];
+    if (ir->values[value].op != IR_PHI) {
+      break;
+    }
+    if (SLOT_VALUE(value) != -1) {
+      LIVE_CLEAR(live, SLOT_VALUE(value));
+    }
+  }
+  if (interfere) {
+    for (int i = 0; i < b->value_count; i++) {
+      int value = b->values[i];
+      if (ir->values[value].op != IR_PHI) {
+        break;
+      }
+      if (SLOT_VALUE(value) == -1) {
+        continue;
+      }
+      INTERFERE(SLOT_VALUE(value), live);
+      for (int j = 0; j < b->value_count; j++) {
+        int other = b->values[j];
+        if (ir->values[other].op != IR_PHI) {
+          break;
+        }
+        if (other != value && SLOT_VALUE(other) != -1) {
+          LIVE_SET(&ir->interference[SLOT_VALUE(value) * words], SLOT_VALUE(other));
+        }
+      }
+    }
+  }
+
+#undef INTERFERE
+#undef LIVE_CLEAR
+#undef LIVE_SET
+#undef SLOT_VALUE
+}
+
+// Computes which values that need a slot are live at the start and end of
+// each block, then which of them interfere.
+static bool compute_liveness(ir_t* ir) {
+  ir->slot_values = malloc(sizeof(int) * (ir->value_count + 1));
+  for (int i = 0; i < ir->value_count; i++) {
+    ir_value_t* v = &ir->values[i];
+    if (!v->dead && v->uses > 0 && !v->on_stack && !is_constant(ir, i)) {
+      v->live_index = ir->slot_value_count;
+      ir->slot_values[ir->slot_value_count++] = i;
+    }
+  }
+  if (ir->slot_value_count > IR_MAX_SLOT_VALUES) {
+    ir->failure = "too many values";
+    return false;
+  }
+
+  int words = ir->words = (ir->slot_value_count + 63) / 64 + 1;
+  for (int i = 0; i < ir->order_count; i++) {
+    ir_block_t* block = &ir->blocks[ir->order[i]];
+    block->live_in = calloc(words, sizeof(uint64_t));
+    block->live_out = calloc(words, sizeof(uint64_t));
+  }
+  uint64_t* live = malloc(sizeof(uint64_t) * words);
+
+  bool changed;
+  do {
+    changed = false;
+    for (int i = ir->order_count - 1; i >= 0; i--) {
+      int block = ir->order[i];
+      ir_block_t* b = &ir->blocks[block];
+      memset(live, 0, sizeof(uint64_t) * words);
+      for (int j = 0; j < b->succ_count; j++) {
+        ir_block_t* succ = &ir->blocks[b->succs[j]];
+        for (int w = 0; w < words; w++) {
+          live[w] |= succ->live_in[w];
+        }
+        int pred = 0;
+        while (succ->preds[pred] != block) {
+          pred++;
+        }
+        for (int k = 0; k < succ->value_count; k++) {
+          int phi = succ->values[k];
+          if (ir->values[phi].op != IR_PHI) {
+            break;
+          }
+          if (!ir->values[phi].dead) {
+            int arg = value_args(ir, phi)[pred];
+            if (ir->values[arg].live_index != -1) {
+              live[ir->values[arg].live_index / 64] |= 1ull << (ir->values[arg].live_index % 64);
+            }
+          }
+        }
+      }
+      memcpy(b->live_out, live, sizeof(uint64_t) * words);
+      scan_block(ir, block, live, false);
+      if (memcmp(live, b->live_in, sizeof(uint64_t) * words) != 0) {
+        memcpy(b->live_in, live, sizeof(uint64_t) * words);
+        changed = true;
+      }
+    }
+  } while (changed);
+
+  ir->interference = calloc((size_t)words * (ir->slot_value_count + 1), sizeof(uint64_t));
+  for (int i = 0; i < ir->order_count; i++) {
+    int block = ir->order[i];
+    memcpy(live, ir->blocks[block].live_out, sizeof(uint64_t) * words);
+    scan_block(ir, block, live, true);
+  }
+  // Make the matrix symmetric.
+  for (int i = 0; i < ir->slot_value_count; i++) {
+    for (int j = 0; j < ir->slot_value_count; j++) {
+      if (ir->interference[i * words + j / 64] & (1ull << (j % 64))) {
+        ir->interference[j * words + i / 64] |= 1ull << (i % 64);
+      }
+    }
+  }
+  free(live);
+  return true;
+}
+
+// Assigns frame slots to the values that need one, greedily in program
+// order. Parameters stay in their slots; a phi prefers the slot of one of
+// its arguments and the arguments prefer the phi's, which saves moves.
+static bool color_slots(ir_t* ir) {
+  int arity = ir->function->arity;
+  int words = ir->words;
+  int* hints = malloc(sizeof(int) * ir->value_count);
+  for (int i = 0; i < ir->value_count; i++) {
+    hints[i] = -1;
+  }
+  ir->frame_size = arity;
+  for (int i = 0; i < ir->slot_value_count; i++) {
+    ir_value_t* v = &ir->values[ir->slot_values[i]];
+    if (v->op == IR_PARAM) {
+      v->reg = v->a;
+    }
+  }
+
+  for (int i = 0; i < ir->order_count && ir->failure == NULL; i++) {
+    int block = ir->order[i];
+    for (int j = 0; j < ir->blocks[block].value_count; j++) {
+      int value = ir->blocks[block].values[j];
+      ir_value_t* v = &ir->values[value];
+      if (v->block != block || v->live_index == -1 || v->op == IR_PARAM) {
+        continue;
+      }
+
+      bool used[UINT8_COUNT] = {false};
+      uint64_t* row = &ir->interference[v->live_index * words];
+      for (int k = 0; k < ir->slot_value_count; k++) {
+        if ((row[k / 64] & (1ull << (k % 64))) && ir->values[ir->slot_values[k]].reg != -1) {
+          used[ir->values[ir->slot_values[k]].reg] = true;
+        }
+      }
+
+      int reg = -1;
+      int* args = value_args(ir, value);
+      for (int k = 0; k < v->arg_count && v->op == IR_PHI && reg == -1; k++) {
+        int hint = ir->values[args[k]].reg;
+        if (hint > 0 && !used[hint]) {
+          reg = hint;
+        }
+      }
+      if (reg == -1 && hints[value] > 0 && !used[hints[value]]) {
+        reg = hints[value];
+      }
+      for (int k = 1; k < UINT8_COUNT && reg == -1; k++) {
+        if (!used[k]) {
+          reg = k;
+        }
+      }
+      if (reg == -1) {
+        ir->failure = "too many live values";
+        break;
+      }
+      v->reg = reg;
+      if (reg > ir->frame_size) {
+        ir->frame_size = reg;
+      }
+      if (v->op == IR_PHI) {
+        for (int k = 0; k < v->arg_count; k++) {
+          if (hints[args[k]] == -1) {
+            hints[args[k]] = reg;
+          }
+        }
+      }
+    }
+  }
+  free(hints);
+  return ir->failure == NULL;
+}
+
+// Lays out block after the added blocks that go right before it.
+static void place_block(ir_t* ir, int block) {
+  for (int prelude = ir->blocks[block].prelude; prelude != -1; prelude = ir->blocks[prelude].prelude_next) {
+    place_block(ir, prelude);
+  }
+  ir->layout[ir->layout_count++] = block;
+}
+
+static void emit_byte(ir_t* ir, uint8_t byte, int line) {
+  if (ir->count + 1 > ir->capacity) {
+    ir->capacity = GROW_CAPACITY(ir->capacity);
+    ir->code = realloc(ir->code, ir->capacity);
+    ir->lines = realloc(ir->lines, sizeof(int) * ir->capacity);
+    if (ir->code == NULL || ir->lines == NULL) {
+      exit(1);
+    }
+  }
+  ir->code[ir->count] = byte;
+  ir->lines[ir->count] = line;
+  ir->count++;
+}
+
+static void emit_short(ir_t* ir, int value, int line) {
+  emit_byte(ir, (value >> 8) & 0xff, line);
+  emit_byte(ir, value & 0xff, line);
+}
+
+// Pushes value, which is a constant or in a slot.
+static void emit_load(ir_t* ir, int value, int line) {
+  ir_value_t* v = &ir->values[value];
+  switch (v->op) {
+    case OP_CONSTANT:
+      emit_byte(ir, OP_CONSTANT, line);
+      emit_byte(ir, v->a, line);
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      emit_byte(ir, v->op, line);
+      break;
+    default:
+      emit_byte(ir, OP_GET_LOCAL, line);
+      emit_byte(ir, v->reg, line);
+      break;
+  }
+}
+
+// Disposes of the value an instruction just pushed: leaves it for its user,
+// stores it in its slot, or drops it.
+static void emit_result(ir_t* ir, int value, int line) {
+  ir_value_t* v = &ir->values[value];
+  if (v->on_stack) {
+    return;
+  }
+  if (v->uses > 0) {
+    emit_byte(ir, OP_SET_LOCAL, line);
+    emit_byte(ir, v->reg, line);
+  }
+  emit_byte(ir, OP_POP, line);
+}
+
+static void emit_binary(ir_t* ir, int value) {
+  ir_value_t* v = &ir->values[value];
+  int* args = value_args(ir, value);
+  int x = args[0];
+  int y = args[1];
+  int line = v->line;
+  bool y_constant = ir->values[y].op == OP_CONSTANT;
+
+  if (in_slot(ir, value) && in_slot(ir, x)) {
+    if (v->op == OP_ADD && in_slot(ir, y)) {
+      emit_byte(ir, OP_ADD_RR, line);
+      emit_byte(ir, v->reg, line);
+      emit_byte(ir, ir->values[x].reg, line);
+      emit_byte(ir, ir->values[y].reg, line);
+      return;
+    }
+    if ((v->op == OP_ADD || v->op == OP_SUBTRACT) && y_constant) {
+      emit_byte(ir, v->op == OP_ADD ? OP_ADD_RK : OP_SUBTRACT_RK, line);
+      emit_byte(ir, v->reg, line);
+      emit_byte(ir, ir->values[x].reg, line);
+      emit_byte(ir, ir->values[y].a, line);
+      return;
+    }
+  }
+  if (v->op == OP_ADD && in_slot(ir, x) && in_slot(ir, y)) {
+    emit_byte(ir, OP_ADD_LOCALS, line);
+    emit_byte(ir, ir->values[x].reg, line);
+    emit_byte(ir, ir->values[y].reg, line);
+    emit_result(ir, value, line);
+    return;
+  }
+
+  int ready = ready_operands(ir, args, 2);
+  if (ready < 1) {
+    emit_load(ir, x, line);
+  }
+  if (y_constant && (v->op == OP_ADD || v->op == OP_SUBTRACT || v->op == OP_LESS)) {
+    emit_byte(ir, v->op == OP_ADD ? OP_ADD_CONSTANT : v->op == OP_SUBTRACT ? OP_SUBTRACT_CONSTANT : OP_LESS_CONSTANT,
+              line);
+    emit_byte(ir, ir->values[y].a, line);
+  } else {
+    if (ready < 2) {
+      emit_load(ir, y, line);
+    }
+    emit_byte(ir, v->op, line);
+  }
+  emit_result(ir, value, line);
+}
+
+static void emit_value(ir_t* ir, int value) {
+  ir_value_t* v = &ir->values[value];
+  int* args = value_args(ir, value);
+  int line = v->line;
+  int op = v->op;
+  for (int preload = v->preload; preload != -1; preload = ir->preloads[preload].next) {
+    emit_load(ir, ir->preloads[preload].value, line);
+  }
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case IR_PARAM:
+    case IR_PHI:
+      return;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+      emit_binary(ir, value);
+      return;
+    case OP_GET_PROPERTY:
+      if (in_slot(ir, args[0])) {
+        emit_byte(ir, OP_GET_LOCAL_PROPERTY, line);
+        emit_byte(ir, ir->values[args[0]].reg, line);
+        emit_byte(ir, v->a, line);
+        emit_short(ir, v->cache, line);
+        emit_result(ir, value, line);
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+
+  for (int i = ready_operands(ir, args, v->arg_count); i < v->arg_count; i++) {
+    emit_load(ir, args[i], line);
+  }
+  emit_byte(ir, op, line);
+  switch (op) {
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      emit_short(ir, v->a, line);
+      break;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+      emit_byte(ir, v->a, line);
+      break;
+    case OP_CLOSURE: {
+      emit_byte(ir, v->a, line);
+      obj_function_t* closed = AS_FUNCTION(ir->chunk->constants.values[v->a]);
+      for (int i = 0; i < closed->upvalue_count * 2; i++) {
+        emit_byte(ir, ir->chunk->code[v->orig + 2 + i], line);
+      }
+      break;
+    }
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      emit_byte(ir, v->a, line);
+      emit_short(ir, v->cache, line);
+      break;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+      emit_byte(ir, v->a, line);
+      emit_byte(ir, v->b, line);
+      emit_short(ir, v->cache, line);
+      break;
+    default:
+      break;
+  }
+
+  switch (op) {
+    case OP_PRINT:
+    case OP_DEFINE_GLOBAL:
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_PROPERTY:
+    case OP_METHOD:
+    case OP_INHERIT:
+      // Drop the assigned value, or the class left under the operand.
+      emit_byte(ir, OP_POP, line);
+      break;
+    default:
+      emit_result(ir, value, line);
+      break;
+  }
+}
+
+// Moves the arguments that block passes to the phis of succ into their
+// slots, all at once: through the stack if some slot is both read and
+// written.
+static void emit_moves(ir_t* ir, int block, int succ, int line) {
+  ir_block_t* s = &ir->blocks[succ];
+  int pred = 0;
+  while (s->preds[pred] != block) {
+    pred++;
+  }
+  int* dsts = malloc(sizeof(int) * (s->value_count + 1));
+  int* srcs = malloc(sizeof(int) * (s->value_count + 1));
+  int count = 0;
+  for (int i = 0; i < s->value_count; i++) {
+    int phi = s->values[i];
+    if (ir->values[phi].op != IR_PHI) {
+      break;
+    }
+    if (ir->values[phi].dead || ir->values[phi].reg == -1) {
+      continue;
+    }
+    int arg = value_args(ir, phi)[pred];
+    if (is_constant(ir, arg) || ir->values[arg].reg != ir->values[phi].reg) {
+      dsts[count] = ir->values[phi].reg;
+      srcs[count] = arg;
+      count++;
+    }
+  }
+
+  bool overlap = false;
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < count; j++) {
+      overlap = overlap || (i != j && !is_constant(ir, srcs[j]) && ir->values[srcs[j]].reg == dsts[i]);
+    }
+  }
+  if (overlap) {
+    for (int i = 0; i < count; i++) {
+      emit_load(ir, srcs[i], line);
+    }
+    for (int i = count - 1; i >= 0; i--) {
+      emit_byte(ir, OP_SET_LOCAL, line);
+      emit_byte(ir, dsts[i], line);
+      emit_byte(ir, OP_POP, line);
+    }
+  } else {
+    for (int i = 0; i < count; i++) {
+      if (ir->values[srcs[i]].op == OP_CONSTANT) {
+        emit_byte(ir, OP_LOAD_CONSTANT, line);
+        emit_byte(ir, dsts[i], line);
+        emit_byte(ir, ir->values[srcs[i]].a, line);
+      } else if (is_constant(ir, srcs[i])) {
+        emit_load(ir, srcs[i], line);
+        emit_byte(ir, OP_SET_LOCAL, line);
+        emit_byte(ir, dsts[i], line);
+        emit_byte(ir, OP_POP, line);
+      } else {
+        emit_byte(ir, OP_MOVE, line);
+        emit_byte(ir, dsts[i], line);
+        emit_byte(ir, ir->values[srcs[i]].reg, line);
+      }
+    }
+  }
+  free(dsts);
+  free(srcs);
+}
+
+// Continues at target, which is laid out as block next if it follows.
+// Backward jumps are loops, and keep the loop index of the original one.
+static void emit_jump_to(ir_t* ir, int target, int next, int loop, int line) {
+  if (target == next) {
+    return;
+  }
+  int offset = ir->blocks[target].offset;
+  if (offset == -1) {
+    emit_byte(ir, OP_JUMP, line);
+    ir->fixups = reserve(ir->fixups, ir->fixup_count, &ir->fixup_capacity, sizeof(ir_fixup_t));
+    ir->fixups[ir->fixup_count].at = ir->count;
+    ir->fixups[ir->fixup_count].block = target;
+    ir->fixup_count++;
+    emit_short(ir, 0xffff, line);
+    return;
+  }
+
+  if (loop == -1) {
+    loop = chunk_add_loop(ir->chunk);
+  }
+  int jump = ir->count + 5 - offset;
+  if (jump > UINT16_MAX || loop > UINT16_MAX) {
+    ir->failure = "loop body too large";
+  }
+  emit_byte(ir, OP_LOOP, line);
+  emit_short(ir, jump, line);
+  emit_short(ir, loop, line);
+}
+
+// Whether the comparison value, which a branch tests, can be folded into the
+// branch as a compare-and-jump on slots.
+static bool can_fuse_branch(ir_t* ir, int value) {
+  ir_value_t* v = &ir->values[value];
+  if (!v->on_stack || (v->op != OP_LESS && v->op != OP_GREATER)) {
+    return false;
+  }
+  int* args = value_args(ir, value);
+  return in_slot(ir, args[0]) &&
+         (in_slot(ir, args[1]) || (v->op == OP_LESS && ir->values[args[1]].op == OP_CONSTANT));
+}
+
+static void emit_block(ir_t* ir, int index) {
+  int block = ir->layout[index];
+  int next = index + 1 < ir->layout_count ? ir->layout[index + 1] : -1;
+  ir->blocks[block].offset = ir->count;
+  int line = ir->blocks[block].line;
+
+  if (block == 0) {
+    for (int slot = ir->function->arity + 1; slot <= ir->frame_size; slot++) {
+      emit_byte(ir, OP_NIL, line);
+    }
+  }
+
+  int last = -1;
+  for (int i = 0; i < ir->blocks[block].value_count; i++) {
+    int value = ir->blocks[block].values[i];
+    ir_value_t* v = &ir->values[value];
+    if (!v->dead && v->block == block && v->op != IR_PHI && v->op != IR_PARAM && !is_constant(ir, value)) {
+      last = value;
+    }
+  }
+  ir_block_t* b = &ir->blocks[block];
+  int fused = b->term == TERM_BRANCH && b->cond == last && can_fuse_branch(ir, last) ? last : -1;
+
+  for (int i = 0; i < ir->blocks[block].value_count; i++) {
+    int value = ir->blocks[block].values[i];
+    if (!ir->values[value].dead && ir->values[value].block == block && value != fused) {
+      emit_value(ir, value);
+    }
+  }
+
+  b = &ir->blocks[block];
+  if (b->term == TERM_JUMP && has_phis(ir, b->succs[0])) {
+    emit_moves(ir, block, b->succs[0], line);
+  }
+
+  switch (b->term) {
+    case TERM_RETURN:
+      if (!ir->values[b->cond].on_stack) {
+        emit_load(ir, b->cond, line);
+      }
+      emit_byte(ir, OP_RETURN, line);
+      break;
+    case TERM_JUMP:
+      emit_jump_to(ir, b->succs[0], next, b->loop, line);
+      break;
+    case TERM_BRANCH: {
+      if (ir->blocks[b->succs[1]].offset != -1) {
+        ir->failure = "backward branch";
+        return;
+      }
+      int cond_line = ir->values[b->cond].line;
+      if (fused != -1) {
+        int* args = value_args(ir, fused);
+        int x = args[0];
+        int y = args[1];
+        if (ir->values[fused].op == OP_GREATER) {
+          x = args[1];
+          y = args[0];
+        }
+        emit_byte(ir, in_slot(ir, y) ? OP_JUMP_IF_NOT_LESS_RR : OP_JUMP_IF_NOT_LESS_RK, cond_line);
+        emit_byte(ir, ir->values[x].reg, cond_line);
+        emit_byte(ir, in_slot(ir, y) ? ir->values[y].reg : ir->values[y].a, cond_line);
+      } else {
+        if (!ir->values[b->cond].on_stack) {
+          emit_load(ir, b->cond, cond_line);
+        }
+        emit_byte(ir, OP_POP_JUMP_IF_FALSE, cond_line);
+      }
+      ir->fixups = reserve(ir->fixups, ir->fixup_count, &ir->fixup_capacity, sizeof(ir_fixup_t));
+      ir->fixups[ir->fixup_count].at = ir->count;
+      ir->fixups[ir->fixup_count].block = b->succs[1];
+      ir->fixup_count++;
+      emit_short(ir, 0xffff, cond_line);
+      emit_jump_to(ir, b->succs[0], next, -1, line);
+      break;
+    }
+  }
+}
+
+// Turns the IR back into bytecode and, if that works out, replaces the
+// function's code with it.
+static void lower(ir_t* ir) {
+  split_critical_edges(ir);
+  count_uses(ir);
+  for (int i = 0; i < ir->order_count; i++) {
+    stackify(ir, ir->order[i]);
+  }
+  if (!compute_liveness(ir) || !color_slots(ir)) {
+    return;
+  }
+
+  ir->layout = malloc(sizeof(int) * ir->block_count);
+  place_block(ir, 0);
+  for (int block = 1; block < ir->code_blocks; block++) {
+    if (ir->blocks[block].rpo != -1) {
+      place_block(ir, block);
+    }
+  }
+  for (int i = 0; i < ir->layout_count && ir->failure == NULL; i++) {
+    emit_block(ir, i);
+  }
+
+  for (int i = 0; i < ir->fixup_count && ir->failure == NULL; i++) {
+    int at = ir->fixups[i].at;
+    int jump = ir->blocks[ir->fixups[i].block].offset - (at + 2);
+    if (ir->blocks[ir->fixups[i].block].offset == -1 || jump > UINT16_MAX) {
+      ir->failure = "jump too far";
+    }
+    ir->code[at] = (jump >> 8) & 0xff;
+    ir->code[at + 1] = jump & 0xff;
+  }
+  if (ir->failure != NULL) {
+    return;
+  }
+
+  chunk_t* chunk = ir->chunk;
+  chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, ir->count);
+  chunk->lines = GROW_ARRAY(int, chunk->lines, chunk->capacity, ir->count);
+  memcpy(chunk->code, ir->code, ir->count);
+  memcpy(chunk->lines, ir->lines, sizeof(int) * ir->count);
+  chunk->count = ir->count;
+  chunk->capacity = ir->count;
+}
@@ -0,0 +1,12 @@
+#ifndef _CLOX_IR_H
+#define _CLOX_IR_H
+
+#include "object.h"
+
+// Rebuilds the bytecode of function, which has just been compiled, through
+// an SSA intermediate representation, optimizing it on the way. Functions
+// the IR cannot express, such as those with locals captured by closures, are
+// left as they are.
+void ir_optimize(obj_function_t* function);
+
+#endif // _CLOX_IR_H
@@ -0,0 +1,1528 @@
+// MAP_ANONYMOUS is hidden by -std=c17 without this.
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+jit_options_t jit_options = {
+  .enabled = true,
+};
+
+#ifdef JIT
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "memory.h"
+
+// Baseline template compiler: every bytecode instruction is translated on
+// its own into a fixed sequence of x86-64 instructions. Simple instructions
+// (constants, locals, globals, jumps and number arithmetic) are generated
+// inline; everything else calls back into the runtime in vm.c, which shares
+// the interpreter's slow paths. Compiled functions keep using the VM value
+// stack and call frames, so runtime errors and the GC see the same state as
+// with the interpreter.
+
+typedef enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+} reg_t;
+
+// Interpreter state kept in callee-saved registers so that it survives calls
+// into the runtime.
+#define SLOTS RBX
+#define STACK_TOP R12
+#define FRAME R13
+#define VM R14
+#define NAN_MASK R15 // QNAN, for number checks
+
+// Condition codes of jcc/setcc.
+typedef enum {
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_S = 0x8,
+} condition_t;
+
+// Extension field of the 0x81/0x83 ALU-with-immediate instructions.
+typedef enum {
+  ALU_ADD = 0,
+  ALU_SUB = 5,
+} alu_t;
+
+// Jump targets in fixups: bytecode offsets, or one of these.
+#define LABEL_ERROR -1
+#define LABEL_EPILOGUE -2
+
+typedef struct {
+  int at; // offset of the rel32 to patch
+  int target;
+} fixup_t;
+
+typedef struct {
+  obj_function_t* function;
+  chunk_t* chunk;
+  uint8_t* code;
+  int count;
+  int capacity;
+  int* native_offsets; // bytecode offset -> offset of its machine code
+  fixup_t* fixups;
+  int fixup_count;
+  int fixup_capacity;
+} assembler_t;
+
+// Tracing JIT: once the back-edge of a loop gets hot, the interpreter hands
+// every instruction of the next iteration to trace_record. The recorded path
+// is compiled to straight-line code that jumps back to its own start, with
+// each conditional branch turned into a guard that leaves the trace where
+// execution stops following the recorded path. Arithmetic whose operands
+// were numbers while recording is emitted without the baseline templates'
+// type checks, behind a guard where the compiler cannot tell that an operand
+// is a number. Slots the loop needs to hold numbers are checked once on
+// entry and again on the back-edge only if the body may have changed them.
+// Leaving a trace stores the ip and stack top of the exit point and the
+// interpreter carries on from there.
+
+// Slots and stack entries of the traced frame that the trace compiler keeps
+// track of. Deeper stacks are not traced.
+#define TRACE_MAX_SLOTS 512
+
+typedef struct {
+  bool active;
+  int frame_count; // of the traced frame
+  obj_function_t* function;
+  loop_t* loop;
+  uint8_t* header;
+  int length;
+  uint8_t* ips[TRACE_MAX_LENGTH];
+  int depths[TRACE_MAX_LENGTH]; // stack_top - slots before each instruction
+  bool numeric[TRACE_MAX_LENGTH]; // whether all its operands were numbers
+} recorder_t;
+
+// What the trace compiler knows about a slot or stack entry of the frame.
+typedef struct {
+  bool number;
+  int origin; // slot whose value on entering the loop this still is, or -1
+} slot_info_t;
+
+typedef struct {
+  int at; // offset of the rel32 to patch
+  uint8_t* ip; // where the interpreter resumes
+} trace_exit_t;
+
+typedef struct {
+  assembler_t as;
+  bool captures_locals; // calls may write slots through upvalues
+  slot_info_t slots[TRACE_MAX_SLOTS];
+  bool entry_numbers[TRACE_MAX_SLOTS]; // slots checked on entering the trace
+  bool needed[TRACE_MAX_SLOTS]; // entry values the body guarded on
+  trace_exit_t* exits;
+  int exit_count;
+  int exit_capacity;
+} trace_compiler_t;
+
+static recorder_t recorder;
+
+static void assembler_init(assembler_t* as, obj_function_t* function);
+static void assembler_free(assembler_t* as);
+static void emit_instruction(assembler_t* as, int offset);
+static void emit_prologue(assembler_t* as);
+static void emit_epilogue(assembler_t* as, int error_exit);
+static void emit_byte(assembler_t* as, uint8_t byte);
+static void emit_u32(assembler_t* as, uint32_t value);
+static void emit_u64(assembler_t* as, uint64_t value);
+static void emit_rex_w(assembler_t* as, int reg, int rm);
+static void emit_modrm_reg(assembler_t* as, int reg, int rm);
+static void emit_modrm_mem(assembler_t* as, int reg, int base, int32_t disp);
+static value_t double_form(value_t value);
+static void emit_mov_imm(assembler_t* as, int reg, uint64_t imm);
+static void emit_mov(assembler_t* as, int dst, int src);
+static void emit_load(assembler_t* as, int reg, int base, int32_t disp);
+static void emit_store(assembler_t* as, int base, int32_t disp, int reg);
+static void emit_alu(assembler_t* as, uint8_t opcode, int dst, int src);
+static void emit_alu_imm(assembler_t* as, alu_t op, int reg, int32_t imm);
+static void emit_push(assembler_t* as, int reg);
+static void emit_pop(assembler_t* as, int reg);
+static void emit_peek(assembler_t* as, int reg, int distance);
+static void emit_call(assembler_t* as, void* function);
+static void emit_call_checked(assembler_t* as, void* function);
+static void emit_save_state(assembler_t* as, uint8_t* ip);
+static void emit_bool_from_flags(assembler_t* as, condition_t cc);
+static int emit_jcc(assembler_t* as, condition_t cc);
+static int emit_jmp(assembler_t* as);
+static void emit_jump_to(assembler_t* as, int at, int target);
+static void patch_here(assembler_t* as, int at);
+static void emit_test_falsey(assembler_t* as, int reg);
+static void emit_jump_if_falsey(assembler_t* as, int reg, int target);
+static int emit_jump_if_not_number(assembler_t* as, int reg);
+static void emit_load_xmm_operands(assembler_t* as);
+static void emit_number_op(assembler_t* as, uint8_t op);
+static void emit_binary(assembler_t* as, uint8_t op, uint8_t* next);
+static void emit_binary_constant(assembler_t* as, uint8_t op, value_t b, uint8_t* next);
+static void emit_register_op(assembler_t* as, uint8_t op, int dst, value_t* b, int b_slot, uint8_t* next);
+static void emit_compare_and_jump(assembler_t* as, int a, value_t* b, int b_slot, int target, uint8_t* ip);
+static void emit_slow_op(assembler_t* as, uint8_t op, uint8_t* next);
+static void emit_slow_instruction(assembler_t* as, uint8_t* instruction, uint8_t* next);
+static void emit_load_global_base(assembler_t* as, int reg);
+static void emit_load_upvalue_location(assembler_t* as, int reg, int slot);
+static void emit_get_property(assembler_t* as, uint8_t* instruction, uint8_t* next);
+static void emit_cmp_mem(assembler_t* as, bool wide, int reg, int base, int32_t disp);
+static bool worth_compiling(chunk_t* chunk);
+static void* install(assembler_t* as, size_t* size);
+static void trace_abort();
+static bool trace_observe_numbers(call_frame_t* frame, uint8_t* ip);
+static void trace_compile();
+static void trace_emit(trace_compiler_t* tc);
+static void trace_emit_instruction(trace_compiler_t* tc, int index);
+static void trace_number_operands(trace_compiler_t* tc, int a_slot, value_t* b, int b_slot, uint8_t* ip);
+static void trace_guard_number(trace_compiler_t* tc, int reg, int slot, uint8_t* ip);
+static void trace_branch(trace_compiler_t* tc, condition_t taken, uint8_t* target, uint8_t* fallthrough, uint8_t* next_recorded);
+static void trace_exit_if(trace_compiler_t* tc, int at, uint8_t* ip);
+static void trace_set(trace_compiler_t* tc, int slot, bool number);
+static void trace_forget_all(trace_compiler_t* tc);
+static bool captures_locals(chunk_t* chunk);
+
+void jit_compile(obj_function_t* function) {
+  chunk_t* chunk = &function->chunk;
+  if (!worth_compiling(chunk)) {
+    return;
+  }
+
+  assembler_t as;
+  assembler_init(&as, function);
+  as.native_offsets = malloc(sizeof(int) * chunk->count);
+  if (as.native_offsets == NULL) {
+    return;
+  }
+
+  emit_prologue(&as);
+  for (int offset = 0; offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+    as.native_offsets[offset] = as.count;
+    emit_instruction(&as, offset);
+  }
+  int error_exit = as.count;
+  emit_byte(&as, 0xb8); // mov eax, EXECUTE_RUNTIME_ERROR
+  emit_u32(&as, EXECUTE_RUNTIME_ERROR);
+  emit_epilogue(&as, error_exit);
+
+  function->jit_code = install(&as, &function->jit_size);
+#ifdef DEBUG_LOG_JIT
+  if (function->jit_code != NULL) {
+    printf("-- jit: %s, %d bytes of bytecode -> %d bytes of machine code\n",
+           function->name->chars, chunk->count, as.count);
+  }
+#endif
+  assembler_free(&as);
+}
+
+void jit_free(obj_function_t* function) {
+  if (function->jit_code != NULL) {
+    munmap(function->jit_code, function->jit_size);
+    function->jit_code = NULL;
+  }
+  for (int i = 0; i < function->chunk.loop_count; i++) {
+    loop_t* loop = &function->chunk.loops[i];
+    if (loop->trace != NULL) {
+      munmap(loop->trace, loop->trace_size);
+      loop->trace = NULL;
+    }
+  }
+}
+
+static void assembler_init(assembler_t* as, obj_function_t* function) {
+  as->function = function;
+  as->chunk = &function->chunk;
+  as->code = NULL;
+  as->count = 0;
+  as->capacity = 0;
+  as->native_offsets = NULL;
+  as->fixups = NULL;
+  as->fixup_count = 0;
+  as->fixup_capacity = 0;
+}
+
+static void assembler_free(assembler_t* as) {
+  free(as->code);
+  free(as->native_offsets);
+  free(as->fixups);
+}
+
+static void emit_instruction(assembler_t* as, int offset) {
+  chunk_t* chunk = as->chunk;
+  uint8_t* ip = &chunk->code[offset];
+  uint8_t* next = ip + chunk_instruction_length(chunk, offset);
+  value_t* constants = chunk->constants.values;
+#define OPERAND(i) (ip[1 + (i)])
+#define SHORT_OPERAND(i) ((OPERAND(i) << 8) | OPERAND((i) + 1))
+#define JUMP_TARGET() ((int)(next - chunk->code) + SHORT_OPERAND(0))
+
+  // Quickened instructions are compiled like the generic ones, which handle
+  // every operand type.
+  uint8_t op = chunk_generic_op(*ip);
+  switch (op) {
+    case OP_CONSTANT:
+      emit_mov_imm(as, RAX, double_form(constants[OPERAND(0)]));
+      emit_push(as, RAX);
+      break;
+    case OP_NIL:
+      emit_mov_imm(as, RAX, NIL_VAL);
+      emit_push(as, RAX);
+      break;
+    case OP_TRUE:
+      emit_mov_imm(as, RAX, TRUE_VAL);
+      emit_push(as, RAX);
+      break;
+    case OP_FALSE:
+      emit_mov_imm(as, RAX, FALSE_VAL);
+      emit_push(as, RAX);
+      break;
+    case OP_EQUAL:
+      emit_pop(as, RSI);
+      emit_peek(as, RDI, 0);
+      emit_call(as, (void*)values_equal);
+      emit_byte(as, 0x0f); // movzx eax, al
+      emit_byte(as, 0xb6);
+      emit_byte(as, 0xc0);
+      emit_mov_imm(as, RCX, FALSE_VAL);
+      emit_alu(as, 0x01, RAX, RCX);
+      emit_store(as, STACK_TOP, -8, RAX);
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      emit_binary(as, op, next);
+      break;
+    case OP_NEGATE: {
+      emit_peek(as, RAX, 0);
+      int not_number = emit_jump_if_not_number(as, RAX);
+      emit_mov_imm(as, RCX, SIGN_BIT);
+      emit_alu(as, 0x31, RAX, RCX); // xor
+      emit_store(as, STACK_TOP, -8, RAX);
+      int done = emit_jmp(as);
+      patch_here(as, not_number);
+      emit_slow_op(as, OP_NEGATE, next);
+      patch_here(as, done);
+      break;
+    }
+    case OP_MODULO:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_BIT_NOT:
+      emit_slow_op(as, op, next);
+      break;
+    case OP_NOT:
+      emit_peek(as, RAX, 0);
+      emit_mov_imm(as, RCX, NIL_VAL);
+      emit_alu(as, 0x39, RAX, RCX);
+      emit_byte(as, 0x0f); // sete dl
+      emit_byte(as, 0x94);
+      emit_byte(as, 0xc2);
+      emit_mov_imm(as, RCX, FALSE_VAL);
+      emit_alu(as, 0x39, RAX, RCX);
+      emit_byte(as, 0x0f); // sete al
+      emit_byte(as, 0x94);
+      emit_byte(as, 0xc0);
+      emit_byte(as, 0x08); // or al, dl
+      emit_byte(as, 0xd0);
+      emit_byte(as, 0x0f); // movzx eax, al
+      emit_byte(as, 0xb6);
+      emit_byte(as, 0xc0);
+      emit_alu(as, 0x01, RAX, RCX);
+      emit_store(as, STACK_TOP, -8, RAX);
+      break;
+    case OP_PRINT:
+      emit_pop(as, RDI);
+      emit_call(as, (void*)jit_print);
+      break;
+    case OP_POP:
+      emit_alu_imm(as, ALU_SUB, STACK_TOP, 8);
+      break;
+    case OP_DEFINE_GLOBAL:
+      emit_pop(as, RAX);
+      emit_load_global_base(as, RCX);
+      emit_store(as, RCX, 8 * SHORT_OPERAND(0), RAX);
+      break;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL: {
+      int slot = SHORT_OPERAND(0);
+      emit_load_global_base(as, RCX);
+      emit_load(as, RAX, RCX, 8 * slot);
+      emit_mov_imm(as, RDX, UNDEFINED_VAL);
+      emit_alu(as, 0x39, RAX, RDX);
+      int undefined = emit_jcc(as, CC_E);
+      if (*ip == OP_GET_GLOBAL) {
+        emit_push(as, RAX);
+      } else {
+        emit_peek(as, RAX, 0);
+        emit_store(as, RCX, 8 * slot, RAX);
+      }
+      int done = emit_jmp(as);
+      patch_here(as, undefined);
+      emit_save_state(as, next);
+      emit_mov_imm(as, RDI, (uint64_t)slot);
+      emit_call_checked(as, (void*)jit_undefined_global);
+      patch_here(as, done);
+      break;
+    }
+    case OP_GET_LOCAL:
+      emit_load(as, RAX, SLOTS, 8 * OPERAND(0));
+      emit_push(as, RAX);
+      break;
+    case OP_SET_LOCAL:
+      emit_peek(as, RAX, 0);
+      emit_store(as, SLOTS, 8 * OPERAND(0), RAX);
+      break;
+    case OP_GET_UPVALUE:
+      emit_load_upvalue_location(as, RCX, OPERAND(0));
+      emit_load(as, RAX, RCX, 0);
+      emit_push(as, RAX);
+      break;
+    case OP_RETURN: {
+      emit_load(as, RAX, VM, offsetof(vm_t, open_upvalues));
+      emit_alu(as, 0x85, RAX, RAX); // test
+      int no_upvalues = emit_jcc(as, CC_E);
+      emit_mov(as, RDI, SLOTS);
+      emit_call(as, (void*)jit_close_upvalues);
+      patch_here(as, no_upvalues);
+      emit_pop(as, RAX);
+      // sub dword [vm + frame_count], 1
+      emit_byte(as, 0x40 | ((VM & 8) >> 3));
+      emit_byte(as, 0x83);
+      emit_modrm_mem(as, ALU_SUB, VM, offsetof(vm_t, frame_count));
+      emit_byte(as, 1);
+      emit_mov(as, STACK_TOP, SLOTS);
+      emit_push(as, RAX);
+      emit_store(as, VM, offsetof(vm_t, stack_top), STACK_TOP);
+      emit_byte(as, 0xb8); // mov eax, EXECUTE_OK
+      emit_u32(as, EXECUTE_OK);
+      emit_jump_to(as, emit_jmp(as), LABEL_EPILOGUE);
+      break;
+    }
+    case OP_JUMP:
+      emit_jump_to(as, emit_jmp(as), JUMP_TARGET());
+      break;
+    case OP_LOOP:
+      emit_jump_to(as, emit_jmp(as), (int)(next - chunk->code) - SHORT_OPERAND(0));
+      break;
+    case OP_JUMP_IF_FALSE:
+      emit_peek(as, RAX, 0);
+      emit_jump_if_falsey(as, RAX, JUMP_TARGET());
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+      emit_pop(as, RAX);
+      emit_jump_if_falsey(as, RAX, JUMP_TARGET());
+      break;
+    case OP_CLOSE_UPVALUE:
+      emit_mov(as, RDI, STACK_TOP);
+      emit_alu_imm(as, ALU_SUB, RDI, 8);
+      emit_call(as, (void*)jit_close_upvalues);
+      emit_alu_imm(as, ALU_SUB, STACK_TOP, 8);
+      break;
+    case OP_ADD_LOCALS:
+      emit_load(as, RAX, SLOTS, 8 * OPERAND(0));
+      emit_register_op(as, OP_ADD, -1, NULL, OPERAND(1), next);
+      break;
+    case OP_ADD_CONSTANT:
+      emit_binary_constant(as, OP_ADD, constants[OPERAND(0)], next);
+      break;
+    case OP_SUBTRACT_CONSTANT:
+      emit_binary_constant(as, OP_SUBTRACT, constants[OPERAND(0)], next);
+      break;
+    case OP_LESS_CONSTANT:
+      emit_binary_constant(as, OP_LESS, constants[OPERAND(0)], next);
+      break;
+    case OP_MOVE:
+      emit_load(as, RAX, SLOTS, 8 * OPERAND(1));
+      emit_store(as, SLOTS, 8 * OPERAND(0), RAX);
+      break;
+    case OP_LOAD_CONSTANT:
+      emit_mov_imm(as, RAX, double_form(constants[OPERAND(1)]));
+      emit_store(as, SLOTS, 8 * OPERAND(0), RAX);
+      break;
+    case OP_ADD_RR:
+      emit_load(as, RAX, SLOTS, 8 * OPERAND(1));
+      emit_register_op(as, OP_ADD, OPERAND(0), NULL, OPERAND(2), next);
+      break;
+    case OP_ADD_RK:
+      emit_load(as, RAX, SLOTS, 8 * OPERAND(1));
+      emit_register_op(as, OP_ADD, OPERAND(0), &constants[OPERAND(2)], -1, next);
+      break;
+    case OP_SUBTRACT_RK:
+      emit_load(as, RAX, SLOTS, 8 * OPERAND(1));
+      emit_register_op(as, OP_SUBTRACT, OPERAND(0), &constants[OPERAND(2)], -1, next);
+      break;
+    case OP_JUMP_IF_NOT_LESS_RR:
+      emit_compare_and_jump(as, OPERAND(0), NULL, OPERAND(1), (int)(next - chunk->code) + SHORT_OPERAND(2), ip);
+      break;
+    case OP_JUMP_IF_NOT_LESS_RK:
+      emit_compare_and_jump(as, OPERAND(0), &constants[OPERAND(1)], -1, (int)(next - chunk->code) + SHORT_OPERAND(2), ip);
+      break;
+    case OP_GET_PROPERTY:
+    case OP_GET_LOCAL_PROPERTY:
+      emit_get_property(as, ip, next);
+      break;
+    default:
+      // Calls, stores into objects (which need the GC's write barrier),
+      // closures and class definitions.
+      emit_slow_instruction(as, ip, next);
+      break;
+  }
+
+#undef JUMP_TARGET
+#undef SHORT_OPERAND
+#undef OPERAND
+}
+
+// Saves the callee-saved registers the compiled code uses and loads the
+// interpreter state for the frame passed in rdi.
+static void emit_prologue(assembler_t* as) {
+  emit_byte(as, 0x55); // push rbp
+  emit_byte(as, 0x53); // push rbx
+  emit_byte(as, 0x41); // push r12
+  emit_byte(as, 0x54);
+  emit_byte(as, 0x41); // push r13
+  emit_byte(as, 0x55);
+  emit_byte(as, 0x41); // push r14
+  emit_byte(as, 0x56);
+  emit_byte(as, 0x41); // push r15
+  emit_byte(as, 0x57);
+  // Six pushes and the return address: realign the stack to 16 bytes.
+  emit_alu_imm(as, ALU_SUB, RSP, 8);
+
+  emit_mov(as, FRAME, RDI);
+  emit_load(as, SLOTS, FRAME, offsetof(call_frame_t, slots));
+  emit_mov_imm(as, VM, (uint64_t)(uintptr_t)&vm);
+  emit_load(as, STACK_TOP, VM, offsetof(vm_t, stack_top));
+  emit_mov_imm(as, NAN_MASK, QNAN);
+}
+
+// Emits the shared exit sequence and resolves the jumps recorded so far.
+static void emit_epilogue(assembler_t* as, int error_exit) {
+  int epilogue = as->count;
+  emit_alu_imm(as, ALU_ADD, RSP, 8);
+  emit_byte(as, 0x41); // pop r15
+  emit_byte(as, 0x5f);
+  emit_byte(as, 0x41); // pop r14
+  emit_byte(as, 0x5e);
+  emit_byte(as, 0x41); // pop r13
+  emit_byte(as, 0x5d);
+  emit_byte(as, 0x41); // pop r12
+  emit_byte(as, 0x5c);
+  emit_byte(as, 0x5b); // pop rbx
+  emit_byte(as, 0x5d); // pop rbp
+  emit_byte(as, 0xc3); // ret
+
+  for (int i = 0; i < as->fixup_count; i++) {
+    fixup_t* fixup = &as->fixups[i];
+    int target;
+    if (fixup->target == LABEL_ERROR) {
+      target = error_exit;
+    } else if (fixup->target == LABEL_EPILOGUE) {
+      target = epilogue;
+    } else {
+      target = as->native_offsets[fixup->target];
+    }
+    int32_t rel = target - (fixup->at + 4);
+    memcpy(&as->code[fixup->at], &rel, sizeof(rel));
+  }
+}
+
+static void emit_byte(assembler_t* as, uint8_t byte) {
+  if (as->count + 1 > as->capacity) {
+    as->capacity = GROW_CAPACITY(as->capacity);
+    as->code = realloc(as->code, as->capacity);
+    if (as->code == NULL) {
+      exit(1);
+    }
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit_u32(assembler_t* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit_byte(as, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+static void emit_u64(assembler_t* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emit_byte(as, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+// REX prefix of a 64-bit instruction whose ModRM refers to reg and rm.
+static void emit_rex_w(assembler_t* as, int reg, int rm) {
+  emit_byte(as, 0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+}
+
+static void emit_modrm_reg(assembler_t* as, int reg, int rm) {
+  emit_byte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// ModRM (and SIB) for the memory operand [base + disp].
+static void emit_modrm_mem(assembler_t* as, int reg, int base, int32_t disp) {
+  bool short_disp = disp >= -128 && disp <= 127;
+  emit_byte(as, (short_disp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emit_byte(as, 0x24);
+  }
+  if (short_disp) {
+    emit_byte(as, (uint8_t)disp);
+  } else {
+    emit_u32(as, (uint32_t)disp);
+  }
+}
+
+// Compiled code does its arithmetic on doubles, so number constants are
+// embedded as doubles even if they are boxed as ints. To Lox code both are
+// the same number.
+static value_t double_form(value_t value) {
+  return IS_INT(value) ? NUMBER_VAL(AS_INT(value)) : value;
+}
+
+static void emit_mov_imm(assembler_t* as, int reg, uint64_t imm) {
+  emit_rex_w(as, 0, reg);
+  emit_byte(as, 0xb8 + (reg & 7));
+  emit_u64(as, imm);
+}
+
+static void emit_mov(assembler_t* as, int dst, int src) {
+  emit_alu(as, 0x89, dst, src);
+}
+
+static void emit_load(assembler_t* as, int reg, int base, int32_t disp) {
+  emit_rex_w(as, reg, base);
+  emit_byte(as, 0x8b);
+  emit_modrm_mem(as, reg, base, disp);
+}
+
+static void emit_store(assembler_t* as, int base, int32_t disp, int reg) {
+  emit_rex_w(as, reg, base);
+  emit_byte(as, 0x89);
+  emit_modrm_mem(as, reg, base, disp);
+}
+
+// Two-register instruction in the "op r/m64, r64" form: 0x01 add, 0x31 xor,
+// 0x39 cmp, 0x85 test, 0x89 mov.
+static void emit_alu(assembler_t* as, uint8_t opcode, int dst, int src) {
+  emit_rex_w(as, src, dst);
+  emit_byte(as, opcode);
+  emit_modrm_reg(as, src, dst);
+}
+
+static void emit_alu_imm(assembler_t* as, alu_t op, int reg, int32_t imm) {
+  emit_rex_w(as, 0, reg);
+  if (imm >= -128 && imm <= 127) {
+    emit_byte(as, 0x83);
+    emit_modrm_reg(as, op, reg);
+    emit_byte(as, (uint8_t)imm);
+  } else {
+    emit_byte(as, 0x81);
+    emit_modrm_reg(as, op, reg);
+    emit_u32(as, (uint32_t)imm);
+  }
+}
+
+static void emit_push(assembler_t* as, int reg) {
+  emit_store(as, STACK_TOP, 0, reg);
+  emit_alu_imm(as, ALU_ADD, STACK_TOP, 8);
+}
+
+static void emit_pop(assembler_t* as, int reg) {
+  emit_alu_imm(as, ALU_SUB, STACK_TOP, 8);
+  emit_load(as, reg, STACK_TOP, 0);
+}
+
+static void emit_peek(assembler_t* as, int reg, int distance) {
+  emit_load(as, reg, STACK_TOP, -8 * (distance + 1));
+}
+
+static void emit_call(assembler_t* as, void* function) {
+  emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)function);
+  emit_byte(as, 0xff); // call rax
+  emit_byte(as, 0xd0);
+}
+
+// Calls a runtime function that returns false after reporting a runtime
+// error, and reloads the stack top it may have moved.
+static void emit_call_checked(assembler_t* as, void* function) {
+  emit_call(as, function);
+  emit_byte(as, 0x84); // test al, al
+  emit_byte(as, 0xc0);
+  emit_jump_to(as, emit_jcc(as, CC_E), LABEL_ERROR);
+  emit_load(as, STACK_TOP, VM, offsetof(vm_t, stack_top));
+}
+
+// Stores what the runtime may look at before it is called: the frame's ip,
+// which runtime errors use for line numbers, and the stack top.
+static void emit_save_state(assembler_t* as, uint8_t* ip) {
+  emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)ip);
+  emit_store(as, FRAME, offsetof(call_frame_t, ip), RAX);
+  emit_store(as, VM, offsetof(vm_t, stack_top), STACK_TOP);
+}
+
+// rax = BOOL_VAL(cc).
+static void emit_bool_from_flags(assembler_t* as, condition_t cc) {
+  emit_byte(as, 0x0f); // setcc al
+  emit_byte(as, 0x90 | cc);
+  emit_byte(as, 0xc0);
+  emit_byte(as, 0x0f); // movzx eax, al
+  emit_byte(as, 0xb6);
+  emit_byte(as, 0xc0);
+  emit_mov_imm(as, RCX, FALSE_VAL);
+  emit_alu(as, 0x01, RAX, RCX); // TRUE_VAL is FALSE_VAL + 1
+}
+
+// Emits a conditional jump and returns the offset of its displacement.
+static int emit_jcc(assembler_t* as, condition_t cc) {
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x80 | cc);
+  emit_u32(as, 0);
+  return as->count - 4;
+}
+
+static int emit_jmp(assembler_t* as) {
+  emit_byte(as, 0xe9);
+  emit_u32(as, 0);
+  return as->count - 4;
+}
+
+// Records that the jump at is to the code of bytecode offset target, or to
+// one of the LABEL_ exits.
+static void emit_jump_to(assembler_t* as, int at, int target) {
+  if (as->fixup_count + 1 > as->fixup_capacity) {
+    as->fixup_capacity = GROW_CAPACITY(as->fixup_capacity);
+    as->fixups = realloc(as->fixups, sizeof(fixup_t) * as->fixup_capacity);
+    if (as->fixups == NULL) {
+      exit(1);
+    }
+  }
+  as->fixups[as->fixup_count].at = at;
+  as->fixups[as->fixup_count].target = target;
+  as->fixup_count++;
+}
+
+// Points the jump at to the next instruction emitted.
+static void patch_here(assembler_t* as, int at) {
+  int32_t rel = as->count - (at + 4);
+  memcpy(&as->code[at], &rel, sizeof(rel));
+}
+
+// Sets "below or equal" if reg is falsey. nil and false are adjacent tags,
+// so a single unsigned comparison finds both.
+static void emit_test_falsey(assembler_t* as, int reg) {
+  _Static_assert(FALSE_VAL == NIL_VAL + 1, "falsey values must be adjacent");
+  emit_mov_imm(as, RCX, NIL_VAL);
+  emit_mov(as, RDX, reg);
+  emit_alu(as, 0x29, RDX, RCX); // sub
+  emit_rex_w(as, 0, RDX); // cmp rdx, 1
+  emit_byte(as, 0x83);
+  emit_modrm_reg(as, 7, RDX);
+  emit_byte(as, 1);
+}
+
+static void emit_jump_if_falsey(assembler_t* as, int reg, int target) {
+  emit_test_falsey(as, reg);
+  emit_jump_to(as, emit_jcc(as, CC_BE), target);
+}
+
+// Jumps unless reg holds a number, which is left in reg as a double: an int
+// is converted, as compiled code computes on doubles only.
+static int emit_jump_if_not_number(assembler_t* as, int reg) {
+  emit_mov(as, R11, reg);
+  emit_rex_w(as, NAN_MASK, R11); // and r11, r15
+  emit_byte(as, 0x21);
+  emit_modrm_reg(as, NAN_MASK, R11);
+  emit_alu(as, 0x39, R11, NAN_MASK);
+  int is_double = emit_jcc(as, CC_NE);
+
+  emit_mov(as, R11, reg);
+  emit_rex_w(as, 0, R11); // shr r11, 32
+  emit_byte(as, 0xc1);
+  emit_modrm_reg(as, 5, R11);
+  emit_byte(as, 32);
+  emit_byte(as, 0x41); // cmp r11d, INT_TAG >> 32
+  emit_byte(as, 0x81);
+  emit_modrm_reg(as, 7, R11);
+  emit_u32(as, (uint32_t)(INT_TAG >> 32));
+  int not_number = emit_jcc(as, CC_NE);
+  emit_byte(as, 0xf2); // cvtsi2sd xmm0, reg (low 32 bits)
+  if (reg >= R8) {
+    emit_byte(as, 0x41);
+  }
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x2a);
+  emit_modrm_reg(as, 0, reg);
+  emit_byte(as, 0x66); // movq reg, xmm0
+  emit_rex_w(as, 0, reg);
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x7e);
+  emit_modrm_reg(as, 0, reg);
+  patch_here(as, is_double);
+  return not_number;
+}
+
+// xmm0 = rax, xmm1 = rdx.
+static void emit_load_xmm_operands(assembler_t* as) {
+  emit_byte(as, 0x66); // movq xmm0, rax
+  emit_rex_w(as, 0, RAX);
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x6e);
+  emit_modrm_reg(as, 0, RAX);
+  emit_byte(as, 0x66); // movq xmm1, rdx
+  emit_rex_w(as, 1, RDX);
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x6e);
+  emit_modrm_reg(as, 1, RDX);
+}
+
+// rax = rax op rdx for two numbers.
+static void emit_number_op(assembler_t* as, uint8_t op) {
+  emit_load_xmm_operands(as);
+  if (op == OP_LESS || op == OP_GREATER) {
+    // "above" is false for unordered operands, so NaN compares false. a < b
+    // is tested as b > a.
+    emit_byte(as, 0x66); // ucomisd
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x2e);
+    emit_modrm_reg(as, op == OP_LESS ? 1 : 0, op == OP_LESS ? 0 : 1);
+    emit_bool_from_flags(as, CC_A);
+    return;
+  }
+
+  uint8_t sse_op;
+  switch (op) {
+    case OP_ADD:      sse_op = 0x58; break;
+    case OP_SUBTRACT: sse_op = 0x5c; break;
+    case OP_MULTIPLY: sse_op = 0x59; break;
+    default:          sse_op = 0x5e; break; // OP_DIVIDE
+  }
+  emit_byte(as, 0xf2); // op xmm0, xmm1
+  emit_byte(as, 0x0f);
+  emit_byte(as, sse_op);
+  emit_modrm_reg(as, 0, 1);
+  emit_byte(as, 0x66); // movq rax, xmm0
+  emit_rex_w(as, 0, RAX);
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x7e);
+  emit_modrm_reg(as, 0, RAX);
+}
+
+// Binary instruction on the two values on top of the stack.
+static void emit_binary(assembler_t* as, uint8_t op, uint8_t* next) {
+  emit_peek(as, RAX, 1);
+  emit_peek(as, RDX, 0);
+  int a_not_number = emit_jump_if_not_number(as, RAX);
+  int b_not_number = emit_jump_if_not_number(as, RDX);
+  emit_number_op(as, op);
+  emit_store(as, STACK_TOP, -16, RAX);
+  emit_alu_imm(as, ALU_SUB, STACK_TOP, 8);
+  int done = emit_jmp(as);
+  patch_here(as, a_not_number);
+  patch_here(as, b_not_number);
+  emit_slow_op(as, op, next);
+  patch_here(as, done);
+}
+
+// Binary instruction on the top of the stack and constant b.
+static void emit_binary_constant(assembler_t* as, uint8_t op, value_t b, uint8_t* next) {
+  emit_peek(as, RAX, 0);
+  emit_mov_imm(as, RDX, double_form(b));
+  if (!IS_NUMBER(b)) {
+    emit_push(as, RDX);
+    emit_slow_op(as, op, next);
+    return;
+  }
+
+  int not_number = emit_jump_if_not_number(as, RAX);
+  emit_number_op(as, op);
+  emit_store(as, STACK_TOP, -8, RAX);
+  int done = emit_jmp(as);
+  patch_here(as, not_number);
+  emit_push(as, RDX);
+  emit_slow_op(as, op, next);
+  patch_here(as, done);
+}
+
+// Addition or subtraction of rax and either constant b or slot b_slot. The
+// result goes to slot dst, or is pushed if dst is -1. Like the interpreter,
+// the slow path works on operands pushed on the stack.
+static void emit_register_op(assembler_t* as, uint8_t op, int dst, value_t* b, int b_slot, uint8_t* next) {
+  int jumps[2];
+  int jump_count = 0;
+  if (b != NULL) {
+    emit_mov_imm(as, RDX, double_form(*b));
+  } else {
+    emit_load(as, RDX, SLOTS, 8 * b_slot);
+  }
+
+  int done = -1;
+  if (b == NULL || IS_NUMBER(*b)) {
+    jumps[jump_count++] = emit_jump_if_not_number(as, RAX);
+    if (b == NULL) {
+      jumps[jump_count++] = emit_jump_if_not_number(as, RDX);
+    }
+    emit_number_op(as, op);
+    if (dst == -1) {
+      emit_push(as, RAX);
+    } else {
+      emit_store(as, SLOTS, 8 * dst, RAX);
+    }
+    done = emit_jmp(as);
+  }
+
+  for (int i = 0; i < jump_count; i++) {
+    patch_here(as, jumps[i]);
+  }
+  emit_push(as, RAX);
+  emit_push(as, RDX);
+  emit_slow_op(as, op, next);
+  if (dst != -1) {
+    emit_pop(as, RAX);
+    emit_store(as, SLOTS, 8 * dst, RAX);
+  }
+  if (done != -1) {
+    patch_here(as, done);
+  }
+}
+
+// Jumps to target unless slot a is less than constant b or slot b_slot.
+static void emit_compare_and_jump(assembler_t* as, int a, value_t* b, int b_slot, int target, uint8_t* ip) {
+  emit_load(as, RAX, SLOTS, 8 * a);
+  if (b != NULL) {
+    emit_mov_imm(as, RDX, double_form(*b));
+  } else {
+    emit_load(as, RDX, SLOTS, 8 * b_slot);
+  }
+
+  int done = -1;
+  int jumps[2];
+  int jump_count = 0;
+  if (b == NULL || IS_NUMBER(*b)) {
+    jumps[jump_count++] = emit_jump_if_not_number(as, RAX);
+    if (b == NULL) {
+      jumps[jump_count++] = emit_jump_if_not_number(as, RDX);
+    }
+    emit_load_xmm_operands(as);
+    emit_byte(as, 0x66); // ucomisd xmm1, xmm0
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x2e);
+    emit_modrm_reg(as, 1, 0);
+    // Not above also covers unordered operands, which are never less.
+    emit_jump_to(as, emit_jcc(as, CC_BE), target);
+    done = emit_jmp(as);
+  }
+
+  // Not numbers: this always fails. The error is reported before the jump
+  // offset is read, as in the interpreter.
+  for (int i = 0; i < jump_count; i++) {
+    patch_here(as, jumps[i]);
+  }
+  emit_push(as, RAX);
+  emit_push(as, RDX);
+  emit_slow_op(as, OP_LESS, ip + 3);
+  if (done != -1) {
+    patch_here(as, done);
+  }
+}
+
+static void emit_slow_op(assembler_t* as, uint8_t op, uint8_t* next) {
+  emit_save_state(as, next);
+  emit_mov_imm(as, RDI, op);
+  emit_call_checked(as, (void*)jit_slow_op);
+}
+
+static void emit_slow_instruction(assembler_t* as, uint8_t* instruction, uint8_t* next) {
+  emit_save_state(as, next);
+  emit_mov_imm(as, RDI, (uint64_t)(uintptr_t)instruction);
+  emit_call_checked(as, (void*)jit_slow_instruction);
+}
+
+static void emit_load_global_base(assembler_t* as, int reg) {
+  emit_load(as, reg, VM, offsetof(vm_t, globals) + offsetof(value_array_t, values));
+}
+
+// reg = frame->closure->upvalues[slot]->location.
+static void emit_load_upvalue_location(assembler_t* as, int reg, int slot) {
+  emit_load(as, reg, FRAME, offsetof(call_frame_t, closure));
+  emit_load(as, reg, reg, offsetof(obj_closure_t, upvalues));
+  emit_load(as, reg, reg, 8 * slot);
+  emit_load(as, reg, reg, offsetof(obj_upvalue_t, location));
+}
+
+// OP_GET_PROPERTY or OP_GET_LOCAL_PROPERTY. A receiver that hits the first
+// entry of the inline cache with a field is handled inline, anything else
+// goes through the runtime.
+static void emit_get_property(assembler_t* as, uint8_t* instruction, uint8_t* next) {
+  bool local = *instruction == OP_GET_LOCAL_PROPERTY;
+  uint8_t* operands = instruction + (local ? 2 : 1);
+  inline_cache_t* cache = &as->chunk->caches[(operands[1] << 8) | operands[2]];
+  cache_entry_t* entry = &cache->entries[0];
+  int slow[6];
+
+  if (local) {
+    emit_load(as, RAX, SLOTS, 8 * instruction[1]);
+  } else {
+    emit_peek(as, RAX, 0);
+  }
+  emit_mov_imm(as, RCX, SIGN_BIT | QNAN);
+  emit_mov(as, RDX, RAX);
+  emit_alu(as, 0x21, RDX, RCX); // and
+  emit_alu(as, 0x39, RDX, RCX);
+  slow[0] = emit_jcc(as, CC_NE);
+  emit_rex_w(as, 0, RCX); // not rcx
+  emit_byte(as, 0xf7);
+  emit_modrm_reg(as, 2, RCX);
+  emit_alu(as, 0x21, RAX, RCX);
+  emit_byte(as, 0x80); // cmp byte [rax + type], OBJ_INSTANCE
+  emit_modrm_mem(as, 7, RAX, offsetof(obj_t, type));
+  emit_byte(as, OBJ_INSTANCE);
+  slow[1] = emit_jcc(as, CC_NE);
+
+  emit_mov_imm(as, RCX, (uint64_t)(uintptr_t)entry);
+  emit_load(as, RDX, RAX, offsetof(obj_instance_t, klass));
+  emit_cmp_mem(as, true, RDX, RCX, offsetof(cache_entry_t, klass));
+  slow[2] = emit_jcc(as, CC_NE);
+  emit_byte(as, 0x8b); // mov edx, [rdx + method_version]
+  emit_modrm_mem(as, RDX, RDX, offsetof(obj_class_t, method_version));
+  emit_cmp_mem(as, false, RDX, RCX, offsetof(cache_entry_t, version));
+  slow[3] = emit_jcc(as, CC_NE);
+  emit_load(as, RDX, RAX, offsetof(obj_instance_t, shape));
+  emit_cmp_mem(as, true, RDX, RCX, offsetof(cache_entry_t, shape));
+  slow[4] = emit_jcc(as, CC_NE);
+  emit_rex_w(as, RDX, RCX); // movsxd rdx, dword [rcx + slot]
+  emit_byte(as, 0x63);
+  emit_modrm_mem(as, RDX, RCX, offsetof(cache_entry_t, slot));
+  emit_alu(as, 0x85, RDX, RDX);
+  slow[5] = emit_jcc(as, CC_S);
+  emit_load(as, RAX, RAX, offsetof(obj_instance_t, fields));
+  emit_rex_w(as, RAX, RAX); // mov rax, [rax + rdx * 8]
+  emit_byte(as, 0x8b);
+  emit_byte(as, 0x04);
+  emit_byte(as, 0xd0);
+  if (local) {
+    emit_push(as, RAX);
+  } else {
+    emit_store(as, STACK_TOP, -8, RAX);
+  }
+  int done = emit_jmp(as);
+
+  for (int i = 0; i < 6; i++) {
+    patch_here(as, slow[i]);
+  }
+  emit_slow_instruction(as, instruction, next);
+  patch_here(as, done);
+}
+
+// cmp reg, [base + disp], on 64-bit registers if wide and 32-bit otherwise.
+static void emit_cmp_mem(assembler_t* as, bool wide, int reg, int base, int32_t disp) {
+  if (wide) {
+    emit_rex_w(as, reg, base);
+  }
+  emit_byte(as, 0x3b);
+  emit_modrm_mem(as, reg, base, disp);
+}
+
+// Entering and leaving native code costs about as much as interpreting a few
+// instructions, so straight-line functions that make no calls, such as
+// getters, are left to the interpreter. So are functions with tail calls:
+// compiled code runs its frame to completion on the native stack, and could
+// not hand it over to the callee.
+static bool worth_compiling(chunk_t* chunk) {
+  bool worth = false;
+  for (int offset = 0; offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+    switch (chunk->code[offset]) {
+      case OP_LOOP:
+      case OP_CALL:
+      case OP_INVOKE:
+      case OP_SUPER_INVOKE:
+        worth = true;
+        break;
+      case OP_TAIL_CALL:
+      case OP_TAIL_INVOKE:
+      case OP_TAIL_SUPER_INVOKE:
+        return false;
+    }
+  }
+  return worth;
+}
+
+// Copies the generated code to executable pages and returns them, or NULL if
+// that fails, in which case the code just stays interpreted.
+static void* install(assembler_t* as, size_t* size) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  *size = ((size_t)as->count + page_size - 1) / page_size * page_size;
+  void* code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return NULL;
+  }
+  memcpy(code, as->code, as->count);
+  if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, *size);
+    return NULL;
+  }
+  return code;
+}
+
+bool trace_start(loop_t* loop, uint8_t* header) {
+  if (recorder.active) {
+    return false;
+  }
+  recorder.active = true;
+  recorder.frame_count = vm.frame_count;
+  recorder.function = vm.frames[vm.frame_count - 1].closure->function;
+  recorder.loop = loop;
+  recorder.header = header;
+  recorder.length = 0;
+  return true;
+}
+
+bool trace_record(uint8_t* ip) {
+  if (!recorder.active) {
+    return false;
+  }
+  // A trace makes calls like the baseline code does, and re-entering the
+  // interpreter for a callee that is not compiled costs more than the trace
+  // saves, so loops that call interpreted functions are not traced.
+  call_frame_t* frame = &vm.frames[vm.frame_count - 1];
+  if (vm.frame_count != recorder.frame_count || frame->closure->function != recorder.function) {
+    trace_abort();
+    return false;
+  }
+  if (ip == recorder.header && recorder.length > 0) {
+    trace_compile();
+    recorder.active = false;
+    return false;
+  }
+
+  int depth = (int)(vm.stack_top - frame->slots);
+  if (recorder.length == TRACE_MAX_LENGTH || depth >= TRACE_MAX_SLOTS) {
+    trace_abort();
+    return false;
+  }
+  switch (*ip) {
+    case OP_RETURN:
+    case OP_TAIL_CALL:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+      trace_abort();
+      return false;
+    case OP_LOOP: {
+      // An inner loop that has a trace of its own would run it instead of
+      // being recorded.
+      loop_t* loop = &recorder.function->chunk.loops[(ip[3] << 8) | ip[4]];
+      if (loop != recorder.loop && loop->trace != NULL) {
+        trace_abort();
+        return false;
+      }
+      break;
+    }
+  }
+
+  recorder.ips[recorder.length] = ip;
+  recorder.depths[recorder.length] = depth;
+  recorder.numeric[recorder.length] = trace_observe_numbers(frame, ip);
+  recorder.length++;
+  return true;
+}
+
+void trace_reset() {
+  if (recorder.active) {
+    trace_abort();
+  }
+}
+
+// Gives up on the recording. The loop is recorded again once it gets hot
+// again, unless it has failed too often already.
+static void trace_abort() {
+  loop_t* loop = recorder.loop;
+  loop->aborts++;
+  loop->hotness = loop->aborts < TRACE_MAX_ABORTS ? 0 : INT32_MIN;
+  recorder.active = false;
+}
+
+static bool trace_observe_numbers(call_frame_t* frame, uint8_t* ip) {
+  value_t* slots = frame->slots;
+  value_t* top = vm.stack_top;
+  value_t* constants = recorder.function->chunk.constants.values;
+  switch (chunk_generic_op(*ip)) {
+    case OP_NEGATE:
+      return IS_NUMBER(top[-1]);
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return IS_NUMBER(top[-2]) && IS_NUMBER(top[-1]);
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+      return IS_NUMBER(top[-1]) && IS_NUMBER(constants[ip[1]]);
+    case OP_ADD_LOCALS:
+    case OP_JUMP_IF_NOT_LESS_RR:
+      return IS_NUMBER(slots[ip[1]]) && IS_NUMBER(slots[ip[2]]);
+    case OP_JUMP_IF_NOT_LESS_RK:
+      return IS_NUMBER(slots[ip[1]]) && IS_NUMBER(constants[ip[2]]);
+    case OP_ADD_RR:
+      return IS_NUMBER(slots[ip[2]]) && IS_NUMBER(slots[ip[3]]);
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+      return IS_NUMBER(slots[ip[2]]) && IS_NUMBER(constants[ip[3]]);
+    default:
+      return false;
+  }
+}
+
+static void trace_compile() {
+  trace_compiler_t tc;
+  tc.captures_locals = captures_locals(&recorder.function->chunk);
+  memset(tc.entry_numbers, 0, sizeof(tc.entry_numbers));
+
+  // The first pass finds the loop-entry values that the body needs to be
+  // numbers. The second checks those once on entry and compiles the body
+  // knowing they are.
+  trace_emit(&tc);
+  memcpy(tc.entry_numbers, tc.needed, sizeof(tc.needed));
+  assembler_free(&tc.as);
+  free(tc.exits);
+  trace_emit(&tc);
+
+  size_t size;
+  void* code = install(&tc.as, &size);
+#ifdef DEBUG_LOG_JIT
+  if (code != NULL) {
+    obj_string_t* name = recorder.function->name;
+    printf("-- trace: %s loop%d, %d instructions -> %d bytes of machine code\n",
+           name != NULL ? name->chars : "script", (int)(recorder.loop - recorder.function->chunk.loops),
+           recorder.length, tc.as.count);
+  }
+#endif
+  assembler_free(&tc.as);
+  free(tc.exits);
+  if (code == NULL) {
+    trace_abort();
+    return;
+  }
+  recorder.loop->trace = code;
+  recorder.loop->trace_size = size;
+}
+
+static void trace_emit(trace_compiler_t* tc) {
+  assembler_t* as = &tc->as;
+  assembler_init(as, recorder.function);
+  tc->exits = NULL;
+  tc->exit_count = 0;
+  tc->exit_capacity = 0;
+  memset(tc->needed, 0, sizeof(tc->needed));
+  int depth = recorder.depths[0];
+  for (int slot = 0; slot < TRACE_MAX_SLOTS; slot++) {
+    tc->slots[slot].number = tc->entry_numbers[slot];
+    tc->slots[slot].origin = slot < depth ? slot : -1;
+  }
+
+  // Number checks store the value back in case it was an int converted to a
+  // double, so that it can be used from its slot without another check.
+  emit_prologue(as);
+  for (int slot = 0; slot < depth; slot++) {
+    if (tc->entry_numbers[slot]) {
+      emit_load(as, RAX, SLOTS, 8 * slot);
+      trace_exit_if(tc, emit_jump_if_not_number(as, RAX), recorder.header);
+      emit_store(as, SLOTS, 8 * slot, RAX);
+    }
+  }
+  int loop_start = as->count;
+  for (int i = 0; i < recorder.length; i++) {
+    trace_emit_instruction(tc, i);
+  }
+  // The next iteration assumes the entry checks still hold.
+  for (int slot = 0; slot < depth; slot++) {
+    if (tc->entry_numbers[slot] && !tc->slots[slot].number) {
+      emit_load(as, RAX, SLOTS, 8 * slot);
+      trace_exit_if(tc, emit_jump_if_not_number(as, RAX), recorder.header);
+      emit_store(as, SLOTS, 8 * slot, RAX);
+    }
+  }
+  int back_edge = emit_jmp(as);
+  int32_t rel = loop_start - (back_edge + 4);
+  memcpy(&as->code[back_edge], &rel, sizeof(rel));
+
+  for (int i = 0; i < tc->exit_count; i++) {
+    patch_here(as, tc->exits[i].at);
+    emit_save_state(as, tc->exits[i].ip);
+    emit_byte(as, 0xb8); // mov eax, EXECUTE_OK
+    emit_u32(as, EXECUTE_OK);
+    emit_jump_to(as, emit_jmp(as), LABEL_EPILOGUE);
+  }
+  int error_exit = as->count;
+  emit_byte(as, 0xb8); // mov eax, EXECUTE_RUNTIME_ERROR
+  emit_u32(as, EXECUTE_RUNTIME_ERROR);
+  emit_epilogue(as, error_exit);
+}
+
+static void trace_emit_instruction(trace_compiler_t* tc, int index) {
+  assembler_t* as = &tc->as;
+  chunk_t* chunk = as->chunk;
+  uint8_t* ip = recorder.ips[index];
+  int offset = (int)(ip - chunk->code);
+  uint8_t* next = ip + chunk_instruction_length(chunk, offset);
+  bool last = index + 1 == recorder.length;
+  uint8_t* next_recorded = last ? recorder.header : recorder.ips[index + 1];
+  int depth = recorder.depths[index];
+  int depth_after = last ? recorder.depths[0] : recorder.depths[index + 1];
+  bool numeric = recorder.numeric[index];
+  value_t* constants = chunk->constants.values;
+  uint8_t op = chunk_generic_op(*ip);
+
+  switch (op) {
+    case OP_JUMP:
+    case OP_LOOP:
+      // The recorded path simply continues at the target.
+      break;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      if (op == OP_JUMP_IF_FALSE) {
+        emit_peek(as, RAX, 0);
+      } else {
+        emit_pop(as, RAX);
+      }
+      emit_test_falsey(as, RAX);
+      trace_branch(tc, CC_BE, next + ((ip[1] << 8) | ip[2]), next, next_recorded);
+      break;
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+      if (!numeric) {
+        // This raises an error; let the interpreter report it.
+        trace_exit_if(tc, emit_jmp(as), ip);
+        break;
+      }
+      if (op == OP_JUMP_IF_NOT_LESS_RR) {
+        trace_number_operands(tc, ip[1], NULL, ip[2], ip);
+      } else {
+        trace_number_operands(tc, ip[1], &constants[ip[2]], -1, ip);
+      }
+      emit_load_xmm_operands(as);
+      emit_byte(as, 0x66); // ucomisd xmm1, xmm0
+      emit_byte(as, 0x0f);
+      emit_byte(as, 0x2e);
+      emit_modrm_reg(as, 1, 0);
+      trace_branch(tc, CC_BE, next + ((ip[3] << 8) | ip[4]), next, next_recorded);
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      if (!numeric) {
+        goto generic;
+      }
+      trace_number_operands(tc, depth - 2, NULL, depth - 1, ip);
+      emit_number_op(as, op);
+      emit_store(as, STACK_TOP, -16, RAX);
+      emit_alu_imm(as, ALU_SUB, STACK_TOP, 8);
+      trace_set(tc, depth - 2, op != OP_GREATER && op != OP_LESS);
+      break;
+    case OP_NEGATE:
+      if (!numeric) {
+        goto generic;
+      }
+      emit_peek(as, RAX, 0);
+      trace_guard_number(tc, RAX, depth - 1, ip);
+      emit_mov_imm(as, RCX, SIGN_BIT);
+      emit_alu(as, 0x31, RAX, RCX); // xor
+      emit_store(as, STACK_TOP, -8, RAX);
+      trace_set(tc, depth - 1, true);
+      break;
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+      if (!numeric) {
+        goto generic;
+      }
+      trace_number_operands(tc, depth - 1, &constants[ip[1]], -1, ip);
+      emit_number_op(as, op == OP_ADD_CONSTANT ? OP_ADD : op == OP_SUBTRACT_CONSTANT ? OP_SUBTRACT : OP_LESS);
+      emit_store(as, STACK_TOP, -8, RAX);
+      trace_set(tc, depth - 1, op != OP_LESS_CONSTANT);
+      break;
+    case OP_ADD_LOCALS:
+      if (!numeric) {
+        goto generic;
+      }
+      trace_number_operands(tc, ip[1], NULL, ip[2], ip);
+      emit_number_op(as, OP_ADD);
+      emit_push(as, RAX);
+      trace_set(tc, depth, true);
+      break;
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+      if (!numeric) {
+        emit_instruction(as, offset);
+        trace_set(tc, ip[1], false);
+        break;
+      }
+      if (op == OP_ADD_RR) {
+        trace_number_operands(tc, ip[2], NULL, ip[3], ip);
+      } else {
+        trace_number_operands(tc, ip[2], &constants[ip[3]], -1, ip);
+      }
+      emit_number_op(as, op == OP_SUBTRACT_RK ? OP_SUBTRACT : OP_ADD);
+      emit_store(as, SLOTS, 8 * ip[1], RAX);
+      trace_set(tc, ip[1], true);
+      break;
+    case OP_CONSTANT:
+      emit_instruction(as, offset);
+      trace_set(tc, depth, IS_NUMBER(constants[ip[1]]));
+      break;
+    case OP_LOAD_CONSTANT:
+      emit_instruction(as, offset);
+      trace_set(tc, ip[1], IS_NUMBER(constants[ip[2]]));
+      break;
+    case OP_GET_LOCAL:
+      emit_instruction(as, offset);
+      tc->slots[depth] = tc->slots[ip[1]];
+      break;
+    case OP_SET_LOCAL:
+      emit_instruction(as, offset);
+      tc->slots[ip[1]] = tc->slots[depth - 1];
+      break;
+    case OP_MOVE:
+      emit_instruction(as, offset);
+      tc->slots[ip[1]] = tc->slots[ip[2]];
+      break;
+    case OP_POP:
+      emit_instruction(as, offset);
+      break;
+    default:
+    generic:
+      // Everything else is compiled like the baseline does, producing a
+      // value of unknown type on top of the stack, if anything.
+      emit_instruction(as, offset);
+      if (tc->captures_locals) {
+        trace_forget_all(tc);
+      }
+      if (depth_after > 0) {
+        trace_set(tc, depth_after - 1, false);
+      }
+      break;
+  }
+}
+
+// Loads slot a_slot into rax and either constant b or slot b_slot into rdx,
+// leaving the trace at ip unless both are numbers.
+static void trace_number_operands(trace_compiler_t* tc, int a_slot, value_t* b, int b_slot, uint8_t* ip) {
+  assembler_t* as = &tc->as;
+  emit_load(as, RAX, SLOTS, 8 * a_slot);
+  if (b != NULL) {
+    emit_mov_imm(as, RDX, double_form(*b));
+  } else {
+    emit_load(as, RDX, SLOTS, 8 * b_slot);
+  }
+  trace_guard_number(tc, RAX, a_slot, ip);
+  if (b == NULL) {
+    trace_guard_number(tc, RDX, b_slot, ip);
+  }
+}
+
+// Leaves the trace at ip unless reg, loaded from slot, holds a number. The
+// check is left out if the slot is already known to hold one, and every
+// copy of the same value is known to hold one afterwards.
+static void trace_guard_number(trace_compiler_t* tc, int reg, int slot, uint8_t* ip) {
+  slot_info_t* info = &tc->slots[slot];
+  if (info->number) {
+    return;
+  }
+  trace_exit_if(tc, emit_jump_if_not_number(&tc->as, reg), ip);
+  emit_store(&tc->as, SLOTS, 8 * slot, reg);
+  info->number = true;
+  int origin = info->origin;
+  if (origin != -1) {
+    tc->needed[origin] = true;
+    for (int i = 0; i < TRACE_MAX_SLOTS; i++) {
+      if (tc->slots[i].origin == origin) {
+        tc->slots[i].number = true;
+      }
+    }
+  }
+}
+
+// Emits the guard of a conditional jump whose flags are set, taken under
+// condition taken: the trace is left where execution goes the other way
+// than it did while recording.
+static void trace_branch(trace_compiler_t* tc, condition_t taken, uint8_t* target, uint8_t* fallthrough, uint8_t* next_recorded) {
+  if (target == fallthrough) {
+    return;
+  }
+  if (next_recorded == target) {
+    // Flipping the low bit of a condition code negates it.
+    trace_exit_if(tc, emit_jcc(&tc->as, (condition_t)(taken ^ 1)), fallthrough);
+  } else {
+    trace_exit_if(tc, emit_jcc(&tc->as, taken), target);
+  }
+}
+
+// Records that the jump at leaves the trace, resuming the interpreter at ip.
+static void trace_exit_if(trace_compiler_t* tc, int at, uint8_t* ip) {
+  if (tc->exit_count + 1 > tc->exit_capacity) {
+    tc->exit_capacity = GROW_CAPACITY(tc->exit_capacity);
+    tc->exits = realloc(tc->exits, sizeof(trace_exit_t) * tc->exit_capacity);
+    if (tc->exits == NULL) {
+      exit(1);
+    }
+  }
+  tc->exits[tc->exit_count].at = at;
+  tc->exits[tc->exit_count].ip = ip;
+  tc->exit_count++;
+}
+
+static void trace_set(trace_compiler_t* tc, int slot, bool number) {
+  tc->slots[slot].number = number;
+  tc->slots[slot].origin = -1;
+}
+
+static void trace_forget_all(trace_compiler_t* tc) {
+  for (int slot = 0; slot < TRACE_MAX_SLOTS; slot++) {
+    trace_set(tc, slot, false);
+  }
+}
+
+// Whether the chunk creates closures over its own locals. Those can be
+// written by any call while the upvalues are open.
+static bool captures_locals(chunk_t* chunk) {
+  for (int offset = 0; offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+    if (chunk->code[offset] != OP_CLOSURE) {
+      continue;
+    }
+    obj_function_t* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    for (int i = 0; i < function->upvalue_count; i++) {
+      if (chunk->code[offset + 2 + 2 * i]) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+#else
+
+void jit_compile(obj_function_t* function) {
+  (void)function; // unused
+}
+
+void jit_free(obj_function_t* function) {
+  (void)function; // unused
+}
+
+#endif // JIT
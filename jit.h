@@ -0,0 +1,71 @@
+#ifndef _CLOX_JIT_H
+#define _CLOX_JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "vm.h"
+
+// The baseline JIT emits x86-64 code that works on NaN-boxed values, so it
+// is only built for that configuration. Everywhere else functions are always
+// interpreted.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define JIT
+#endif
+
+// Functions are compiled to native code once they have been called this many
+// times.
+#define JIT_CALL_THRESHOLD 100
+// A trace of a loop is recorded once its back-edge has been taken this many
+// times, and abandoned if it grows longer than TRACE_MAX_LENGTH instructions.
+// Loops that fail to record TRACE_MAX_ABORTS times are left alone.
+#define TRACE_HOT_LOOP 50
+#define TRACE_MAX_LENGTH 256
+#define TRACE_MAX_ABORTS 3
+
+typedef struct {
+  bool enabled;
+} jit_options_t;
+
+extern jit_options_t jit_options;
+
+// Compiles function to native code, leaving jit_code NULL if it uses an
+// instruction the JIT does not support.
+void jit_compile(obj_function_t* function);
+void jit_free(obj_function_t* function);
+typedef execute_result_t (*jit_entry_t)(call_frame_t* frame);
+
+// Runs frame, whose function has been compiled, until it returns.
+static inline execute_result_t jit_run(call_frame_t* frame) {
+  jit_entry_t entry = (jit_entry_t)frame->closure->function->jit_code;
+  return entry(frame);
+}
+
+// Starts recording a trace of loop, whose back-edge in the current frame
+// jumps to header. Returns false if another recording is in progress.
+bool trace_start(loop_t* loop, uint8_t* header);
+// Records the instruction at ip, which is about to run. Returns false once
+// the recording is over, whether the trace was compiled or abandoned.
+bool trace_record(uint8_t* ip);
+// Abandons any recording in progress, after a runtime error.
+void trace_reset();
+
+// Runs the trace of loop from its header until a guard fails. frame->ip is
+// left at the instruction to continue interpreting from.
+static inline execute_result_t trace_run(loop_t* loop, call_frame_t* frame) {
+  jit_entry_t entry = (jit_entry_t)loop->trace;
+  return entry(frame);
+}
+
+#ifdef JIT
+// Runtime entry points for compiled code, implemented in vm.c. The generated
+// code stores frame->ip and vm.stack_top before calling any of them.
+bool jit_slow_op(uint8_t op);
+bool jit_slow_instruction(uint8_t* instruction);
+bool jit_undefined_global(int slot);
+void jit_close_upvalues(value_t* last);
+void jit_print(value_t value);
+#endif
+
+#endif // _CLOX_JIT_H
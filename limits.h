@@ -5,5 +5,9 @@
 #define LOCALS_MAX (UINT8_MAX+1)
 #define STACK_MAX (FRAMES_MAX*LOCALS_MAX)
 #define FRAMES_MAX 64
+// Instances with more fields than this, or whose shape already has this many
+// transitions, fall back to a dictionary of fields.
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 32
 
 #endif // _CLOX_LIMITS_H
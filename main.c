@@ -1,31 +1,70 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "memory.h"
 #include "vm.h"
 
+static void usage(const char* program);
 static void run_repl();
 static void run_script(const char* path);
 static char* read_file(const char* path);
 
 int main(int argc, char* argv[]) {
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stack-code") == 0) {
+      compiler_options.register_code = false;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      jit_options.enabled = false;
+    } else if (strcmp(argv[i], "-O") == 0) {
+      compiler_options.optimize = true;
+    } else if (strncmp(argv[i], "--gc-slice=", 11) == 0) {
+      gc_options.max_slice_us = atoi(argv[i] + 11);
+    } else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+      gc_options.concurrent = true;
+    } else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+      gc_options.threads = atoi(argv[i] + 13);
+    } else if (strncmp(argv[i], "--gc-compact=", 13) == 0) {
+      gc_options.compact_percent = atoi(argv[i] + 13);
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      gc_options.print_stats = true;
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
   vm_init();
 
-  if (argc == 1) {
+  if (path == NULL) {
     run_repl();
-  } else if (argc == 2) {
-    const char* path = argv[1];
-    run_script(path);
   } else {
-    fprintf(stderr, "Usage: %s [path]\n", argv[0]);
-    return 1;
+    run_script(path);
   }
 
   vm_free();
   return 0;
 }
 
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--stack-code] [--no-jit] [-O] [--gc-slice=US] [--gc-concurrent] [--gc-threads=N] [--gc-compact=PCT] [--gc-stats] [path]\n", program);
+  fprintf(stderr, "  --stack-code  compile locals to pure stack code instead of register instructions\n");
+  fprintf(stderr, "  --no-jit      always interpret, never compile hot functions to machine code\n");
+  fprintf(stderr, "  -O            optimize functions through an SSA intermediate representation\n");
+  fprintf(stderr, "  --gc-slice=US limit incremental marking pauses to US microseconds, 0 to stop the world (default 1000)\n");
+  fprintf(stderr, "  --gc-concurrent mark on a background thread while the program runs\n");
+  fprintf(stderr, "  --gc-threads=N mark and sweep with N threads while the program is stopped (default 1)\n");
+  fprintf(stderr, "  --gc-compact=PCT move objects out of sparse pages once PCT%% of the object pages is free after a collection (default never)\n");
+  fprintf(stderr, "  --gc-stats    print the distribution of garbage collection pauses on exit\n");
+}
+
 static void run_repl() {
   char line[1024];
   for (;;) {
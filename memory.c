@@ -4,46 +4,198 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+
+#ifdef CONCURRENT_GC
+#include <threads.h>
+#endif
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
 #endif
 
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
+#include "slab.h"
 #include "table.h"
 #include "vm.h"
 
 #define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between minor collections.
+#define GC_NURSERY_SIZE (256 * 1024)
+// Bytes allocated between slices of incremental marking, and gray objects
+// blackened between checks of the slice's deadline.
+#define GC_STEP_SIZE (64 * 1024)
+#define GC_SLICE_BATCH 64
+// Pages swept lazily after each minor collection, on top of those the
+// allocator sweeps when it needs free slots.
+#define GC_SWEEP_PAGES 32
+// Gray objects the marker thread blackens before letting the program take its
+// lock.
+#ifdef DEBUG_STRESS_GC
+#define GC_MARKER_BATCH 1
+#else
+#define GC_MARKER_BATCH 64
+#endif
+#define GC_PAUSE_BUCKETS 32
+// Initial capacity of each worker's gray deque.
+#define GC_DEQUE_SIZE 256
+
+#ifdef CONCURRENT_GC
+// A worker's gray objects, in a Chase-Lev deque: the worker pushes and takes
+// at the bottom, and idle workers steal from the top. A full buffer is
+// replaced by one twice the size, and kept until marking is over in case a
+// thief is still reading it.
+typedef struct gray_buffer_t {
+  struct gray_buffer_t* previous;
+  int64_t capacity;
+  _Atomic(obj_t*) slots[];
+} gray_buffer_t;
+
+typedef struct {
+  _Atomic(int64_t) top;
+  _Atomic(int64_t) bottom;
+  _Atomic(gray_buffer_t*) buffer;
+  size_t freed; // bytes freed while sweeping
+  void* deferred; // arrays freed while sweeping, see slab_defer_free()
+  thrd_t thread;
+} gc_worker_t;
+
+typedef enum {
+  GC_JOB_MARK,
+  GC_JOB_SWEEP,
+  GC_JOB_EXIT,
+} gc_job_t;
+#endif
 
+static void track_allocation(size_t old_size, size_t new_size);
+static size_t release_object(obj_t* object);
+static size_t sweep_object(obj_t* object);
 static void free_object(obj_t* object);
+static void push_gray(obj_t* object);
+static void start_full();
+static void begin_marking();
+static void mark_step();
+static void finish_marking();
+static double now_us();
+static void record_pause(uint64_t* kind, double start);
+#ifdef CONCURRENT_GC
+static bool marker_start();
+static void marker_stop();
+static int marker_run(void* arg);
+static void marker_lock();
+static void marker_unlock();
+static void concurrent_step();
+static bool pool_start();
+static void pool_stop();
+static int pool_run(void* arg);
+static void pool_run_job(gc_job_t job);
+static void run_job(gc_worker_t* worker, gc_job_t job);
+static void worker_push(gc_worker_t* worker, obj_t* object);
+static obj_t* worker_take(gc_worker_t* worker);
+static obj_t* worker_steal(gc_worker_t* worker);
+static bool gray_left();
+static void trace_in_parallel();
+static void mark_in_parallel(gc_worker_t* worker);
+static void sweep_in_parallel(gc_worker_t* worker);
+#endif
 static void mark_roots();
+static void mark_remembered();
+static void forget_object(obj_t* object);
 static void trace_references();
 static void sweep();
+static void sweep_step(int pages);
+static void end_collection();
+static void sweep_young();
 static void blacken_object(obj_t* object);
 static void mark_array(value_array_t* array);
+static void mark_caches(chunk_t* chunk);
+static void object_moved(obj_t* from, obj_t* to);
+static void update_object(obj_t* object);
+static void update_value(value_t* value);
+static void update_table(table_t* table);
+static void update_array(value_array_t* array);
+static void update_caches(chunk_t* chunk);
 
-void* reallocate(void* previous, size_t old_size, size_t new_size) {
-  (void)old_size; // unused
-  vm.bytes_allocated += new_size - old_size;
+// Points reference at where the object it points to has moved, if it has.
+#define UPDATE_REFERENCE(reference) \
+  ((reference) = (void*)slab_forward((obj_t*)(reference)))
 
-#ifdef DEBUG_STRESS_GC
-  if (new_size > old_size) {
-    collect_garbage();
-  }
-#endif // DEBUG_STRESS_GC
+gc_options_t gc_options = {
+  .max_slice_us = 1000,
+  .print_stats = false,
+  .concurrent = false,
+  .threads = 1,
+  .compact_percent = 0,
+};
 
-  if (vm.bytes_allocated > vm.next_gc) {
-    collect_garbage();
-  }
+// GC pauses, bucketed by powers of two of their duration in microseconds.
+typedef struct {
+  uint64_t minor;
+  uint64_t slices;
+  uint64_t concurrent;
+  uint64_t full;
+  uint64_t compactions;
+  double total_us;
+  double max_us;
+  uint64_t buckets[GC_PAUSE_BUCKETS];
+} gc_pauses_t;
+
+static gc_pauses_t pauses;
+
+#ifdef CONCURRENT_GC
+// While marking concurrently, the marker thread and the program share the
+// gray stack and the marks, and take turns at them through lock. Anything
+// else the marker reads belongs to objects the program does not change
+// before they have been scanned, thanks to write_barrier_prepare().
+typedef struct {
+  bool started;
+  bool active; // owns the gray stack and the marks
+  bool exit;
+  thrd_t thread;
+  mtx_t lock;
+  cnd_t wake;
+  atomic_int waiting; // for lock in the program's thread
+  double busy_us;
+} marker_t;
+
+static marker_t marker;
 
-  if (new_size == 0) {
-    free(previous);
+// Workers that mark and sweep in parallel during a pause. The program's
+// thread is the first of them, and the others wait on start between jobs.
+typedef struct {
+  bool started;
+  int count;
+  gc_worker_t* workers;
+  mtx_t lock;
+  cnd_t start;
+  cnd_t done;
+  uint64_t generation; // of the job, so that a wakeup is not taken twice
+  gc_job_t job;
+  int running; // threads other than the program's still on the job
+  atomic_int idle; // workers out of gray objects
+  atomic_int next_page; // the next page to sweep
+} gc_pool_t;
+
+static gc_pool_t pool;
+// The worker the current thread is while on a job, if any.
+static thread_local gc_worker_t* gc_worker = NULL;
+#endif
+
+void* reallocate(void* previous, size_t old_size, size_t new_size) {
+#ifdef CONCURRENT_GC
+  if (gc_worker != NULL) {
+    // Sweeping in parallel. The program's thread adds up what the workers
+    // freed once they are done.
+    gc_worker->freed += old_size;
+    slab_defer_free(previous, old_size, &gc_worker->deferred);
     return NULL;
   }
-
-  void* result = realloc(previous, new_size);
-  if (result == NULL) {
+#endif
+  track_allocation(old_size, new_size);
+  void* result = slab_reallocate(previous, old_size, new_size);
+  if (result == NULL && new_size > 0) {
     printf("out of memory!\n");
     exit(1);
   }
@@ -51,6 +203,78 @@ void* reallocate(void* previous, size_t old_size, size_t new_size) {
   return result;
 }
 
+obj_t* allocate_object(size_t size) {
+  track_allocation(0, size);
+  obj_t* object = slab_allocate_object(size);
+  if (object == NULL) {
+    printf("out of memory!\n");
+    exit(1);
+  }
+
+  if (vm.young_capacity < vm.young_count + 1) {
+    vm.young_capacity = GROW_CAPACITY(vm.young_capacity);
+    vm.young_objects = (obj_t**)realloc(vm.young_objects, sizeof(obj_t*) * vm.young_capacity);
+
+    if (vm.young_objects == NULL) {
+      printf("out of memory!\n");
+      exit(1);
+    }
+  }
+  vm.young_objects[vm.young_count++] = object;
+  return object;
+}
+
+// Counts an allocation changing from old_size to new_size bytes, and does
+// any collection work due before it happens.
+static void track_allocation(size_t old_size, size_t new_size) {
+  vm.bytes_allocated += new_size - old_size;
+
+  // Only collect when growing: frees happen during sweeping, and a
+  // collection must not start from inside another one.
+  if (new_size > old_size) {
+    vm.young_bytes += new_size - old_size;
+
+#ifdef DEBUG_STRESS_GC
+    // Do some collection work on every allocation: a marking step while a
+    // full collection is in progress, otherwise a minor collection, and now
+    // and then the start of a full one.
+    static int stress_count = 0;
+    if (vm.gc_phase == GC_MARKING) {
+      mark_step();
+#ifdef CONCURRENT_GC
+    } else if (vm.gc_phase == GC_CONCURRENT) {
+      concurrent_step();
+#endif
+    } else if (++stress_count % 16 == 0) {
+      start_full();
+    } else {
+      collect_young();
+    }
+#endif // DEBUG_STRESS_GC
+
+    if (vm.gc_phase == GC_MARKING || vm.gc_phase == GC_CONCURRENT) {
+      if (vm.bytes_allocated > vm.next_gc * GC_HEAP_GROW_FACTOR) {
+        // Marking is not keeping up with allocation.
+        collect_garbage();
+      } else if (vm.young_bytes > GC_STEP_SIZE) {
+#ifdef CONCURRENT_GC
+        if (vm.gc_phase == GC_CONCURRENT) {
+          concurrent_step();
+        } else {
+          mark_step();
+        }
+#else
+        mark_step();
+#endif
+      }
+    } else if (vm.bytes_allocated > vm.next_gc) {
+      start_full();
+    } else if (vm.young_bytes > GC_NURSERY_SIZE) {
+      collect_young();
+    }
+  }
+}
+
 void mark_value(value_t value) {
   if (IS_OBJ(value)) {
     mark_object(AS_OBJ(value));
@@ -61,7 +285,7 @@ void mark_object(obj_t* object) {
   if (object == NULL) {
     return;
   }
-  if (object->is_marked) {
+  if (is_marked(object)) {
     return;
   }
 #ifdef DEBUG_LOG_GC
@@ -69,18 +293,18 @@ void mark_object(obj_t* object) {
   value_print(OBJ_VAL(object));
   printf("\n");
 #endif // DEBUG_LOG_GC
-  object->is_marked = true;
-
-  if (vm.gray_capacity < vm.gray_count + 1) {
-    vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-    vm.gray_stack = (obj_t**)realloc(vm.gray_stack, sizeof(obj_t*) * vm.gray_capacity);
-
-    if (vm.gray_stack == NULL) {
-      exit(1);
+#ifdef CONCURRENT_GC
+  if (gc_worker != NULL) {
+    // Other workers may reach the object at the same time. Only the one
+    // that sets its mark traces it.
+    if (claim_mark(object)) {
+      worker_push(gc_worker, object);
     }
+    return;
   }
-
-  vm.gray_stack[vm.gray_count++] = object;
+#endif
+  set_mark(object);
+  push_gray(object);
 }
 
 void collect_garbage() {
@@ -88,75 +312,803 @@ void collect_garbage() {
   printf("-- gc begin\n");
   size_t before = vm.bytes_allocated;
 #endif // DEBUG_LOG_GC
+  double start = now_us();
+
+  // An incremental collection in progress is finished off. Its marks are
+  // still valid: everything marked so far is live.
+  if (vm.gc_phase == GC_IDLE || vm.gc_phase == GC_SWEEPING) {
+    begin_marking();
+  }
+  finish_marking();
+
+  record_pause(&pauses.full, start);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+      before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+#endif // DEBUG_LOG_GC
+}
+
+void collect_young() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytes_allocated;
+#endif // DEBUG_LOG_GC
+  double start = now_us();
 
+  // Old objects are marked already, so marking stops at them and only young
+  // objects are traced. Those referenced from old ones are reached through
+  // the remembered set.
   mark_roots();
+  mark_remembered();
   trace_references();
   table_remove_white(&vm.strings);
-  sweep();
+  sweep_young();
+  // A full collection still sweeping lazily gets on with it.
+  if (vm.gc_phase == GC_SWEEPING) {
+    sweep_step(GC_SWEEP_PAGES);
+  }
 
-  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  vm.young_bytes = 0;
+  record_pause(&pauses.minor, start);
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
+  printf("-- minor gc end\n");
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
       before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
 #endif // DEBUG_LOG_GC
 }
 
 void free_objects() {
-  for (obj_t* object = vm.objects; object != NULL; ) {
-    obj_t* next = object->next;
-    free_object(object);
-    object = next;
-  }
+#ifdef CONCURRENT_GC
+  marker_stop();
+  pool_stop();
+#endif
+
+  slab_free_all(release_object);
+  vm.young_count = 0;
 
   free(vm.gray_stack);
+  free(vm.remembered);
+  free(vm.young_objects);
+}
+
+void compact_heap() {
+  vm.compact_pending = false;
+  if (vm.gc_phase != GC_IDLE) {
+    return;
+  }
+  double start = now_us();
+  if (!slab_compact_begin()) {
+    return;
+  }
+#ifdef JIT
+  // The trace recorder holds on to the function it is recording.
+  trace_reset();
+#endif
+  if (!slab_evacuate(object_moved)) {
+    printf("out of memory!\n");
+    exit(1);
+  }
+
+  for (value_t* slot = vm.stack; slot < vm.stack_top; slot++) {
+    update_value(slot);
+  }
+  for (int i = 0; i < vm.frame_count; i++) {
+    UPDATE_REFERENCE(vm.frames[i].closure);
+  }
+  // Closed upvalues keep stale links, so only the open ones are followed.
+  for (obj_upvalue_t** upvalue = &vm.open_upvalues; *upvalue != NULL; upvalue = &(*upvalue)->next) {
+    UPDATE_REFERENCE(*upvalue);
+  }
+  update_table(&vm.global_slots);
+  update_array(&vm.global_names);
+  update_array(&vm.globals);
+  update_table(&vm.strings);
+  UPDATE_REFERENCE(vm.init_string);
+  UPDATE_REFERENCE(vm.empty_shape);
+  for (int i = 0; i < vm.young_count; i++) {
+    UPDATE_REFERENCE(vm.young_objects[i]);
+  }
+  for (int i = 0; i < vm.remembered_count; i++) {
+    UPDATE_REFERENCE(vm.remembered[i]);
+  }
+  slab_each_object(update_object);
+
+  slab_compact_end();
+  record_pause(&pauses.compactions, start);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- compacted to %d pages\n", slab_page_count());
+#endif // DEBUG_LOG_GC
 }
 
-void free_object(obj_t* object) {
+// While a full collection is marking, the barrier's "old" objects are the
+// gray and black ones instead, and those given a reference to a white object
+// are turned gray again to be rescanned.
+void remember_object(obj_t* object) {
+#ifdef CONCURRENT_GC
+  if (vm.gc_phase == GC_CONCURRENT) {
+    return;
+  }
+#endif
+  if (!is_marked(object) || object->is_remembered) {
+    return;
+  }
+  object->is_remembered = true;
+  if (vm.gc_phase == GC_MARKING) {
+    push_gray(object);
+    return;
+  }
+
+  if (vm.remembered_capacity < vm.remembered_count + 1) {
+    vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+    vm.remembered = (obj_t**)realloc(vm.remembered, sizeof(obj_t*) * vm.remembered_capacity);
+
+    if (vm.remembered == NULL) {
+      exit(1);
+    }
+  }
+  vm.remembered[vm.remembered_count++] = object;
+}
+
+void gc_print_stats() {
+  uint64_t count = pauses.minor + pauses.slices + pauses.concurrent + pauses.full + pauses.compactions;
+  fprintf(stderr, "-- gc: %llu pauses (%llu minor, %llu incremental, %llu concurrent, %llu full, %llu compacting), %.3f ms total, %.0f us max\n",
+          (unsigned long long)count, (unsigned long long)pauses.minor,
+          (unsigned long long)pauses.slices, (unsigned long long)pauses.concurrent,
+          (unsigned long long)pauses.full, (unsigned long long)pauses.compactions,
+          pauses.total_us / 1000, pauses.max_us);
+#ifdef CONCURRENT_GC
+  if (marker.busy_us > 0) {
+    fprintf(stderr, "   %.3f ms marking on the marker thread\n", marker.busy_us / 1000);
+  }
+#endif
+  uint64_t seen = 0;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (pauses.buckets[i] == 0) {
+      continue;
+    }
+    seen += pauses.buckets[i];
+    fprintf(stderr, "   < %7llu us: %8llu (%5.1f%%)\n",
+            1ULL << (i + 1), (unsigned long long)pauses.buckets[i],
+            100.0 * seen / count);
+  }
+}
+
+// Frees what object owns, returning the size of the object itself.
+static size_t release_object(obj_t* object) {
   switch (object->type) {
     case OBJ_STRING: {
       obj_string_t* string = (obj_string_t*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(obj_string_t, object);
-      break;
+      return sizeof(obj_string_t) + string->length + 1;
     }
     case OBJ_UPVALUE:
-      FREE(obj_upvalue_t, object);
-      break;
+      return sizeof(obj_upvalue_t);
     case OBJ_FUNCTION: {
       obj_function_t* function = (obj_function_t*)object;
+      jit_free(function);
       chunk_free(&function->chunk);
-      FREE(obj_function_t, object);
-      break;
+      return sizeof(obj_function_t);
     }
     case OBJ_NATIVE:
-      FREE(obj_native_t, object);
-      break;
+      return sizeof(obj_native_t);
     case OBJ_CLOSURE: {
       obj_closure_t* closure = (obj_closure_t*)object;
       FREE_ARRAY(obj_upvalue_t*, closure->upvalues, closure->upvalue_count);
-      FREE(obj_closure_t, object);
-      break;
+      return sizeof(obj_closure_t);
     }
     case OBJ_CLASS: {
       obj_class_t* klass = (obj_class_t*)object;
       table_free(&klass->methods);
-      FREE(obj_class_t, object);
-      break;
+      return sizeof(obj_class_t);
     }
     case OBJ_INSTANCE: {
       obj_instance_t* instance = (obj_instance_t*)object;
-      table_free(&instance->fields);
-      FREE(obj_instance_t, object);
-      break;
+      if (instance->fields != instance->inline_fields) {
+        FREE_ARRAY(value_t, instance->fields, instance->field_capacity);
+      }
+      table_free(&instance->dictionary);
+      return sizeof(obj_instance_t) + sizeof(value_t) * instance->inline_capacity;
     }
     case OBJ_BOUND_METHOD:
-      FREE(obj_bound_method_t, object);
+      return sizeof(obj_bound_method_t);
+    case OBJ_SHAPE: {
+      obj_shape_t* shape = (obj_shape_t*)object;
+      FREE_ARRAY(obj_string_t*, shape->names, shape->field_count);
+      table_free(&shape->transitions);
+      return sizeof(obj_shape_t);
+    }
+  }
+  return 0;
+}
+
+// Frees object once its page is swept lazily, and takes what it held off the
+// heap the next collection is scheduled from, as if it had been freed before
+// that was worked out.
+static size_t sweep_object(obj_t* object) {
+  size_t before = vm.bytes_allocated;
+  size_t size = release_object(object);
+  vm.bytes_allocated -= size;
+  vm.next_gc -= (before - vm.bytes_allocated) * GC_HEAP_GROW_FACTOR;
+  return size;
+}
+
+static void free_object(obj_t* object) {
+  size_t size = release_object(object);
+  vm.bytes_allocated -= size;
+  slab_free_object(object, size);
+}
+
+static void push_gray(obj_t* object) {
+  if (vm.gray_capacity < vm.gray_count + 1) {
+    vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+    vm.gray_stack = (obj_t**)realloc(vm.gray_stack, sizeof(obj_t*) * vm.gray_capacity);
+
+    if (vm.gray_stack == NULL) {
+      exit(1);
+    }
+  }
+
+  vm.gray_stack[vm.gray_count++] = object;
+}
+
+// Starts a full collection, concurrently if asked to, otherwise
+// incrementally unless slices are disabled. Minor collections wait until it
+// is over: the young objects allocated meanwhile are swept along with
+// everything else.
+static void start_full() {
+#ifdef CONCURRENT_GC
+  if (gc_options.concurrent && marker_start()) {
+    if (vm.gc_start_pending && vm.bytes_allocated > vm.next_gc * GC_HEAP_GROW_FACTOR) {
+      // No object has been allocated to start at for a long while.
+      collect_garbage();
+    } else {
+      vm.gc_start_pending = true;
+    }
+    return;
+  }
+#endif
+  if (gc_options.max_slice_us <= 0) {
+    collect_garbage();
+    return;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("-- incremental gc begin\n");
+#endif // DEBUG_LOG_GC
+  double start = now_us();
+  begin_marking();
+  vm.young_bytes = 0;
+  record_pause(&pauses.slices, start);
+}
+
+static void begin_marking() {
+  vm.gc_start_pending = false;
+  // The pages the last collection left to sweep need its marks.
+  if (vm.gc_phase == GC_SWEEPING) {
+    sweep_step(slab_page_count());
+  }
+  // Old objects are still marked from the collection that promoted them.
+  // Clearing the mark bitmaps unmarks them all at once, without touching
+  // the objects. Everything is traced from scratch, so the remembered set is
+  // not needed.
+  slab_clear_marks();
+  for (int i = 0; i < vm.remembered_count; i++) {
+    vm.remembered[i]->is_remembered = false;
+  }
+  vm.remembered_count = 0;
+
+  mark_roots();
+  vm.gc_phase = GC_MARKING;
+}
+
+// Blackens gray objects until the stack is empty or the slice runs out of
+// time, finishing the collection in the former case.
+static void mark_step() {
+  double start = now_us();
+  double deadline = start + gc_options.max_slice_us;
+
+  do {
+#ifdef DEBUG_STRESS_GC
+    // One object per step, to spread marking over as many mutations as
+    // possible.
+    int batch = 1;
+#else
+    int batch = GC_SLICE_BATCH;
+#endif // DEBUG_STRESS_GC
+    while (vm.gray_count > 0 && batch-- > 0) {
+      obj_t* object = vm.gray_stack[--vm.gray_count];
+      forget_object(object);
+      blacken_object(object);
+    }
+#ifdef DEBUG_STRESS_GC
+    break;
+#endif // DEBUG_STRESS_GC
+  } while (vm.gray_count > 0 && now_us() < deadline);
+
+  if (vm.gray_count == 0) {
+    finish_marking();
+  }
+  vm.young_bytes = 0;
+  record_pause(&pauses.slices, start);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- incremental gc slice, %d gray left\n", vm.gray_count);
+#endif // DEBUG_LOG_GC
+}
+
+// The roots are not behind write barriers, so they are marked once more
+// before sweeping. Objects allocated during marking are still unmarked and
+// survive only if reachable.
+static void finish_marking() {
+#ifdef CONCURRENT_GC
+  if (vm.gc_phase == GC_CONCURRENT) {
+    // Take the gray stack back from the marker, which stops after the batch
+    // it is on, and finish in this thread.
+    marker_lock();
+    marker.active = false;
+    marker_unlock();
+    vm.gc_phase = GC_MARKING;
+  }
+#endif
+  mark_roots();
+  trace_references();
+  // Dead strings leave the table before any of them is freed, however late
+  // their pages are swept.
+  table_remove_white(&vm.strings);
+  // Dead young objects are swept along with the old ones.
+  vm.young_count = 0;
+  vm.young_bytes = 0;
+  sweep();
+}
+
+#ifdef CONCURRENT_GC
+// Starts the marker thread unless it is running already. If it cannot be
+// started, collections go back to marking in slices.
+static bool marker_start() {
+  if (marker.started) {
+    return true;
+  }
+  if (mtx_init(&marker.lock, mtx_plain) != thrd_success) {
+    gc_options.concurrent = false;
+    return false;
+  }
+  if (cnd_init(&marker.wake) != thrd_success) {
+    mtx_destroy(&marker.lock);
+    gc_options.concurrent = false;
+    return false;
+  }
+  if (thrd_create(&marker.thread, marker_run, NULL) != thrd_success) {
+    cnd_destroy(&marker.wake);
+    mtx_destroy(&marker.lock);
+    gc_options.concurrent = false;
+    return false;
+  }
+  marker.started = true;
+  return true;
+}
+
+static void marker_stop() {
+  if (!marker.started) {
+    return;
+  }
+  marker_lock();
+  marker.exit = true;
+  cnd_signal(&marker.wake);
+  marker_unlock();
+  thrd_join(marker.thread, NULL);
+  cnd_destroy(&marker.wake);
+  mtx_destroy(&marker.lock);
+  marker.started = false;
+  marker.active = false;
+  marker.exit = false;
+  vm.gc_phase = GC_IDLE;
+}
+
+static int marker_run(void* arg) {
+  (void)arg; // unused
+  mtx_lock(&marker.lock);
+  while (!marker.exit) {
+    if (!marker.active || vm.gray_count == 0) {
+      cnd_wait(&marker.wake, &marker.lock);
+      continue;
+    }
+
+    double start = now_us();
+    for (int batch = GC_MARKER_BATCH; batch > 0 && vm.gray_count > 0; batch--) {
+      obj_t* object = vm.gray_stack[--vm.gray_count];
+      if (!is_scanned(object)) {
+        blacken_object(object);
+        set_scanned(object);
+      }
+    }
+    marker.busy_us += now_us() - start;
+
+    if (atomic_load_explicit(&marker.waiting, memory_order_relaxed) > 0) {
+      mtx_unlock(&marker.lock);
+      thrd_yield();
+      mtx_lock(&marker.lock);
+    }
+  }
+  mtx_unlock(&marker.lock);
+  return 0;
+}
+
+// Takes the marker's lock from the program's thread. The marker lets go of
+// it between batches when asked to.
+static void marker_lock() {
+  atomic_fetch_add_explicit(&marker.waiting, 1, memory_order_relaxed);
+  mtx_lock(&marker.lock);
+  atomic_fetch_sub_explicit(&marker.waiting, 1, memory_order_relaxed);
+}
+
+static void marker_unlock() {
+  mtx_unlock(&marker.lock);
+}
+
+// Marks the roots and hands the gray stack to the marker thread. From here
+// on, new objects are allocated black and the write barriers record the
+// heap as it was at this point: anything reachable now, or allocated later,
+// survives the collection.
+void start_concurrent() {
+#ifdef DEBUG_LOG_GC
+  printf("-- concurrent gc begin\n");
+#endif // DEBUG_LOG_GC
+  double start = now_us();
+  begin_marking();
+  vm.young_bytes = 0;
+
+  vm.gc_phase = GC_CONCURRENT;
+  marker_lock();
+  marker.active = true;
+  cnd_signal(&marker.wake);
+  marker_unlock();
+  record_pause(&pauses.concurrent, start);
+}
+
+// Finishes the collection once the marker has run out of gray objects,
+// marking the roots again in case the marker missed any.
+static void concurrent_step() {
+  vm.young_bytes = 0;
+  marker_lock();
+  bool done = vm.gray_count == 0;
+  marker_unlock();
+  if (!done) {
+    return;
+  }
+
+  double start = now_us();
+  finish_marking();
+  record_pause(&pauses.concurrent, start);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- concurrent gc end\n");
+#endif // DEBUG_LOG_GC
+}
+
+void scan_before_write(obj_t* object) {
+  marker_lock();
+  if (!is_scanned(object)) {
+    set_mark(object);
+    blacken_object(object);
+    set_scanned(object);
+    cnd_signal(&marker.wake);
+  }
+  marker_unlock();
+}
+
+void shade_object(obj_t* object) {
+  marker_lock();
+  mark_object(object);
+  cnd_signal(&marker.wake);
+  marker_unlock();
+}
+
+// Starts the worker threads unless they are running already, or there is
+// only one worker. If they cannot be started, collections run in the
+// program's thread alone.
+static bool pool_start() {
+  if (pool.started) {
+    return true;
+  }
+  if (gc_options.threads <= 1) {
+    return false;
+  }
+  if (mtx_init(&pool.lock, mtx_plain) != thrd_success) {
+    gc_options.threads = 1;
+    return false;
+  }
+  if (cnd_init(&pool.start) != thrd_success) {
+    mtx_destroy(&pool.lock);
+    gc_options.threads = 1;
+    return false;
+  }
+  if (cnd_init(&pool.done) != thrd_success) {
+    cnd_destroy(&pool.start);
+    mtx_destroy(&pool.lock);
+    gc_options.threads = 1;
+    return false;
+  }
+
+  pool.workers = (gc_worker_t*)calloc(gc_options.threads, sizeof(gc_worker_t));
+  if (pool.workers == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < gc_options.threads; i++) {
+    gray_buffer_t* buffer = (gray_buffer_t*)malloc(
+        sizeof(gray_buffer_t) + sizeof(_Atomic(obj_t*)) * GC_DEQUE_SIZE);
+    if (buffer == NULL) {
+      exit(1);
+    }
+    buffer->previous = NULL;
+    buffer->capacity = GC_DEQUE_SIZE;
+    atomic_init(&pool.workers[i].buffer, buffer);
+    atomic_init(&pool.workers[i].top, 0);
+    atomic_init(&pool.workers[i].bottom, 0);
+  }
+
+  pool.started = true;
+  pool.count = 1;
+  while (pool.count < gc_options.threads &&
+         thrd_create(&pool.workers[pool.count].thread, pool_run, &pool.workers[pool.count]) == thrd_success) {
+    pool.count++;
+  }
+  if (pool.count < gc_options.threads) {
+    pool_stop();
+    gc_options.threads = 1;
+    return false;
+  }
+  return true;
+}
+
+static void pool_stop() {
+  if (!pool.started) {
+    return;
+  }
+  mtx_lock(&pool.lock);
+  pool.job = GC_JOB_EXIT;
+  pool.generation++;
+  cnd_broadcast(&pool.start);
+  mtx_unlock(&pool.lock);
+  for (int i = 1; i < pool.count; i++) {
+    thrd_join(pool.workers[i].thread, NULL);
+  }
+
+  cnd_destroy(&pool.done);
+  cnd_destroy(&pool.start);
+  mtx_destroy(&pool.lock);
+  for (int i = 0; i < gc_options.threads; i++) {
+    free(atomic_load_explicit(&pool.workers[i].buffer, memory_order_relaxed));
+  }
+  free(pool.workers);
+  pool.workers = NULL;
+  pool.started = false;
+}
+
+static int pool_run(void* arg) {
+  gc_worker_t* worker = (gc_worker_t*)arg;
+  uint64_t generation = 0;
+  mtx_lock(&pool.lock);
+  for (;;) {
+    while (pool.generation == generation) {
+      cnd_wait(&pool.start, &pool.lock);
+    }
+    generation = pool.generation;
+    gc_job_t job = pool.job;
+    mtx_unlock(&pool.lock);
+    if (job == GC_JOB_EXIT) {
+      return 0;
+    }
+
+    gc_worker = worker;
+    run_job(worker, job);
+    gc_worker = NULL;
+
+    mtx_lock(&pool.lock);
+    if (--pool.running == 0) {
+      cnd_signal(&pool.done);
+    }
+  }
+}
+
+// Runs job on every worker, the program's thread included, and waits for
+// all of them to finish it.
+static void pool_run_job(gc_job_t job) {
+  mtx_lock(&pool.lock);
+  pool.job = job;
+  pool.generation++;
+  pool.running = pool.count - 1;
+  cnd_broadcast(&pool.start);
+  mtx_unlock(&pool.lock);
+
+  gc_worker = &pool.workers[0];
+  run_job(gc_worker, job);
+  gc_worker = NULL;
+
+  mtx_lock(&pool.lock);
+  while (pool.running > 0) {
+    cnd_wait(&pool.done, &pool.lock);
+  }
+  mtx_unlock(&pool.lock);
+}
+
+static void run_job(gc_worker_t* worker, gc_job_t job) {
+  switch (job) {
+    case GC_JOB_MARK:
+      mark_in_parallel(worker);
+      break;
+    case GC_JOB_SWEEP:
+      sweep_in_parallel(worker);
       break;
+    case GC_JOB_EXIT:
+      break;
+  }
+}
+
+// The deque operations follow "Correct and Efficient Work-Stealing for Weak
+// Memory Models" (Lê et al., 2013). Only worker itself pushes and takes.
+static void worker_push(gc_worker_t* worker, obj_t* object) {
+  int64_t bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+  int64_t top = atomic_load_explicit(&worker->top, memory_order_acquire);
+  gray_buffer_t* buffer = atomic_load_explicit(&worker->buffer, memory_order_relaxed);
+  if (bottom - top >= buffer->capacity) {
+    gray_buffer_t* grown = (gray_buffer_t*)malloc(
+        sizeof(gray_buffer_t) + sizeof(_Atomic(obj_t*)) * buffer->capacity * 2);
+    if (grown == NULL) {
+      exit(1);
+    }
+    grown->previous = buffer;
+    grown->capacity = buffer->capacity * 2;
+    for (int64_t i = top; i < bottom; i++) {
+      obj_t* gray = atomic_load_explicit(&buffer->slots[i & (buffer->capacity - 1)], memory_order_relaxed);
+      atomic_store_explicit(&grown->slots[i & (grown->capacity - 1)], gray, memory_order_relaxed);
+    }
+    atomic_store_explicit(&worker->buffer, grown, memory_order_release);
+    buffer = grown;
+  }
+  atomic_store_explicit(&buffer->slots[bottom & (buffer->capacity - 1)], object, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static obj_t* worker_take(gc_worker_t* worker) {
+  int64_t bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed) - 1;
+  gray_buffer_t* buffer = atomic_load_explicit(&worker->buffer, memory_order_relaxed);
+  atomic_store_explicit(&worker->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t top = atomic_load_explicit(&worker->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+  obj_t* object = atomic_load_explicit(&buffer->slots[bottom & (buffer->capacity - 1)], memory_order_relaxed);
+  if (top == bottom) {
+    // The last object, which a thief may be after too.
+    if (!atomic_compare_exchange_strong_explicit(&worker->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+      object = NULL;
+    }
+    atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return object;
+}
+
+// Steals an object from the top of another worker's deque, trying each of
+// them once.
+static obj_t* worker_steal(gc_worker_t* worker) {
+  int self = (int)(worker - pool.workers);
+  for (int i = 1; i < pool.count; i++) {
+    gc_worker_t* victim = &pool.workers[(self + i) % pool.count];
+    int64_t top = atomic_load_explicit(&victim->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+    if (top >= bottom) {
+      continue;
+    }
+    gray_buffer_t* buffer = atomic_load_explicit(&victim->buffer, memory_order_acquire);
+    obj_t* object = atomic_load_explicit(&buffer->slots[top & (buffer->capacity - 1)], memory_order_relaxed);
+    if (atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1,
+                                                memory_order_seq_cst, memory_order_relaxed)) {
+      return object;
+    }
+  }
+  return NULL;
+}
+
+static bool gray_left() {
+  for (int i = 0; i < pool.count; i++) {
+    if (atomic_load_explicit(&pool.workers[i].top, memory_order_relaxed) <
+        atomic_load_explicit(&pool.workers[i].bottom, memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Deals the gray stack out to the workers and marks until none of them has
+// anything left.
+static void trace_in_parallel() {
+  for (int i = 0; i < vm.gray_count; i++) {
+    obj_t* object = vm.gray_stack[i];
+    forget_object(object);
+    worker_push(&pool.workers[i % pool.count], object);
+  }
+  vm.gray_count = 0;
+
+  atomic_store_explicit(&pool.idle, 0, memory_order_relaxed);
+  pool_run_job(GC_JOB_MARK);
+
+  for (int i = 0; i < pool.count; i++) {
+    gray_buffer_t* buffer = atomic_load_explicit(&pool.workers[i].buffer, memory_order_relaxed);
+    while (buffer->previous != NULL) {
+      gray_buffer_t* previous = buffer->previous;
+      buffer->previous = previous->previous;
+      free(previous);
+    }
+  }
+}
+
+// A worker that runs out of gray objects steals them from the others, and
+// once it cannot, counts itself idle. Only a busy worker can gray more
+// objects, so marking is over when every worker is idle.
+static void mark_in_parallel(gc_worker_t* worker) {
+  for (;;) {
+    obj_t* object;
+    while ((object = worker_take(worker)) != NULL) {
+      blacken_object(object);
+    }
+    if ((object = worker_steal(worker)) != NULL) {
+      blacken_object(object);
+      continue;
+    }
+
+    atomic_fetch_add_explicit(&pool.idle, 1, memory_order_seq_cst);
+    for (;;) {
+      if (atomic_load_explicit(&pool.idle, memory_order_seq_cst) == pool.count) {
+        return;
+      }
+      if (gray_left()) {
+        atomic_fetch_sub_explicit(&pool.idle, 1, memory_order_seq_cst);
+        break;
+      }
+      thrd_yield();
+    }
   }
 }
 
+static void sweep_in_parallel(gc_worker_t* worker) {
+  int count = slab_page_count();
+  int page;
+  while ((page = atomic_fetch_add_explicit(&pool.next_page, 1, memory_order_relaxed)) < count) {
+    worker->freed += slab_sweep_page(page, release_object);
+  }
+}
+#endif // CONCURRENT_GC
+
+static double now_us() {
+  struct timespec time;
+  timespec_get(&time, TIME_UTC);
+  return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+static void record_pause(uint64_t* kind, double start) {
+  double pause = now_us() - start;
+  (*kind)++;
+  pauses.total_us += pause;
+  if (pause > pauses.max_us) {
+    pauses.max_us = pause;
+  }
+
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= (double)(2ULL << bucket)) {
+    bucket++;
+  }
+  pauses.buckets[bucket]++;
+}
+
 static void mark_roots() {
   for (value_t* slot = vm.stack; slot < vm.stack_top; slot++) {
     mark_value(*slot);
@@ -170,37 +1122,100 @@ static void mark_roots() {
     mark_object((obj_t*)upvalue);
   }
 
-  mark_table(&vm.globals);
+  mark_table(&vm.global_slots);
+  mark_array(&vm.global_names);
+  mark_array(&vm.globals);
   mark_compiler_roots();
   mark_object((obj_t*)vm.init_string);
+  mark_object((obj_t*)vm.empty_shape);
+}
+
+// Takes object out of the remembered set once it is traced. Most objects
+// traced were never in it, and are left unwritten.
+static void forget_object(obj_t* object) {
+  if (object->is_remembered) {
+    object->is_remembered = false;
+  }
+}
+
+// Marks the young objects referenced from remembered old ones. Once they
+// have been promoted there are no such references left.
+static void mark_remembered() {
+  for (int i = 0; i < vm.remembered_count; i++) {
+    obj_t* object = vm.remembered[i];
+    object->is_remembered = false;
+    blacken_object(object);
+  }
+  vm.remembered_count = 0;
 }
 
 static void trace_references() {
+#ifdef CONCURRENT_GC
+  // Minor collections trace too little to be worth waking the workers for.
+  if (vm.gc_phase == GC_MARKING && pool_start()) {
+    trace_in_parallel();
+    return;
+  }
+#endif
   while (vm.gray_count > 0) {
     obj_t* object = vm.gray_stack[--vm.gray_count];
+    forget_object(object);
     blacken_object(object);
   }
 }
 
+// Frees the unmarked objects, a page at a time. The marked ones stay marked.
+// Workers in a pool sweep every page in parallel during the pause. Otherwise
+// the pages are swept lazily while the program runs, and the collection is
+// only over once they all are.
 static void sweep() {
-  obj_t* previous = NULL;
-  obj_t* object = vm.objects;
-  while (object != NULL) {
-    if (object->is_marked) {
-      object->is_marked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      obj_t* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
-      free_object(unreached);
+  vm.bytes_allocated -= slab_sweep_large(release_object);
+#ifdef CONCURRENT_GC
+  if (pool_start()) {
+    atomic_store_explicit(&pool.next_page, 0, memory_order_relaxed);
+    pool_run_job(GC_JOB_SWEEP);
+    for (int i = 0; i < pool.count; i++) {
+      vm.bytes_allocated -= pool.workers[i].freed;
+      pool.workers[i].freed = 0;
+      slab_free_list(pool.workers[i].deferred);
+      pool.workers[i].deferred = NULL;
+    }
+    slab_trim();
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    end_collection();
+    return;
+  }
+#endif
+  // Until the last page is swept, the heap the next collection is scheduled
+  // from still counts the dead objects in the others, see sweep_object().
+  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  slab_sweep_begin(sweep_object);
+  vm.gc_phase = GC_SWEEPING;
+}
+
+static void sweep_step(int pages) {
+  if (slab_sweep_some(pages)) {
+    end_collection();
+  }
+}
+
+static void end_collection() {
+  vm.gc_phase = GC_IDLE;
+  if (gc_options.compact_percent > 0 && slab_fragmentation() * 100 > gc_options.compact_percent) {
+    vm.compact_pending = true;
+  }
+}
+
+// Frees the unmarked young objects. The marked ones are promoted to the old
+// generation, which they are part of as long as they stay marked.
+static void sweep_young() {
+  for (int i = 0; i < vm.young_count; i++) {
+    obj_t* object = vm.young_objects[i];
+    if (!is_marked(object)) {
+      free_object(object);
     }
   }
+  vm.young_count = 0;
 }
 
 static void blacken_object(obj_t* object) {
@@ -214,12 +1229,27 @@ static void blacken_object(obj_t* object) {
       obj_class_t* klass = (obj_class_t*)object;
       mark_object((obj_t*)klass->name);
       mark_table(&klass->methods);
+      mark_object((obj_t*)klass->initializer);
       break;
     }
     case OBJ_INSTANCE: {
       obj_instance_t* instance = (obj_instance_t*)object;
       mark_object((obj_t*)instance->klass);
-      mark_table(&instance->fields);
+      if (instance->shape != NULL) {
+        mark_object((obj_t*)instance->shape);
+        for (int i = 0; i < instance->shape->field_count; i++) {
+          mark_value(instance->fields[i]);
+        }
+      }
+      mark_table(&instance->dictionary);
+      break;
+    }
+    case OBJ_SHAPE: {
+      obj_shape_t* shape = (obj_shape_t*)object;
+      for (int i = 0; i < shape->field_count; i++) {
+        mark_object((obj_t*)shape->names[i]);
+      }
+      mark_table(&shape->transitions);
       break;
     }
     case OBJ_BOUND_METHOD: {
@@ -240,6 +1270,7 @@ static void blacken_object(obj_t* object) {
       obj_function_t* function = (obj_function_t*)object;
       mark_object((obj_t*)function->name);
       mark_array(&function->chunk.constants);
+      mark_caches(&function->chunk);
       break;
     }
     case OBJ_UPVALUE:
@@ -256,3 +1287,136 @@ static void mark_array(value_array_t* array) {
     mark_value(array->values[i]);
   }
 }
+
+// Cache entries hold strong references so that a class or shape cannot be
+// freed and another one allocated at the same address while still cached.
+static void mark_caches(chunk_t* chunk) {
+  for (int i = 0; i < chunk->cache_count; i++) {
+    inline_cache_t* cache = &chunk->caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      cache_entry_t* entry = &cache->entries[j];
+      mark_object((obj_t*)entry->klass);
+      mark_object((obj_t*)entry->shape);
+      mark_object((obj_t*)entry->new_shape);
+      mark_object((obj_t*)entry->method);
+    }
+  }
+}
+
+// Fixes up the references moved objects hold into themselves.
+static void object_moved(obj_t* from, obj_t* to) {
+  switch (to->type) {
+    case OBJ_INSTANCE: {
+      obj_instance_t* instance = (obj_instance_t*)to;
+      if (instance->fields == ((obj_instance_t*)from)->inline_fields) {
+        instance->fields = instance->inline_fields;
+      }
+      break;
+    }
+    case OBJ_UPVALUE: {
+      obj_upvalue_t* upvalue = (obj_upvalue_t*)to;
+      if (upvalue->location == &((obj_upvalue_t*)from)->closed) {
+        upvalue->location = &upvalue->closed;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Updates the references object holds to moved objects, like
+// blacken_object() marks them.
+static void update_object(obj_t* object) {
+  switch (object->type) {
+    case OBJ_CLASS: {
+      obj_class_t* klass = (obj_class_t*)object;
+      UPDATE_REFERENCE(klass->name);
+      update_table(&klass->methods);
+      UPDATE_REFERENCE(klass->initializer);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      obj_instance_t* instance = (obj_instance_t*)object;
+      UPDATE_REFERENCE(instance->klass);
+      UPDATE_REFERENCE(instance->shape);
+      if (instance->shape != NULL) {
+        for (int i = 0; i < instance->shape->field_count; i++) {
+          update_value(&instance->fields[i]);
+        }
+      }
+      update_table(&instance->dictionary);
+      break;
+    }
+    case OBJ_SHAPE: {
+      obj_shape_t* shape = (obj_shape_t*)object;
+      for (int i = 0; i < shape->field_count; i++) {
+        UPDATE_REFERENCE(shape->names[i]);
+      }
+      update_table(&shape->transitions);
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      obj_bound_method_t* bound = (obj_bound_method_t*)object;
+      update_value(&bound->receiver);
+      UPDATE_REFERENCE(bound->method);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      obj_closure_t* closure = (obj_closure_t*)object;
+      UPDATE_REFERENCE(closure->function);
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        UPDATE_REFERENCE(closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      obj_function_t* function = (obj_function_t*)object;
+      UPDATE_REFERENCE(function->name);
+      update_array(&function->chunk.constants);
+      update_caches(&function->chunk);
+      break;
+    }
+    case OBJ_UPVALUE:
+      update_value(&((obj_upvalue_t*)object)->closed);
+      break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+static void update_value(value_t* value) {
+  if (IS_OBJ(*value)) {
+    *value = OBJ_VAL(slab_forward(AS_OBJ(*value)));
+  }
+}
+
+static void update_table(table_t* table) {
+  for (int i = 0; i <= table->capacity; i++) {
+    entry_t* entry = &table->entries[i];
+    if (entry->key != NULL) {
+      UPDATE_REFERENCE(entry->key);
+      update_value(&entry->value);
+    }
+  }
+}
+
+static void update_array(value_array_t* array) {
+  for (int i = 0; i < array->count; i++) {
+    update_value(&array->values[i]);
+  }
+}
+
+static void update_caches(chunk_t* chunk) {
+  for (int i = 0; i < chunk->cache_count; i++) {
+    inline_cache_t* cache = &chunk->caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      cache_entry_t* entry = &cache->entries[j];
+      UPDATE_REFERENCE(entry->klass);
+      UPDATE_REFERENCE(entry->shape);
+      UPDATE_REFERENCE(entry->new_shape);
+      UPDATE_REFERENCE(entry->method);
+    }
+  }
+}
@@ -1,10 +1,13 @@
 #ifndef _CLOX_MEMORY_H
 #define _CLOX_MEMORY_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "object.h"
+#include "slab.h"
 #include "value.h"
+#include "vm.h"
 
 #define GROW_CAPACITY(capacity) \
   ((capacity) < 8 ? 8 : (capacity) * 2)
@@ -20,10 +23,114 @@
 #define FREE_ARRAY(type, pointer, old_count) \
   reallocate((pointer), sizeof(type) * (old_count), 0)
 
+typedef struct {
+  // Longest a slice of incremental marking may run for, in microseconds.
+  // Zero makes every full collection stop the world until it is done.
+  int max_slice_us;
+  // Print the distribution of collection pauses on exit.
+  bool print_stats;
+  // Mark on a background thread instead of in slices, where supported.
+  bool concurrent;
+  // Threads that mark and sweep while the program is stopped, its own
+  // included, where supported.
+  int threads;
+  // Compact the heap once a full collection leaves more than this percentage
+  // of the pages of objects free. Zero never compacts.
+  int compact_percent;
+} gc_options_t;
+
+extern gc_options_t gc_options;
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+// Allocates an object of size bytes, which must be freed by the collector.
+obj_t* allocate_object(size_t size);
 void mark_value(value_t value);
 void mark_object(obj_t* object);
+// Full collection of both generations, finishing any incremental marking in
+// progress.
 void collect_garbage();
+// Minor collection of the young generation only, tracing from the roots and
+// the remembered set.
+void collect_young();
 void free_objects();
+// Puts object in the remembered set if it is old, for stores the write
+// barriers below cannot check one by one.
+void remember_object(obj_t* object);
+// Moves objects out of sparsely used pages if a full collection asked for it
+// with vm.compact_pending. Every reference to them is updated, so it must
+// only be called where the program holds no references to objects other
+// than those the collector knows about: in the outermost interpreter loop,
+// between instructions, or between scripts.
+void compact_heap();
+void gc_print_stats();
+#ifdef CONCURRENT_GC
+void start_concurrent();
+void scan_before_write(obj_t* object);
+void shade_object(obj_t* object);
+#endif
+
+// Concurrent marking does not start inside reallocate(), where the caller may
+// be halfway through changing an object, but at the next object allocation:
+// objects are always allocated before any of the changes they are for.
+static inline void gc_safe_point() {
+#ifdef CONCURRENT_GC
+  if (vm.gc_start_pending) {
+    start_concurrent();
+  }
+#endif
+}
+
+// Write barriers, to be called after storing a reference to value into
+// object. A young value stored into an old object puts the object in the
+// remembered set, so that minor collections see the reference. During
+// incremental marking the same check keeps a marked object from hiding a
+// reference to an unmarked one.
+static inline void write_barrier_object(obj_t* object, obj_t* value) {
+#ifdef CONCURRENT_GC
+  // The marker thread owns the marks until it is done.
+  if (vm.gc_phase == GC_CONCURRENT) {
+    return;
+  }
+#endif
+  if (value != NULL && !is_marked(value) && is_marked(object)) {
+    remember_object(object);
+  }
+}
+
+static inline void write_barrier(obj_t* object, value_t value) {
+  if (IS_OBJ(value)) {
+    write_barrier_object(object, AS_OBJ(value));
+  }
+}
+
+// Write barrier to be called before changing the references held by object,
+// including by growing or freeing an array it owns. While marking
+// concurrently, the marker must see the references object held when marking
+// began, and must not read the object while it changes, so the object is
+// scanned first if the marker has not got to it yet. Objects allocated since
+// marking began count as scanned.
+static inline void write_barrier_prepare(obj_t* object) {
+#ifdef CONCURRENT_GC
+  if (vm.gc_phase == GC_CONCURRENT && !is_scanned(object)) {
+    scan_before_write(object);
+  }
+#else
+  (void)object; // unused
+#endif
+}
+
+// Read barrier for references the program can get hold of without reaching
+// them from a root, such as strings found in the intern table. While marking
+// concurrently they may be unmarked and about to be freed, so object is
+// marked.
+static inline void read_barrier(obj_t* object) {
+#ifdef CONCURRENT_GC
+  if (vm.gc_phase == GC_CONCURRENT) {
+    shade_object(object);
+  }
+#else
+  (void)object; // unused
+#endif
+}
 
 #endif // _CLOX_MEMORY_H
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "limits.h"
 #include "table.h"
 #include "memory.h"
 #include "value.h"
@@ -10,36 +11,50 @@
 
 #define ALLOCATE_OBJ(type, object_type) \
   ((type*)object_allocate(sizeof(type), object_type))
+// FNV-1a, which hashes a string a character at a time, so the hash of a
+// concatenation carries on from the hash of its first part.
+#define STRING_HASH_SEED 2166136261u
 
-static obj_string_t* string_allocate(char* chars, int length, uint32_t hash);
+static obj_string_t* string_allocate(int length);
+static void string_intern(obj_string_t* string, uint32_t hash);
 static obj_t* object_allocate(size_t size, obj_type_t type);
-static uint32_t hash_string(const char* str, int length);
+static uint32_t hash_string(uint32_t hash, const char* str, int length);
 static void function_print(obj_function_t* function);
+static obj_shape_t* shape_transition(obj_shape_t* shape, obj_string_t* name);
+static void instance_grow_fields(obj_instance_t* instance, int count);
+static void instance_to_dictionary(obj_instance_t* instance);
 
 obj_string_t* string_copy(const char* chars, int length) {
-  uint32_t hash = hash_string(chars, length);
+  uint32_t hash = hash_string(STRING_HASH_SEED, chars, length);
 
   obj_string_t* interned = table_find_string(&vm.strings, chars, length, hash);
   if (interned != NULL) {
+    read_barrier(&interned->obj);
     return interned;
   }
 
-  char* heap_chars = ALLOCATE(char, length + 1);
-  memcpy(heap_chars, chars, length);
-  heap_chars[length] = '\0';
-  return string_allocate(heap_chars, length, hash);
+  obj_string_t* string = string_allocate(length);
+  memcpy(string->chars, chars, length);
+  string_intern(string, hash);
+  return string;
 }
 
-obj_string_t* string_take(char* chars, int length) {
-  uint32_t hash = hash_string(chars, length);
+// The result is hashed and looked up from its two halves, so that one that
+// is interned already allocates nothing.
+obj_string_t* string_concatenate(obj_string_t* first, obj_string_t* second) {
+  uint32_t hash = hash_string(first->hash, second->chars, second->length);
 
-  obj_string_t* interned = table_find_string(&vm.strings, chars, length, hash);
+  obj_string_t* interned = table_find_concatenation(&vm.strings, first, second, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    read_barrier(&interned->obj);
     return interned;
   }
 
-  return string_allocate(chars, length, hash);
+  obj_string_t* string = string_allocate(first->length + second->length);
+  memcpy(string->chars, first->chars, first->length);
+  memcpy(string->chars + first->length, second->chars, second->length);
+  string_intern(string, hash);
+  return string;
 }
 
 obj_upvalue_t* upvalue_new(value_t* slot) {
@@ -55,6 +70,10 @@ obj_function_t* function_new() {
   function->arity = 0;
   function->upvalue_count = 0;
   function->name = NULL;
+  function->inline_body.kind = INLINE_NONE;
+  function->call_count = 0;
+  function->jit_code = NULL;
+  function->jit_size = 0;
   chunk_init(&function->chunk);
   return function;
 }
@@ -83,13 +102,22 @@ obj_class_t* class_new(obj_string_t* name) {
   obj_class_t* klass = ALLOCATE_OBJ(obj_class_t, OBJ_CLASS);
   klass->name = name;
   table_init(&klass->methods);
+  klass->method_version = 0;
+  klass->initializer = NULL;
+  klass->instance_fields = 0;
   return klass;
 }
 
 obj_instance_t* instance_new(obj_class_t* klass) {
-  obj_instance_t* instance = ALLOCATE_OBJ(obj_instance_t, OBJ_INSTANCE);
+  int capacity = klass->instance_fields;
+  obj_instance_t* instance = (obj_instance_t*)object_allocate(
+      sizeof(obj_instance_t) + sizeof(value_t) * capacity, OBJ_INSTANCE);
   instance->klass = klass;
-  table_init(&instance->fields);
+  instance->shape = vm.empty_shape;
+  instance->fields = instance->inline_fields;
+  instance->field_capacity = capacity;
+  instance->inline_capacity = capacity;
+  table_init(&instance->dictionary);
   return instance;
 }
 
@@ -100,6 +128,62 @@ obj_bound_method_t* bound_method_new(value_t receiver, obj_closure_t* method) {
   return bound;
 }
 
+// Creates the shape of parent's fields followed by name, or the empty shape
+// if parent is NULL. parent must be reachable by the GC.
+obj_shape_t* shape_new(obj_shape_t* parent, obj_string_t* name) {
+  int field_count = parent == NULL ? 0 : parent->field_count + 1;
+  obj_string_t** names = ALLOCATE(obj_string_t*, field_count);
+  for (int i = 0; i < field_count - 1; i++) {
+    names[i] = parent->names[i];
+  }
+  if (parent != NULL) {
+    names[field_count - 1] = name;
+  }
+
+  obj_shape_t* shape = ALLOCATE_OBJ(obj_shape_t, OBJ_SHAPE);
+  shape->names = names;
+  shape->field_count = field_count;
+  table_init(&shape->transitions);
+  return shape;
+}
+
+// The instance and value must be reachable by the GC.
+void instance_set_field(obj_instance_t* instance, obj_string_t* name, value_t value) {
+  if (instance->shape != NULL) {
+    int slot = shape_find_slot(instance->shape, name);
+    if (slot != -1) {
+      write_barrier_prepare(&instance->obj);
+      instance->fields[slot] = value;
+      write_barrier(&instance->obj, value);
+      return;
+    }
+
+    obj_shape_t* shape = shape_transition(instance->shape, name);
+    // Only now, as the transition may have allocated.
+    write_barrier_prepare(&instance->obj);
+    if (shape != NULL) {
+      if (shape->field_count > instance->field_capacity) {
+        instance_grow_fields(instance, shape->field_count);
+      }
+      instance->fields[shape->field_count - 1] = value;
+      instance->shape = shape;
+      write_barrier(&instance->obj, value);
+      write_barrier_object(&instance->obj, &shape->obj);
+      if (shape->field_count > instance->klass->instance_fields) {
+        instance->klass->instance_fields = shape->field_count;
+      }
+      return;
+    }
+
+    instance_to_dictionary(instance);
+  } else {
+    write_barrier_prepare(&instance->obj);
+  }
+
+  table_set(&instance->dictionary, name, value);
+  write_barrier(&instance->obj, value);
+}
+
 void object_print(value_t value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_STRING:
@@ -126,28 +210,43 @@ void object_print(value_t value) {
     case OBJ_BOUND_METHOD:
       function_print(AS_BOUND_METHOD(value)->method->function);
       break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
   }
 }
 
-static obj_string_t* string_allocate(char* chars, int length, uint32_t hash) {
-  obj_string_t* string = ALLOCATE_OBJ(obj_string_t, OBJ_STRING);
+// Leaves the characters to the caller, other than the final '\0'.
+static obj_string_t* string_allocate(int length) {
+  obj_string_t* string = (obj_string_t*)object_allocate(sizeof(obj_string_t) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
+  string->chars[length] = '\0';
+  return string;
+}
+
+static void string_intern(obj_string_t* string, uint32_t hash) {
   string->hash = hash;
 
   stack_push(OBJ_VAL(string));
   table_set(&vm.strings, string, NIL_VAL);
   stack_pop();
-  return string;
 }
 
 static obj_t* object_allocate(size_t size, obj_type_t type) {
-  obj_t* object = (obj_t*)reallocate(NULL, 0, size);
+  gc_safe_point();
+  obj_t* object = allocate_object(size);
   object->type = type;
-  object->is_marked = false;
-
-  object->next = vm.objects;
-  vm.objects = object;
+  object->is_remembered = false;
+#ifdef CONCURRENT_GC
+  // Objects allocated while marking concurrently are black: they survive the
+  // collection and the marker never looks inside them. Any other new object
+  // is unmarked, as its slot was freed unmarked. The marker may be marking
+  // the object's neighbours meanwhile.
+  if (vm.gc_phase == GC_CONCURRENT) {
+    claim_mark(object);
+    set_scanned(object);
+  }
+#endif
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -156,8 +255,8 @@ static obj_t* object_allocate(size_t size, obj_type_t type) {
   return object;
 }
 
-static uint32_t hash_string(const char* str, int length) {
-  uint32_t hash = 2166136261u;
+// Hashes str, after the characters that hashed to hash.
+static uint32_t hash_string(uint32_t hash, const char* str, int length) {
   for (int i = 0; i < length; i++) {
     hash ^= (uint8_t)str[i];
     hash *= 16777619;
@@ -172,3 +271,53 @@ static void function_print(obj_function_t* function) {
   }
   printf("<fn %s>", function->name->chars);
 }
+
+// Returns the shape that adds name to the given shape, creating it if
+// needed, or NULL if the instance should switch to dictionary mode.
+static obj_shape_t* shape_transition(obj_shape_t* shape, obj_string_t* name) {
+  value_t child;
+  if (table_get(&shape->transitions, name, &child)) {
+    return AS_SHAPE(child);
+  }
+  if (shape->field_count >= SHAPE_MAX_FIELDS || shape->transitions.count >= SHAPE_MAX_TRANSITIONS) {
+    return NULL;
+  }
+
+  obj_shape_t* new_shape = shape_new(shape, name);
+  stack_push(OBJ_VAL(new_shape));
+  write_barrier_prepare(&shape->obj);
+  table_set(&shape->transitions, name, OBJ_VAL(new_shape));
+  write_barrier_object(&shape->obj, &new_shape->obj);
+  stack_pop();
+  return new_shape;
+}
+
+static void instance_grow_fields(obj_instance_t* instance, int count) {
+  int capacity = GROW_CAPACITY(instance->field_capacity);
+  if (capacity < count) {
+    capacity = count;
+  }
+  value_t* fields = ALLOCATE(value_t, capacity);
+  int used = instance->shape->field_count;
+  for (int i = 0; i < used; i++) {
+    fields[i] = instance->fields[i];
+  }
+  if (instance->fields != instance->inline_fields) {
+    FREE_ARRAY(value_t, instance->fields, instance->field_capacity);
+  }
+  instance->fields = fields;
+  instance->field_capacity = capacity;
+}
+
+static void instance_to_dictionary(obj_instance_t* instance) {
+  obj_shape_t* shape = instance->shape;
+  for (int i = 0; i < shape->field_count; i++) {
+    table_set(&instance->dictionary, shape->names[i], instance->fields[i]);
+  }
+  instance->shape = NULL;
+  if (instance->fields != instance->inline_fields) {
+    FREE_ARRAY(value_t, instance->fields, instance->field_capacity);
+  }
+  instance->fields = instance->inline_fields;
+  instance->field_capacity = instance->inline_capacity;
+}
@@ -3,6 +3,14 @@
 
 #include <stdint.h>
 
+// Marking on a background thread needs C11 threads and atomics.
+#if defined(__has_include)
+#if __has_include(<threads.h>) && !defined(__STDC_NO_THREADS__) && !defined(__STDC_NO_ATOMICS__)
+#define CONCURRENT_GC
+#include <stdatomic.h>
+#endif
+#endif
+
 #include "chunk.h"
 #include "table.h"
 #include "value.h"
@@ -17,6 +25,7 @@
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
 #define IS_UPVALUE(VALUE) is_obj_type(value, OBJ_UPVALUE)
+#define IS_SHAPE(value) is_obj_type(value, OBJ_SHAPE)
 
 #define AS_STRING(value)  ((obj_string_t*)AS_OBJ(value))
 #define AS_CSTRING(value) (((obj_string_t*)AS_OBJ(value))->chars)
@@ -27,6 +36,7 @@
 #define AS_INSTANCE(value) ((obj_instance_t*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((obj_bound_method_t*)AS_OBJ(value))
 #define AS_UPVALUE(value) ((obj_upvalue_t*)AS_OBJ(value))
+#define AS_SHAPE(value) ((obj_shape_t*)AS_OBJ(value))
 
 typedef enum {
   OBJ_STRING,
@@ -37,19 +47,27 @@ typedef enum {
   OBJ_CLASS,
   OBJ_INSTANCE,
   OBJ_BOUND_METHOD,
+  OBJ_SHAPE,
 } obj_type_t;
 
+// The header takes three bytes, so the first field of every object after it
+// starts at offset 4 or 8. Marks live in bitmaps on the side, see slab.h. A
+// marked object stays marked after the collection, and is part of the old
+// generation from then on: a young object is one that is unmarked outside of
+// a collection.
 struct obj_t {
-  obj_type_t type;
-  bool is_marked;
-  struct obj_t* next;
+  uint8_t type; // obj_type_t
+  bool is_remembered; // in vm.remembered
+  bool is_large; // too large for a page of slab.c
 };
 
+// The characters follow the header in the same allocation, and end with a
+// '\0' not counted in length.
 struct obj_string_t {
   obj_t obj;
   int length;
   uint32_t hash;
-  char* chars;
+  char chars[];
 };
 
 typedef struct obj_upvalue_t {
@@ -59,12 +77,41 @@ typedef struct obj_upvalue_t {
   struct obj_upvalue_t* next;
 } obj_upvalue_t;
 
+// Bodies that consist of a single return of a simple expression, which the
+// VM evaluates in place of a call instead of pushing a frame. Operands are
+// slots of the callee's frame (slot 0 holds the receiver of a method), or
+// constants when INLINE_CONSTANT is set.
+typedef enum {
+  INLINE_NONE,
+  INLINE_OPERAND, // return a;
+  INLINE_FIELD, // return a.name; b is the name's constant, cache the site's cache
+  INLINE_BINARY, // return a op b;
+} inline_kind_t;
+
+#define INLINE_CONSTANT 0x100
+
+typedef struct {
+  inline_kind_t kind;
+  uint8_t op; // OP_ADD, OP_LESS etc. for INLINE_BINARY
+  uint16_t a;
+  uint16_t b;
+  uint16_t cache;
+} inline_body_t;
+
 typedef struct {
   obj_t obj;
   int arity;
   int upvalue_count;
   chunk_t chunk;
   obj_string_t* name;
+  // Set by the compiler when the function can be inlined at call sites.
+  inline_body_t inline_body;
+  // Number of calls so far, counted until the function is handed to the JIT.
+  int call_count;
+  // Native code generated by the JIT, or NULL while the function is
+  // interpreted.
+  void* jit_code;
+  size_t jit_size;
 } obj_function_t;
 
 typedef value_t (*native_fn_t)(int arg_count, value_t* args);
@@ -75,23 +122,46 @@ typedef struct {
   int arity;
 } obj_native_t;
 
-typedef struct {
+typedef struct obj_closure_t {
   obj_t obj;
   obj_function_t* function;
   obj_upvalue_t** upvalues;
   int upvalue_count;
 } obj_closure_t;
 
-typedef struct {
+typedef struct obj_class_t {
   obj_t obj;
   obj_string_t* name;
   table_t methods;
+  // Bumped whenever methods changes, invalidating inline cache entries.
+  int method_version;
+  obj_closure_t* initializer; // the "init" method, or NULL
+  // Largest number of fields an instance of this class has grown to; used to
+  // size the inline field array of new instances.
+  int instance_fields;
 } obj_class_t;
 
+// Hidden class shared by all instances that had the same fields added in the
+// same order. names[i] is the name of the field stored in slot i of the
+// instance's field array.
+typedef struct obj_shape_t {
+  obj_t obj;
+  obj_string_t** names;
+  int field_count;
+  table_t transitions; // field name -> shape with that field appended
+} obj_shape_t;
+
 typedef struct {
   obj_t obj;
   obj_class_t* klass;
-  table_t fields;
+  // NULL once the instance has fallen back to storing its fields in
+  // dictionary.
+  obj_shape_t* shape;
+  value_t* fields; // inline_fields, or a heap array once they overflow
+  int field_capacity;
+  int inline_capacity;
+  table_t dictionary;
+  value_t inline_fields[];
 } obj_instance_t;
 
 typedef struct {
@@ -105,7 +175,8 @@ static inline bool is_obj_type(value_t value, obj_type_t type) {
 }
 
 obj_string_t* string_copy(const char* chars, int length);
-obj_string_t* string_take(char* chars, int length);
+// Both strings must be reachable, as the result may set off a collection.
+obj_string_t* string_concatenate(obj_string_t* first, obj_string_t* second);
 obj_upvalue_t* upvalue_new(value_t* slot);
 obj_function_t* function_new();
 obj_native_t* native_new(native_fn_t function, int arity);
@@ -113,6 +184,32 @@ obj_closure_t* closure_new(obj_function_t* function);
 obj_class_t* class_new(obj_string_t* name);
 obj_instance_t* instance_new(obj_class_t* klass);
 obj_bound_method_t* bound_method_new(value_t receiver, obj_closure_t* method);
+obj_shape_t* shape_new(obj_shape_t* parent, obj_string_t* name);
+void instance_set_field(obj_instance_t* instance, obj_string_t* name, value_t value);
 void object_print(value_t value);
 
+// Returns the field slot of name in instances with the given shape, or -1.
+// Field names are interned, so comparing pointers is enough.
+static inline int shape_find_slot(obj_shape_t* shape, obj_string_t* name) {
+  for (int i = 0; i < shape->field_count; i++) {
+    if (shape->names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static inline bool instance_get_field(obj_instance_t* instance, obj_string_t* name, value_t* value) {
+  if (instance->shape == NULL) {
+    return table_get(&instance->dictionary, name, value);
+  }
+
+  int slot = shape_find_slot(instance->shape, name);
+  if (slot == -1) {
+    return false;
+  }
+  *value = instance->fields[slot];
+  return true;
+}
+
 #endif // _CLOX_OBJECT_H
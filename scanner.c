@@ -68,11 +68,21 @@ token_t scanner_scan_token() {
     case '=':
       return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
+      if (match('<')) {
+        return make_token(TOKEN_LESS_LESS);
+      }
       return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
+      if (match('>')) {
+        return make_token(TOKEN_GREATER_GREATER);
+      }
       return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '/': return make_token(TOKEN_SLASH);
     case '%': return make_token(TOKEN_PERCENT);
+    case '&': return make_token(TOKEN_AMPERSAND);
+    case '|': return make_token(TOKEN_PIPE);
+    case '^': return make_token(TOKEN_CARET);
+    case '~': return make_token(TOKEN_TILDE);
     case '"': return string();
   }
 
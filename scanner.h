@@ -6,12 +6,13 @@ typedef enum {
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
-  TOKEN_PERCENT,
+  TOKEN_PERCENT, TOKEN_AMPERSAND, TOKEN_PIPE,
+  TOKEN_CARET, TOKEN_TILDE,
 
   TOKEN_BANG, TOKEN_BANG_EQUAL,
   TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
-  TOKEN_GREATER, TOKEN_GREATER_EQUAL,
-  TOKEN_LESS, TOKEN_LESS_EQUAL,
+  TOKEN_GREATER, TOKEN_GREATER_EQUAL, TOKEN_GREATER_GREATER,
+  TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_LESS_LESS,
 
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 
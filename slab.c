@@ -0,0 +1,718 @@
+#include "slab.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Size classes go up in steps of 8 bytes to 128, and in four steps per
+// doubling from there. Slots are at least as large as the 16 bytes each bit
+// of a bitmap stands for, so no two of them start under the same bit.
+#define SLAB_CLASSES 27
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE / 16 / 64)
+#ifdef CONCURRENT_GC
+#define SLAB_BITMAPS 2
+#else
+#define SLAB_BITMAPS 1
+#endif
+#define SLAB_HEADER_SIZE ((sizeof(slab_page_t) + 15) & ~(size_t)15)
+// Empty pages kept for reuse instead of being freed.
+#define SLAB_SPARE_PAGES 8
+
+// A page starts with this header, and its slots follow. Pages are aligned to
+// their size, so the page of a slot is found by masking its address. Like
+// the bitmaps, allocated has a bit for every 16 bytes of the page.
+typedef struct slab_page_t {
+  slab_bitmaps_t bitmaps; // of pages of objects
+  struct slab_page_t* next; // in its class's list of pages with free slots
+  char* free; // freed slots, linked through their first word
+  char* unused; // slots from here to limit have never been allocated
+  char* limit;
+  char* slots;
+  size_t slot_size;
+  int live;
+  int size_class;
+  bool objects;
+  bool listed; // the current page of its class, or in its list
+  uint64_t allocated[SLAB_BITMAP_WORDS]; // slots holding objects
+} slab_page_t;
+
+typedef struct {
+  slab_page_t* current;
+  slab_page_t* available; // pages other than current with free slots
+  slab_page_t* unswept; // pages of objects left to sweep lazily
+} slab_class_t;
+
+typedef struct {
+  slab_page_t** pages;
+  int count;
+  int capacity;
+} page_list_t;
+
+// Objects too large for a page are allocated after this header, which holds
+// their bits for the collector.
+typedef struct slab_large_t {
+  slab_bitmaps_t bitmaps;
+  struct slab_large_t* next;
+  struct slab_large_t* previous;
+  slab_word_t words[SLAB_BITMAPS];
+} slab_large_t;
+
+static_assert(sizeof(slab_large_t) <= SLAB_LARGE_HEADER, "SLAB_LARGE_HEADER is too small");
+
+typedef struct {
+  slab_class_t classes[2][SLAB_CLASSES]; // by whether they hold objects
+  page_list_t object_pages;
+  page_list_t array_pages;
+  page_list_t evacuating; // object pages being emptied by compaction
+  slab_page_t* spare;
+  int spare_count;
+  slab_large_t* large;
+  size_t (*release)(obj_t*); // while sweeping lazily
+  int unswept;
+  size_t class_size[SLAB_CLASSES];
+  uint8_t class_of[SLAB_MAX_SIZE / 8 + 1]; // by size in 8 byte units
+} slab_t;
+
+static slab_t slab;
+
+static void* slot_allocate(bool objects, size_t size);
+static void slot_free(slab_page_t* page, char* slot);
+static void array_free(void* pointer, size_t size);
+static void large_free(slab_large_t* large);
+static size_t sweep_page(slab_page_t* page, size_t (*release)(obj_t*));
+static slab_page_t* sweep_next(slab_class_t* klass);
+static slab_page_t* page_of(void* pointer);
+static slab_page_t* page_refill(slab_class_t* klass, bool objects, int size_class);
+static slab_page_t* page_new(bool objects, int size_class);
+static void page_release(slab_page_t* page);
+static void page_list(slab_page_t* page);
+static void page_list_add(page_list_t* list, slab_page_t* page);
+static void trim_pages(page_list_t* list, bool objects);
+static bool page_has_room(slab_page_t* page);
+static int page_capacity(slab_page_t* page);
+static bool page_allocated(slab_page_t* page, char* slot);
+static int compare_pages(const void* a, const void* b);
+static void clear_words(slab_word_t* words, int count);
+
+void slab_init() {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    if (i < 15) {
+      slab.class_size[i] = 8 * (i + 2);
+    } else {
+      slab.class_size[i] = (size_t)(5 + (i - 15) % 4) << (5 + (i - 15) / 4);
+    }
+  }
+  int size_class = 0;
+  for (int units = 0; units <= SLAB_MAX_SIZE / 8; units++) {
+    while (slab.class_size[size_class] < (size_t)units * 8) {
+      size_class++;
+    }
+    slab.class_of[units] = size_class;
+  }
+}
+
+void slab_free_all(size_t (*release)(obj_t*)) {
+  for (int i = 0; i < slab.object_pages.count; i++) {
+    slab_page_t* page = slab.object_pages.pages[i];
+    for (char* slot = page->slots; slot < page->unused; slot += page->slot_size) {
+      if (page_allocated(page, slot)) {
+        release((obj_t*)slot);
+      }
+    }
+  }
+  while (slab.large != NULL) {
+    slab_large_t* large = slab.large;
+    slab.large = large->next;
+    release((obj_t*)((char*)large + SLAB_LARGE_HEADER));
+    free(large);
+  }
+
+  page_list_t* lists[] = {&slab.object_pages, &slab.array_pages};
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < lists[i]->count; j++) {
+      page_release(lists[i]->pages[j]);
+    }
+    free(lists[i]->pages);
+    lists[i]->pages = NULL;
+    lists[i]->count = 0;
+    lists[i]->capacity = 0;
+  }
+  free(slab.evacuating.pages);
+  slab.evacuating.pages = NULL;
+  slab.evacuating.count = 0;
+  slab.evacuating.capacity = 0;
+  while (slab.spare != NULL) {
+    slab_page_t* spare = slab.spare;
+    slab.spare = spare->next;
+    free(spare->bitmaps.marks);
+    free(spare);
+  }
+  slab.spare_count = 0;
+  slab.release = NULL;
+  slab.unswept = 0;
+  memset(slab.classes, 0, sizeof(slab.classes));
+}
+
+void* slab_reallocate(void* pointer, size_t old_size, size_t new_size) {
+  if (new_size == 0) {
+    if (pointer != NULL) {
+      array_free(pointer, old_size);
+    }
+    return NULL;
+  }
+  bool new_small = new_size <= SLAB_MAX_SIZE;
+  if (pointer == NULL) {
+    return new_small ? slot_allocate(false, new_size) : malloc(new_size);
+  }
+
+  bool old_small = old_size <= SLAB_MAX_SIZE;
+  if (!old_small && !new_small) {
+    return realloc(pointer, new_size);
+  }
+  if (old_small && new_small &&
+      slab.class_of[(old_size + 7) / 8] == slab.class_of[(new_size + 7) / 8]) {
+    return pointer;
+  }
+  void* result = new_small ? slot_allocate(false, new_size) : malloc(new_size);
+  if (result == NULL) {
+    return NULL;
+  }
+  memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+  array_free(pointer, old_size);
+  return result;
+}
+
+void slab_defer_free(void* pointer, size_t size, void** list) {
+  if (pointer == NULL) {
+    return;
+  }
+  if (size > SLAB_MAX_SIZE) {
+    free(pointer);
+    return;
+  }
+  *(void**)pointer = *list;
+  *list = pointer;
+}
+
+void slab_free_list(void* list) {
+  while (list != NULL) {
+    void* next = *(void**)list;
+    slab_page_t* page = page_of(list);
+    slot_free(page, list);
+    page_list(page);
+    list = next;
+  }
+}
+
+obj_t* slab_allocate_object(size_t size) {
+  if (size <= SLAB_MAX_SIZE) {
+    obj_t* object = (obj_t*)slot_allocate(true, size);
+    if (object != NULL) {
+      object->is_large = false;
+    }
+    return object;
+  }
+
+  slab_large_t* large = (slab_large_t*)malloc(SLAB_LARGE_HEADER + size);
+  if (large == NULL) {
+    return NULL;
+  }
+  large->bitmaps.marks = &large->words[0];
+  large->bitmaps.evacuating = false;
+#ifdef CONCURRENT_GC
+  large->bitmaps.scanned = &large->words[1];
+#endif
+  clear_words(large->words, SLAB_BITMAPS);
+  large->previous = NULL;
+  large->next = slab.large;
+  if (slab.large != NULL) {
+    slab.large->previous = large;
+  }
+  slab.large = large;
+  obj_t* object = (obj_t*)((char*)large + SLAB_LARGE_HEADER);
+  object->is_large = true;
+  return object;
+}
+
+void slab_free_object(obj_t* object, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    large_free((slab_large_t*)((char*)object - SLAB_LARGE_HEADER));
+    return;
+  }
+
+  slab_page_t* page = page_of(object);
+  slot_free(page, (char*)object);
+  page_list(page);
+}
+
+int slab_page_count() {
+  return slab.object_pages.count;
+}
+
+// Only touches page and its bitmaps, so that pages can be swept in
+// parallel, and the live objects are left alone. Lining the page up for
+// allocation again is left to slab_trim().
+size_t slab_sweep_page(int index, size_t (*release)(obj_t*)) {
+  return sweep_page(slab.object_pages.pages[index], release);
+}
+
+size_t slab_sweep_large(size_t (*release)(obj_t*)) {
+  size_t freed = 0;
+  slab_large_t* large = slab.large;
+  while (large != NULL) {
+    slab_large_t* next = large->next;
+    obj_t* object = (obj_t*)((char*)large + SLAB_LARGE_HEADER);
+    if (!is_marked(object)) {
+      freed += release(object);
+      large_free(large);
+    }
+    large = next;
+  }
+  return freed;
+}
+
+void slab_sweep_begin(size_t (*release)(obj_t*)) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    slab_class_t* klass = &slab.classes[true][i];
+    klass->current = NULL;
+    klass->available = NULL;
+    klass->unswept = NULL;
+  }
+  // Pages left to sweep count as listed, so that nothing else lists them.
+  for (int i = 0; i < slab.object_pages.count; i++) {
+    slab_page_t* page = slab.object_pages.pages[i];
+    slab_class_t* klass = &slab.classes[true][page->size_class];
+    page->next = klass->unswept;
+    klass->unswept = page;
+    page->listed = true;
+  }
+  slab.release = release;
+  slab.unswept = slab.object_pages.count;
+}
+
+bool slab_sweep_some(int pages) {
+  for (int i = 0; i < SLAB_CLASSES && pages > 0; i++) {
+    slab_class_t* klass = &slab.classes[true][i];
+    for (; klass->unswept != NULL && pages > 0; pages--) {
+      slab_page_t* page = sweep_next(klass);
+      page->listed = false;
+      if (page_has_room(page)) {
+        page_list(page);
+      }
+    }
+  }
+  if (slab.unswept > 0) {
+    return false;
+  }
+  slab.release = NULL;
+  trim_pages(&slab.object_pages, true);
+  return true;
+}
+
+void slab_trim() {
+  trim_pages(&slab.object_pages, true);
+  trim_pages(&slab.array_pages, false);
+}
+
+void slab_clear_marks() {
+  for (int i = 0; i < slab.object_pages.count; i++) {
+    clear_words(slab.object_pages.pages[i]->bitmaps.marks, SLAB_BITMAP_WORDS * SLAB_BITMAPS);
+  }
+  for (slab_large_t* large = slab.large; large != NULL; large = large->next) {
+    clear_words(large->words, SLAB_BITMAPS);
+  }
+}
+
+double slab_fragmentation() {
+  size_t used = 0;
+  for (int i = 0; i < slab.object_pages.count; i++) {
+    slab_page_t* page = slab.object_pages.pages[i];
+    used += page->live * page->slot_size;
+  }
+  size_t total = (size_t)slab.object_pages.count * (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE);
+  return total == 0 ? 0 : 1 - (double)used / total;
+}
+
+// Within each size class, the pages are emptied from the least used up, as
+// long as they are less than half full and their objects fit in the free
+// slots of the pages left. Pages already empty, since minor collections
+// freed everything in them, are left for trim_pages() to give back.
+bool slab_compact_begin() {
+  int count = slab.object_pages.count;
+  slab_page_t** pages = (slab_page_t**)malloc(sizeof(slab_page_t*) * (count + 1));
+  if (pages == NULL) {
+    return false;
+  }
+  memcpy(pages, slab.object_pages.pages, sizeof(slab_page_t*) * count);
+  qsort(pages, count, sizeof(slab_page_t*), compare_pages);
+
+  for (int first = 0, last; first < count; first = last) {
+    int room = 0;
+    for (last = first; last < count && pages[last]->size_class == pages[first]->size_class; last++) {
+      if (pages[last]->live > 0) {
+        room += page_capacity(pages[last]) - pages[last]->live;
+      }
+    }
+    for (int i = first; i < last; i++) {
+      slab_page_t* page = pages[i];
+      if (page->live == 0) {
+        continue;
+      }
+      int capacity = page_capacity(page);
+      // Emptying the page takes away its free slots, and fills others with
+      // its live ones.
+      if (page->live * 2 >= capacity || room < capacity) {
+        break;
+      }
+      room -= capacity;
+      page->bitmaps.evacuating = true;
+      page_list_add(&slab.evacuating, page);
+    }
+  }
+  free(pages);
+  if (slab.evacuating.count == 0) {
+    return false;
+  }
+
+  // Nothing is allocated from the pages being emptied.
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    slab_class_t* klass = &slab.classes[true][i];
+    if (klass->current != NULL && klass->current->bitmaps.evacuating) {
+      klass->current->listed = false;
+      klass->current = NULL;
+    }
+  }
+  trim_pages(&slab.object_pages, true);
+  return true;
+}
+
+bool slab_evacuate(void (*moved)(obj_t* from, obj_t* to)) {
+  for (int i = 0; i < slab.evacuating.count; i++) {
+    slab_page_t* page = slab.evacuating.pages[i];
+    for (char* slot = page->slots; slot < page->unused; slot += page->slot_size) {
+      if (!page_allocated(page, slot)) {
+        continue;
+      }
+      obj_t* from = (obj_t*)slot;
+      obj_t* to = (obj_t*)slot_allocate(true, page->slot_size);
+      if (to == NULL) {
+        return false;
+      }
+      memcpy(to, from, page->slot_size);
+      if (is_marked(from)) {
+        set_mark(to);
+      }
+      ((obj_t**)from)[1] = to;
+      moved(from, to);
+    }
+  }
+  return true;
+}
+
+void slab_each_object(void (*visit)(obj_t*)) {
+  for (int i = 0; i < slab.object_pages.count; i++) {
+    slab_page_t* page = slab.object_pages.pages[i];
+    if (page->bitmaps.evacuating) {
+      continue;
+    }
+    for (char* slot = page->slots; slot < page->unused; slot += page->slot_size) {
+      if (page_allocated(page, slot)) {
+        visit((obj_t*)slot);
+      }
+    }
+  }
+  for (slab_large_t* large = slab.large; large != NULL; large = large->next) {
+    visit((obj_t*)((char*)large + SLAB_LARGE_HEADER));
+  }
+}
+
+void slab_compact_end() {
+  int kept = 0;
+  for (int i = 0; i < slab.object_pages.count; i++) {
+    slab_page_t* page = slab.object_pages.pages[i];
+    if (page->bitmaps.evacuating) {
+      page_release(page);
+    } else {
+      slab.object_pages.pages[kept++] = page;
+    }
+  }
+  slab.object_pages.count = kept;
+  slab.evacuating.count = 0;
+  trim_pages(&slab.object_pages, true);
+#ifdef __GLIBC__
+  // free() holds on to pages in the middle of the heap.
+  malloc_trim(0);
+#endif
+}
+
+static size_t sweep_page(slab_page_t* page, size_t (*release)(obj_t*)) {
+  size_t start = page->slots - (char*)page;
+  size_t freed = 0;
+  for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+#ifdef CONCURRENT_GC
+    uint64_t marks = atomic_load_explicit(&page->bitmaps.marks[word], memory_order_relaxed);
+#else
+    uint64_t marks = page->bitmaps.marks[word];
+#endif
+    uint64_t dead = page->allocated[word] & ~marks;
+    for (int bit = 0; dead != 0; bit++, dead >>= 1) {
+      if ((dead & 1) != 0) {
+        // The last slot to start before the end of the bit's 16 bytes.
+        size_t offset = (word * 64 + bit) * 16 + 15 - start;
+        char* slot = page->slots + offset / page->slot_size * page->slot_size;
+        freed += release((obj_t*)slot);
+        slot_free(page, slot);
+      }
+    }
+  }
+  return freed;
+}
+
+// Sweeps the next page of klass left to sweep lazily.
+static slab_page_t* sweep_next(slab_class_t* klass) {
+  slab_page_t* page = klass->unswept;
+  klass->unswept = page->next;
+  page->next = NULL;
+  slab.unswept--;
+  sweep_page(page, slab.release);
+  return page;
+}
+
+static void* slot_allocate(bool objects, size_t size) {
+  int size_class = slab.class_of[(size + 7) / 8];
+  slab_class_t* klass = &slab.classes[objects][size_class];
+  slab_page_t* page = klass->current;
+  if (page == NULL || (page->free == NULL && page->unused == page->limit)) {
+    page = page_refill(klass, objects, size_class);
+    if (page == NULL) {
+      return NULL;
+    }
+  }
+
+  char* slot;
+  if (page->free != NULL) {
+    slot = page->free;
+    page->free = *(char**)slot;
+  } else {
+    slot = page->unused;
+    page->unused += page->slot_size;
+  }
+  page->live++;
+  if (objects) {
+    size_t index = (slot - (char*)page) / 16;
+    page->allocated[index / 64] |= 1ULL << (index % 64);
+  }
+  return slot;
+}
+
+static void slot_free(slab_page_t* page, char* slot) {
+  if (page->objects) {
+    size_t index = (slot - (char*)page) / 16;
+    page->allocated[index / 64] &= ~(1ULL << (index % 64));
+  }
+  *(char**)slot = page->free;
+  page->free = slot;
+  page->live--;
+}
+
+static void array_free(void* pointer, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    free(pointer);
+    return;
+  }
+  slab_page_t* page = page_of(pointer);
+  slot_free(page, pointer);
+  page_list(page);
+}
+
+static void large_free(slab_large_t* large) {
+  if (large->previous != NULL) {
+    large->previous->next = large->next;
+  } else {
+    slab.large = large->next;
+  }
+  if (large->next != NULL) {
+    large->next->previous = large->previous;
+  }
+  free(large);
+}
+
+static slab_page_t* page_of(void* pointer) {
+  return (slab_page_t*)((uintptr_t)pointer & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+// Moves klass on to another page with free slots, or a new one.
+static slab_page_t* page_refill(slab_class_t* klass, bool objects, int size_class) {
+  slab_page_t* page = klass->available;
+  if (page != NULL) {
+    klass->available = page->next;
+  }
+  // Pages left to sweep come before new ones.
+  while (page == NULL && klass->unswept != NULL) {
+    page = sweep_next(klass);
+    if (!page_has_room(page)) {
+      page->listed = false;
+      page = NULL;
+    }
+  }
+  if (page == NULL) {
+    page = page_new(objects, size_class);
+    if (page == NULL) {
+      return NULL;
+    }
+  }
+  if (klass->current != NULL) {
+    klass->current->listed = false;
+  }
+  klass->current = page;
+  return page;
+}
+
+static slab_page_t* page_new(bool objects, int size_class) {
+  slab_page_t* page = slab.spare;
+  if (page != NULL) {
+    slab.spare = page->next;
+    slab.spare_count--;
+  } else {
+    page = (slab_page_t*)aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL) {
+      return NULL;
+    }
+    page->bitmaps.marks = NULL;
+  }
+  page->bitmaps.evacuating = false;
+  if (objects && page->bitmaps.marks == NULL) {
+    // The bitmaps of a page share one allocation, freed with the page.
+    page->bitmaps.marks = (slab_word_t*)malloc(sizeof(slab_word_t) * SLAB_BITMAP_WORDS * SLAB_BITMAPS);
+    if (page->bitmaps.marks == NULL) {
+      free(page);
+      return NULL;
+    }
+#ifdef CONCURRENT_GC
+    page->bitmaps.scanned = page->bitmaps.marks + SLAB_BITMAP_WORDS;
+#endif
+  }
+  if (objects) {
+    clear_words(page->bitmaps.marks, SLAB_BITMAP_WORDS * SLAB_BITMAPS);
+  }
+
+  page->next = NULL;
+  page->free = NULL;
+  page->slot_size = slab.class_size[size_class];
+  page->slots = (char*)page + SLAB_HEADER_SIZE;
+  page->unused = page->slots;
+  page->limit = page->slots + (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / page->slot_size * page->slot_size;
+  page->live = 0;
+  page->size_class = size_class;
+  page->objects = objects;
+  page->listed = true;
+  memset(page->allocated, 0, sizeof(page->allocated));
+
+  page_list_add(objects ? &slab.object_pages : &slab.array_pages, page);
+  return page;
+}
+
+static void page_release(slab_page_t* page) {
+  if (slab.spare_count < SLAB_SPARE_PAGES) {
+    page->next = slab.spare;
+    slab.spare = page;
+    slab.spare_count++;
+  } else {
+    free(page->bitmaps.marks);
+    free(page);
+  }
+}
+
+// Puts page, which has just had a slot freed, in its class's list unless it
+// is there already.
+static void page_list(slab_page_t* page) {
+  if (page->listed) {
+    return;
+  }
+  slab_class_t* klass = &slab.classes[page->objects][page->size_class];
+  page->next = klass->available;
+  klass->available = page;
+  page->listed = true;
+}
+
+static void page_list_add(page_list_t* list, slab_page_t* page) {
+  if (list->capacity < list->count + 1) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->pages = (slab_page_t**)realloc(list->pages, sizeof(slab_page_t*) * list->capacity);
+
+    if (list->pages == NULL) {
+      exit(1);
+    }
+  }
+  list->pages[list->count++] = page;
+}
+
+// Frees the empty pages in list, other than the ones being allocated from,
+// and rebuilds the lists of pages with free slots from the rest.
+static void trim_pages(page_list_t* list, bool objects) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    slab.classes[objects][i].available = NULL;
+  }
+
+  int kept = 0;
+  for (int i = 0; i < list->count; i++) {
+    slab_page_t* page = list->pages[i];
+    slab_class_t* klass = &slab.classes[objects][page->size_class];
+    if (page != klass->current) {
+      // Pages being emptied are given back by slab_compact_end(), once
+      // nothing reads them any more.
+      if (page->live == 0 && !page->bitmaps.evacuating) {
+        page_release(page);
+        continue;
+      }
+      // Full pages are left untouched.
+      bool listed = !page->bitmaps.evacuating && page_has_room(page);
+      if (listed) {
+        page->next = klass->available;
+        klass->available = page;
+      }
+      if (page->listed != listed) {
+        page->listed = listed;
+      }
+    }
+    list->pages[kept++] = page;
+  }
+  list->count = kept;
+}
+
+static void clear_words(slab_word_t* words, int count) {
+  for (int i = 0; i < count; i++) {
+#ifdef CONCURRENT_GC
+    atomic_store_explicit(&words[i], 0, memory_order_relaxed);
+#else
+    words[i] = 0;
+#endif
+  }
+}
+
+static bool page_has_room(slab_page_t* page) {
+  return page->free != NULL || page->unused < page->limit;
+}
+
+static int page_capacity(slab_page_t* page) {
+  return (int)((page->limit - page->slots) / page->slot_size);
+}
+
+static bool page_allocated(slab_page_t* page, char* slot) {
+  size_t index = (slot - (char*)page) / 16;
+  return (page->allocated[index / 64] & (1ULL << (index % 64))) != 0;
+}
+
+// By size class, then from the least used page up.
+static int compare_pages(const void* a, const void* b) {
+  slab_page_t* page_a = *(slab_page_t* const*)a;
+  slab_page_t* page_b = *(slab_page_t* const*)b;
+  if (page_a->size_class != page_b->size_class) {
+    return page_a->size_class - page_b->size_class;
+  }
+  return page_a->live - page_b->live;
+}
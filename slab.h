@@ -0,0 +1,164 @@
+#ifndef _CLOX_SLAB_H
+#define _CLOX_SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+
+// Objects and small arrays are carved out of pages of SLAB_PAGE_SIZE bytes,
+// each of which holds slots of a single size class, up to SLAB_MAX_SIZE.
+// Objects and arrays never share a page, so that a page of objects can be
+// swept on its own. Anything larger comes from malloc(), after a header of
+// SLAB_LARGE_HEADER bytes.
+#define SLAB_PAGE_SIZE (32 * 1024)
+#define SLAB_MAX_SIZE 1024
+#define SLAB_LARGE_HEADER 64
+
+#ifdef CONCURRENT_GC
+typedef _Atomic(uint64_t) slab_word_t;
+#else
+typedef uint64_t slab_word_t;
+#endif
+
+// The collector's bits for each object are kept in bitmaps allocated apart
+// from the objects, with a bit for every 16 bytes of a page, so that a
+// collection writes to the bitmaps and not to the objects. Pages and the
+// headers of large objects start with pointers to their bitmaps.
+typedef struct {
+  slab_word_t* marks;
+#ifdef CONCURRENT_GC
+  // Set once the references in the object have been marked during the
+  // current concurrent collection.
+  slab_word_t* scanned;
+#endif
+  bool evacuating; // the objects are being moved out, see slab_forward()
+} slab_bitmaps_t;
+
+static inline slab_bitmaps_t* slab_bitmaps(obj_t* object, uint64_t* mask, int* word) {
+  if (object->is_large) {
+    *mask = 1;
+    *word = 0;
+    return (slab_bitmaps_t*)((char*)object - SLAB_LARGE_HEADER);
+  }
+  uintptr_t index = ((uintptr_t)object & (SLAB_PAGE_SIZE - 1)) / 16;
+  *mask = 1ULL << (index % 64);
+  *word = (int)(index / 64);
+  return (slab_bitmaps_t*)((uintptr_t)object & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline bool is_marked(obj_t* object) {
+  uint64_t mask;
+  int word;
+  slab_bitmaps_t* bitmaps = slab_bitmaps(object, &mask, &word);
+#ifdef CONCURRENT_GC
+  return (atomic_load_explicit(&bitmaps->marks[word], memory_order_relaxed) & mask) != 0;
+#else
+  return (bitmaps->marks[word] & mask) != 0;
+#endif
+}
+
+// Marks object, when no other thread is marking.
+static inline void set_mark(obj_t* object) {
+  uint64_t mask;
+  int word;
+  slab_bitmaps_t* bitmaps = slab_bitmaps(object, &mask, &word);
+#ifdef CONCURRENT_GC
+  uint64_t marks = atomic_load_explicit(&bitmaps->marks[word], memory_order_relaxed);
+  atomic_store_explicit(&bitmaps->marks[word], marks | mask, memory_order_relaxed);
+#else
+  bitmaps->marks[word] |= mask;
+#endif
+}
+
+#ifdef CONCURRENT_GC
+// Marks object while other threads may be marking objects in the same word,
+// returning false if it was marked already.
+static inline bool claim_mark(obj_t* object) {
+  uint64_t mask;
+  int word;
+  slab_bitmaps_t* bitmaps = slab_bitmaps(object, &mask, &word);
+  return (atomic_fetch_or_explicit(&bitmaps->marks[word], mask, memory_order_relaxed) & mask) == 0;
+}
+#endif
+
+#ifdef CONCURRENT_GC
+static inline bool is_scanned(obj_t* object) {
+  uint64_t mask;
+  int word;
+  slab_bitmaps_t* bitmaps = slab_bitmaps(object, &mask, &word);
+  return (atomic_load_explicit(&bitmaps->scanned[word], memory_order_acquire) & mask) != 0;
+}
+
+static inline void set_scanned(obj_t* object) {
+  uint64_t mask;
+  int word;
+  slab_bitmaps_t* bitmaps = slab_bitmaps(object, &mask, &word);
+  atomic_fetch_or_explicit(&bitmaps->scanned[word], mask, memory_order_release);
+}
+#endif
+
+// Where object is after compaction: an object moved out of its page left
+// its new address in its second word.
+static inline obj_t* slab_forward(obj_t* object) {
+  if (object == NULL || object->is_large) {
+    return object;
+  }
+  slab_bitmaps_t* page = (slab_bitmaps_t*)((uintptr_t)object & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+  return page->evacuating ? ((obj_t**)object)[1] : object;
+}
+
+void slab_init();
+// Frees every page, after calling release on every object still allocated.
+void slab_free_all(size_t (*release)(obj_t*));
+
+// Arrays, which behave as with realloc() except that old_size must be the
+// size pointer was last allocated with. Returns NULL if out of memory.
+void* slab_reallocate(void* pointer, size_t old_size, size_t new_size);
+// Frees an array of size bytes from a thread other than the program's: small
+// ones are put on list until slab_free_list() is called from the program's
+// thread.
+void slab_defer_free(void* pointer, size_t size, void** list);
+void slab_free_list(void* list);
+
+obj_t* slab_allocate_object(size_t size);
+void slab_free_object(obj_t* object, size_t size);
+
+// Sweeping frees the unmarked objects of one page at a time, or of those too
+// large for a page, calling release on each of them first to free what it
+// owns and find its size. Returns the bytes freed. Different pages can be
+// swept in parallel, as long as slab_trim() is called once they are all
+// done.
+int slab_page_count();
+size_t slab_sweep_page(int index, size_t (*release)(obj_t*));
+size_t slab_sweep_large(size_t (*release)(obj_t*));
+// Sweeping lazily instead leaves each page of objects to be swept when its
+// class runs out of free slots, or by slab_sweep_some(). Meanwhile objects
+// are only allocated in pages already swept, where they are not mistaken
+// for dead ones.
+void slab_sweep_begin(size_t (*release)(obj_t*));
+// Sweeps up to pages more pages, returning true once every page has been
+// swept and the empty ones given back.
+bool slab_sweep_some(int pages);
+// Gives the empty pages back and lines the others up for allocation, after
+// a full collection.
+void slab_trim();
+// Unmarks every object, at the start of a full collection.
+void slab_clear_marks();
+
+// Compaction moves the objects out of the least used pages into free slots
+// of the others, and gives the pages it empties back. The fraction of the
+// pages of objects that is free says whether it is worth it.
+double slab_fragmentation();
+// Picks the pages to empty, returning false if none is worth it.
+bool slab_compact_begin();
+// Moves the objects out of the pages picked, calling moved for each one
+// after copying it. Returns false if out of memory. The old copies stay in
+// place, forwarding to the new ones, until slab_compact_end().
+bool slab_evacuate(void (*moved)(obj_t* from, obj_t* to));
+// Calls visit for every object outside the pages being emptied.
+void slab_each_object(void (*visit)(obj_t*));
+void slab_compact_end();
+
+#endif // _CLOX_SLAB_H
@@ -104,6 +104,30 @@ obj_string_t* table_find_string(table_t* table, const char* chars, int length, u
   }
 }
 
+obj_string_t* table_find_concatenation(table_t* table, obj_string_t* first, obj_string_t* second, uint32_t hash) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  int length = first->length + second->length;
+  uint32_t index = hash & table->capacity;
+  for (;;) {
+    entry_t* entry = &table->entries[index];
+    if (entry->key == NULL) {
+      if (IS_NIL(entry->value)) {
+        return NULL;
+      }
+    } else if (entry->key->length == length &&
+               entry->key->hash == hash &&
+               memcmp(entry->key->chars, first->chars, first->length) == 0 &&
+               memcmp(entry->key->chars + first->length, second->chars, second->length) == 0) {
+      return entry->key;
+    }
+
+    index = (index + 1) & table->capacity;
+  }
+}
+
 void mark_table(table_t* table) {
   for (int i = 0; i <= table->capacity; i++) {
     entry_t* entry = &table->entries[i];
@@ -115,7 +139,7 @@ void mark_table(table_t* table) {
 void table_remove_white(table_t* table) {
   for (int i = 0; i <= table->capacity; i++) {
     entry_t* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
+    if (entry->key != NULL && !is_marked(&entry->key->obj)) {
       table_delete(table, entry->key);
     }
   }
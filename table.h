@@ -23,6 +23,9 @@ bool table_get(table_t* table, obj_string_t* key, value_t* value);
 bool table_delete(table_t* table, obj_string_t* key);
 void table_add_all(table_t* from, table_t* to);
 obj_string_t* table_find_string(table_t* table, const char* chars, int length, uint32_t hash);
+// Finds the string equal to first followed by second, without putting them
+// together.
+obj_string_t* table_find_concatenation(table_t* table, obj_string_t* first, obj_string_t* second, uint32_t hash);
 void mark_table(table_t* table);
 void table_remove_white(table_t* table);
 
@@ -15,7 +15,7 @@ void value_array_init(value_array_t* array) {
 }
 
 void value_array_free(value_array_t* array) {
-  free(array->values);
+  FREE_ARRAY(value_t, array->values, array->capacity);
   value_array_init(array);
 }
 
@@ -54,6 +54,9 @@ void value_print(value_t value) {
     case VAL_OBJ:
       object_print(value);
       break;
+    case VAL_UNDEFINED:
+      printf("undefined");
+      break;
   }
 #endif // NAN_BOXING
 }
@@ -73,6 +76,7 @@ bool values_equal(value_t first, value_t second) {
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(first) == AS_NUMBER(second);
     case VAL_OBJ:    return AS_OBJ(first) == AS_OBJ(second);
+    case VAL_UNDEFINED: return true;
     default:         return false;  // unreachable
   }
 #endif // NAN_BOXING
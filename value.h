@@ -1,6 +1,7 @@
 #ifndef _CLOX_VALUE_H
 #define _CLOX_VALUE_H
 
+#include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -16,15 +17,29 @@ typedef struct obj_string_t obj_string_t;
 #define TAG_NIL 1
 #define TAG_FALSE 2
 #define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+// Numbers that are integers fitting in 32 bits are boxed as ints, in the
+// low half of a quiet NaN with this bit set, and all others as doubles. Both
+// forms are the same number to Lox code: IS_NUMBER() and AS_NUMBER() accept
+// either, and only the arithmetic fast paths tell them apart.
+#define INT_TAG ((uint64_t)(QNAN | ((uint64_t)1 << 48)))
 
 typedef uint64_t value_t;
 
 #define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)    ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_INT(value)    (((value) >> 32) == (INT_TAG >> 32))
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+// Both a and b are ints, tested at once.
+#define ARE_INTS(a, b)   (((((a) ^ INT_TAG) | ((b) ^ INT_TAG)) >> 32) == 0)
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_INT(value)    ((int32_t)(uint32_t)(value))
+#define AS_DOUBLE(value) value_to_double(value)
 #define AS_NUMBER(value) value_to_num(value)
 #define AS_OBJ(value)    ((obj_t*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -33,15 +48,21 @@ typedef uint64_t value_t;
 
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)
 #define NIL_VAL         ((value_t)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((value_t)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define INT_VAL(i)      ((value_t)(INT_TAG | (uint32_t)(int32_t)(i)))
 #define NUMBER_VAL(num) num_to_value(num)
 #define OBJ_VAL(obj)    (value_t)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
-static inline double value_to_num(value_t value) {
+static inline double value_to_double(value_t value) {
   double num;
   memcpy(&num, &value, sizeof(value_t));
   return num;
 }
 
+static inline double value_to_num(value_t value) {
+  return IS_INT(value) ? AS_INT(value) : AS_DOUBLE(value);
+}
+
 static inline value_t num_to_value(double num) {
   value_t value;
   memcpy(&value, &num, sizeof(double));
@@ -55,6 +76,7 @@ typedef enum {
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_UNDEFINED,
 } value_type_t;
 
 typedef struct {
@@ -70,18 +92,53 @@ typedef struct {
 #define IS_NIL(value)    ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)    ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+// Without NaN boxing all numbers are doubles.
+#define IS_INT(value)    false
+#define IS_DOUBLE(value) IS_NUMBER(value)
+#define ARE_INTS(a, b)   false
 
 #define AS_BOOL(value)   ((value).as.boolean)
+#define AS_INT(value)    ((int32_t)(value).as.number)
+#define AS_DOUBLE(value) ((value).as.number)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJ(value)    ((value).as.obj)
 
 #define BOOL_VAL(value)   ((value_t){VAL_BOOL,   {.boolean=(value)}})
 #define NIL_VAL           ((value_t){VAL_NIL,    {.number=0}})
+#define INT_VAL(value)    NUMBER_VAL((double)(int32_t)(value))
 #define NUMBER_VAL(value) ((value_t){VAL_NUMBER, {.number=(value)}})
 #define OBJ_VAL(value)    ((value_t){VAL_OBJ,    {.obj=(obj_t*)(value)}})
+#define UNDEFINED_VAL     ((value_t){VAL_UNDEFINED, {.number=0}})
 
 #endif // NAN_BOXING
 
+// UNDEFINED_VAL marks global variable slots that have not been defined yet.
+// It is never visible to Lox code.
+
+// Whether num is an integer that fits in an int32_t.
+static inline bool num_is_int32(double num) {
+  return num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num;
+}
+
+// num in the form it would be boxed in if it were computed from ints: an int
+// if it is one, and a double otherwise (including -0).
+static inline value_t num_to_narrow_value(double num) {
+  if (num_is_int32(num) && !(num == 0 && signbit(num))) {
+    return INT_VAL((int32_t)num);
+  }
+  return NUMBER_VAL(num);
+}
+
+// The exact result of arithmetic on two ints, an int again unless it
+// overflows.
+static inline value_t int64_to_value(int64_t i) {
+  if (i < INT32_MIN || i > INT32_MAX) {
+    return NUMBER_VAL((double)i);
+  }
+  return INT_VAL((int32_t)i);
+}
+
 typedef struct {
   int count;
   int capacity;
@@ -8,18 +8,31 @@
 #include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "slab.h"
 #include "value.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+// Labels as values are a GNU extension; fall back to the portable switch.
+#undef COMPUTED_GOTO
+#endif
+
+#if defined(JIT) && defined(COMPUTED_GOTO)
+// Traces are recorded by swapping the dispatch table, so loops are only
+// traced with threaded dispatch.
+#define TRACE_LOOPS
+#endif
+
 vm_t vm;
 
 // Forward declarations.
-static execute_result_t vm_run();
+static execute_result_t vm_run(int base_frame);
 static void stack_reset();
 static void stack_debug_print();
 static value_t stack_peek(int distance);
@@ -29,41 +42,99 @@ static void concatenate_strings();
 static bool call_value(value_t callee, int arg_count);
 static obj_upvalue_t* capture_upvalue(value_t* local);
 static bool call(obj_closure_t* closure, int arg_count);
+static inline bool call_inline(obj_function_t* function, int arg_count, value_t* slots);
+static inline value_t multiply_ints(int32_t a, int32_t b);
+static bool bitwise_op(uint8_t op, value_t a, value_t b, value_t* result);
+static bool tail_call_value(value_t callee, int arg_count);
+static bool tail_call(obj_closure_t* closure, int arg_count);
+static void count_call(obj_function_t* function);
 static void native_define(const char* name, int arity, native_fn_t function);
 static value_t native_clock(int arg_count, value_t* args);
 static void close_upvalues(value_t* last);
 static void define_method(obj_string_t* name);
 static bool bind_method(obj_class_t* klass, obj_string_t* name);
-static bool invoke(obj_string_t* name, int arg_count);
-static bool invoke_from_class(obj_class_t* klass, obj_string_t* name, int arg_count);
+static bool get_property(obj_instance_t* instance, obj_string_t* name, inline_cache_t* cache, cache_entry_t* entry);
+static void set_property(obj_instance_t* instance, obj_string_t* name, value_t value, inline_cache_t* cache);
+static bool invoke(obj_string_t* name, int arg_count, inline_cache_t* cache, bool tail);
+static bool invoke_from_class(obj_class_t* klass, obj_string_t* name, int arg_count, bool tail);
+static bool super_invoke(obj_class_t* superclass, obj_string_t* name, int arg_count, inline_cache_t* cache, bool tail);
+static inline cache_entry_t* cache_lookup(inline_cache_t* cache, obj_class_t* klass, obj_shape_t* shape);
+static cache_entry_t* cache_add(inline_cache_t* cache, obj_class_t* klass, obj_shape_t* shape);
+static void cache_fill_property(inline_cache_t* cache, obj_instance_t* instance, obj_string_t* name);
+#ifdef JIT
+static bool finish_call(int frame_count);
+static bool get_property_operands(chunk_t* chunk, uint8_t* operands);
+#endif
 
 void vm_init() {
   stack_reset();
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+  vm.instruction_count = 0;
+#endif
+#ifdef DEBUG_INLINE_CACHE_STATS
+  vm.cache_hits = 0;
+  vm.cache_misses = 0;
+#endif
   vm.bytes_allocated = 0;
   vm.next_gc = 1024 * 1024;
-  vm.objects = NULL;
+  slab_init();
+  vm.young_count = 0;
+  vm.young_capacity = 0;
+  vm.young_objects = NULL;
+  vm.young_bytes = 0;
+  vm.gc_phase = GC_IDLE;
+  vm.gc_start_pending = false;
+  vm.compact_pending = false;
 
   vm.gray_count = 0;
   vm.gray_capacity = 0;
   vm.gray_stack = NULL;
 
-  table_init(&vm.globals);
+  vm.remembered_count = 0;
+  vm.remembered_capacity = 0;
+  vm.remembered = NULL;
+
+  table_init(&vm.global_slots);
+  value_array_init(&vm.global_names);
+  value_array_init(&vm.globals);
   table_init(&vm.strings);
 
   vm.init_string = NULL;
   vm.init_string = string_copy("init", 4);
 
+  vm.empty_shape = NULL;
+  vm.empty_shape = shape_new(NULL, NULL);
+
   native_define("clock", 0, native_clock);
 }
 
 void vm_free() {
   table_free(&vm.strings);
-  table_free(&vm.globals);
+  table_free(&vm.global_slots);
+  value_array_free(&vm.global_names);
+  value_array_free(&vm.globals);
   vm.init_string = NULL;
+  vm.empty_shape = NULL;
   free_objects();
+
+  if (gc_options.print_stats) {
+    gc_print_stats();
+  }
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+  fprintf(stderr, "-- %llu instructions executed\n", (unsigned long long)vm.instruction_count);
+#endif
+#ifdef DEBUG_INLINE_CACHE_STATS
+  uint64_t lookups = vm.cache_hits + vm.cache_misses;
+  fprintf(stderr, "-- inline caches: %llu hits, %llu misses (%.2f%% hit rate)\n",
+          (unsigned long long)vm.cache_hits, (unsigned long long)vm.cache_misses,
+          lookups == 0 ? 0.0 : 100.0 * vm.cache_hits / lookups);
+#endif
 }
 
 execute_result_t execute(const char* source) {
+  if (vm.compact_pending) {
+    compact_heap();
+  }
   obj_function_t* function = compile(source);
   if (function == NULL) {
     return EXECUTE_COMPILE_ERROR;
@@ -75,293 +146,918 @@ execute_result_t execute(const char* source) {
   stack_push(OBJ_VAL(closure));
   call(closure, 0);
 
-  return vm_run();
+  return vm_run(0);
 }
 
-static execute_result_t vm_run() {
-  call_frame_t* frame = &vm.frames[vm.frame_count - 1];
+#if defined(COMPUTED_GOTO) && defined(__GNUC__) && !defined(__clang__)
+// Keep GCC from merging the per-handler dispatch jumps back into one, either
+// directly or by hoisting common code into a shared dispatch block (GCSE).
+#pragma GCC push_options
+#pragma GCC optimize("no-crossjumping", "no-gcse")
+#endif
+
+// Runs the interpreter until the frame count drops back to base_frame, or
+// until the script returns. Compiled code calls back in here to run
+// interpreted callees.
+static execute_result_t vm_run(int base_frame) {
+  // The hot interpreter state is kept in locals so the compiler can keep it
+  // in registers. It is written back to the current frame and to
+  // vm.stack_top (SAVE_STATE) before anything that can observe it: calls,
+  // allocations that may trigger a collection and runtime errors.
+  call_frame_t* frame;
+  uint8_t* ip;
+  value_t* slots;
+  value_t* constants;
+  inline_cache_t* caches;
+  value_t* stack_top = vm.stack_top;
 
-#define READ_BYTE() (*frame->ip++)
+#define LOAD_FRAME() \
+  do { \
+    frame = &vm.frames[vm.frame_count - 1]; \
+    ip = frame->ip; \
+    slots = frame->slots; \
+    constants = frame->closure->function->chunk.constants.values; \
+    caches = frame->closure->function->chunk.caches; \
+  } while (false)
+#define SAVE_STATE() \
+  do { \
+    frame->ip = ip; \
+    vm.stack_top = stack_top; \
+  } while (false)
+#define LOAD_STACK() (stack_top = vm.stack_top)
+#ifdef JIT
+// Loads the frame after a call. A frame that was just pushed for a compiled
+// function is run as native code to completion before continuing with the
+// caller.
+#define ENTER_FRAME() \
+  do { \
+    LOAD_FRAME(); \
+    if (frame->closure->function->jit_code != NULL && ip == frame->closure->function->chunk.code) { \
+      if (jit_run(frame) != EXECUTE_OK) { \
+        return EXECUTE_RUNTIME_ERROR; \
+      } \
+      LOAD_STACK(); \
+      LOAD_FRAME(); \
+    } \
+  } while (false)
+#else
+#define ENTER_FRAME() LOAD_FRAME()
+#endif
+
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+  (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define GLOBAL_NAME(slot) AS_STRING(vm.global_names.values[slot])
+#define READ_CACHE() (&caches[READ_SHORT()])
+// Rewrites the instruction being executed, whose operands have all been
+// read, to a form specialized for the operand types seen.
+#define QUICKEN(opcode) (ip[-1] = (opcode))
+#define RUNTIME_ERROR(...) \
+  do { \
+    SAVE_STATE(); \
+    runtime_error(__VA_ARGS__); \
+    return EXECUTE_RUNTIME_ERROR; \
+  } while (false)
 #define BINARY_OP(value_type, op) \
   do { \
-    if (!IS_NUMBER(stack_peek(0)) || !IS_NUMBER(stack_peek(1))) { \
-      runtime_error("operands must be numbers"); \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+      RUNTIME_ERROR("operands must be numbers"); \
+    } \
+    double b = AS_NUMBER(POP()); \
+    double a = AS_NUMBER(PEEK(0)); \
+    PEEK(0) = value_type(a op b); \
+  } while (false)
+// BINARY_OP with a fast path for two ints, whose result int_type builds from
+// the exact value computed on 64 bits.
+#define INT_BINARY_OP(int_type, value_type, op) \
+  do { \
+    if (ARE_INTS(PEEK(0), PEEK(1))) { \
+      int64_t b = AS_INT(POP()); \
+      PEEK(0) = int_type(AS_INT(PEEK(0)) op b); \
+    } else { \
+      BINARY_OP(value_type, op); \
+    } \
+  } while (false)
+#define BINARY_OP_CONSTANT(int_type, value_type, op) \
+  do { \
+    value_t b = READ_CONSTANT(); \
+    if (ARE_INTS(PEEK(0), b)) { \
+      PEEK(0) = int_type((int64_t)AS_INT(PEEK(0)) op AS_INT(b)); \
+      break; \
+    } \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(b)) { \
+      RUNTIME_ERROR("operands must be numbers"); \
+    } \
+    PEEK(0) = value_type(AS_NUMBER(PEEK(0)) op AS_NUMBER(b)); \
+  } while (false)
+// Replaces the instance on top of the stack with its property name.
+#define GET_PROPERTY(instance, name, cache) \
+  do { \
+    cache_entry_t* entry = cache_lookup(cache, instance->klass, instance->shape); \
+    if (entry != NULL && entry->slot >= 0) { \
+      PEEK(0) = instance->fields[entry->slot]; \
+      break; \
+    } \
+    SAVE_STATE(); \
+    if (!get_property(instance, name, cache, entry)) { \
       return EXECUTE_RUNTIME_ERROR; \
     } \
-    double b = AS_NUMBER(stack_pop()); \
-    double a = AS_NUMBER(stack_pop()); \
-    stack_push(value_type(a op b)); \
+    LOAD_STACK(); \
+  } while (false)
+// Slow path of the fused additions, with both operands already pushed.
+#define ADD_STRINGS() \
+  do { \
+    if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) { \
+      RUNTIME_ERROR("operands of + must be two numbers or two strings"); \
+    } \
+    SAVE_STATE(); \
+    concatenate_strings(); \
+    LOAD_STACK(); \
+  } while (false)
+
+// Three-address addition into a frame slot. The string slow path goes
+// through the stack so that concatenate_strings() sees GC-reachable operands.
+#define REGISTER_ADD(dst, a, b) \
+  do { \
+    if (ARE_INTS(a, b)) { \
+      slots[dst] = int64_to_value((int64_t)AS_INT(a) + AS_INT(b)); \
+    } else if (IS_DOUBLE(a) && IS_DOUBLE(b)) { \
+      slots[dst] = NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b)); \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+      slots[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+    } else { \
+      PUSH(a); \
+      PUSH(b); \
+      ADD_STRINGS(); \
+      slots[dst] = POP(); \
+    } \
+  } while (false)
+// Operands are type-checked before the jump offset is read so that errors
+// are reported at the comparison's line.
+#define COMPARE_AND_JUMP(a, b, op) \
+  do { \
+    bool result; \
+    if (ARE_INTS(a, b)) { \
+      result = AS_INT(a) op AS_INT(b); \
+    } else if (IS_DOUBLE(a) && IS_DOUBLE(b)) { \
+      result = AS_DOUBLE(a) op AS_DOUBLE(b); \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+      result = AS_NUMBER(a) op AS_NUMBER(b); \
+    } else { \
+      RUNTIME_ERROR("operands must be numbers"); \
+    } \
+    uint16_t offset = READ_SHORT(); \
+    if (!result) { \
+      ip += offset; \
+    } \
+  } while (false)
+// Bitwise operators, on numbers that are integers fitting in 32 bits.
+#define BITWISE_OP(op) \
+  do { \
+    value_t result; \
+    if (!bitwise_op(op, PEEK(1), PEEK(0), &result)) { \
+      RUNTIME_ERROR("operands must be integers"); \
+    } \
+    stack_top--; \
+    PEEK(0) = result; \
   } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    stack_debug_print();
-    disasm_instruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+  do { \
+    SAVE_STATE(); \
+    stack_debug_print(); \
+    disasm_instruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code)); \
+  } while (false)
 #else
-    (void)stack_debug_print; // unused
+#define TRACE_INSTRUCTION() (void)stack_debug_print // unused
 #endif // DEBUG_TRACE_EXECUTION
 
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm.instruction_count++)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif // DEBUG_COUNT_INSTRUCTIONS
+
+#ifdef COMPUTED_GOTO
+  // Direct threading: every handler ends with its own indirect jump to the
+  // next handler instead of going back through the single switch dispatch.
+  // The switch below is only used to enter the first instruction.
+  static void* dispatch_table[] = {
+    [OP_CONSTANT] = &&OP_CONSTANT_label,
+    [OP_NIL] = &&OP_NIL_label,
+    [OP_TRUE] = &&OP_TRUE_label,
+    [OP_FALSE] = &&OP_FALSE_label,
+    [OP_EQUAL] = &&OP_EQUAL_label,
+    [OP_GREATER] = &&OP_GREATER_label,
+    [OP_LESS] = &&OP_LESS_label,
+    [OP_NEGATE] = &&OP_NEGATE_label,
+    [OP_ADD] = &&OP_ADD_label,
+    [OP_SUBTRACT] = &&OP_SUBTRACT_label,
+    [OP_MULTIPLY] = &&OP_MULTIPLY_label,
+    [OP_DIVIDE] = &&OP_DIVIDE_label,
+    [OP_MODULO] = &&OP_MODULO_label,
+    [OP_BIT_AND] = &&OP_BIT_AND_label,
+    [OP_BIT_OR] = &&OP_BIT_OR_label,
+    [OP_BIT_XOR] = &&OP_BIT_XOR_label,
+    [OP_SHIFT_LEFT] = &&OP_SHIFT_LEFT_label,
+    [OP_SHIFT_RIGHT] = &&OP_SHIFT_RIGHT_label,
+    [OP_BIT_NOT] = &&OP_BIT_NOT_label,
+    [OP_NOT] = &&OP_NOT_label,
+    [OP_PRINT] = &&OP_PRINT_label,
+    [OP_POP] = &&OP_POP_label,
+    [OP_DEFINE_GLOBAL] = &&OP_DEFINE_GLOBAL_label,
+    [OP_GET_GLOBAL] = &&OP_GET_GLOBAL_label,
+    [OP_SET_GLOBAL] = &&OP_SET_GLOBAL_label,
+    [OP_GET_LOCAL] = &&OP_GET_LOCAL_label,
+    [OP_SET_LOCAL] = &&OP_SET_LOCAL_label,
+    [OP_GET_UPVALUE] = &&OP_GET_UPVALUE_label,
+    [OP_SET_UPVALUE] = &&OP_SET_UPVALUE_label,
+    [OP_GET_SUPER] = &&OP_GET_SUPER_label,
+    [OP_RETURN] = &&OP_RETURN_label,
+    [OP_JUMP] = &&OP_JUMP_label,
+    [OP_JUMP_IF_FALSE] = &&OP_JUMP_IF_FALSE_label,
+    [OP_LOOP] = &&OP_LOOP_label,
+    [OP_CALL] = &&OP_CALL_label,
+    [OP_TAIL_CALL] = &&OP_TAIL_CALL_label,
+    [OP_CLOSURE] = &&OP_CLOSURE_label,
+    [OP_CLOSE_UPVALUE] = &&OP_CLOSE_UPVALUE_label,
+    [OP_CLASS] = &&OP_CLASS_label,
+    [OP_SET_PROPERTY] = &&OP_SET_PROPERTY_label,
+    [OP_GET_PROPERTY] = &&OP_GET_PROPERTY_label,
+    [OP_METHOD] = &&OP_METHOD_label,
+    [OP_INVOKE] = &&OP_INVOKE_label,
+    [OP_SUPER_INVOKE] = &&OP_SUPER_INVOKE_label,
+    [OP_TAIL_INVOKE] = &&OP_TAIL_INVOKE_label,
+    [OP_TAIL_SUPER_INVOKE] = &&OP_TAIL_SUPER_INVOKE_label,
+    [OP_INHERIT] = &&OP_INHERIT_label,
+    [OP_GET_LOCAL_PROPERTY] = &&OP_GET_LOCAL_PROPERTY_label,
+    [OP_ADD_LOCALS] = &&OP_ADD_LOCALS_label,
+    [OP_ADD_CONSTANT] = &&OP_ADD_CONSTANT_label,
+    [OP_SUBTRACT_CONSTANT] = &&OP_SUBTRACT_CONSTANT_label,
+    [OP_LESS_CONSTANT] = &&OP_LESS_CONSTANT_label,
+    [OP_POP_JUMP_IF_FALSE] = &&OP_POP_JUMP_IF_FALSE_label,
+    [OP_MOVE] = &&OP_MOVE_label,
+    [OP_LOAD_CONSTANT] = &&OP_LOAD_CONSTANT_label,
+    [OP_ADD_RR] = &&OP_ADD_RR_label,
+    [OP_ADD_RK] = &&OP_ADD_RK_label,
+    [OP_SUBTRACT_RK] = &&OP_SUBTRACT_RK_label,
+    [OP_JUMP_IF_NOT_LESS_RR] = &&OP_JUMP_IF_NOT_LESS_RR_label,
+    [OP_JUMP_IF_NOT_LESS_RK] = &&OP_JUMP_IF_NOT_LESS_RK_label,
+    [OP_ADD_NUM] = &&OP_ADD_NUM_label,
+    [OP_ADD_STR] = &&OP_ADD_STR_label,
+    [OP_EQUAL_NUM] = &&OP_EQUAL_NUM_label,
+  };
+  _Static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == OP_EQUAL_NUM + 1,
+                 "dispatch_table must have an entry for every opcode");
+
+#ifdef TRACE_LOOPS
+  // While a trace is being recorded, every instruction is dispatched through
+  // record_table, which notes it before running its handler.
+  static void* record_table[] = {
+    [0 ... OP_EQUAL_NUM] = &&record_instruction,
+  };
+  void** dispatch = dispatch_table;
+#define DISPATCH_TABLE dispatch
+#else
+#define DISPATCH_TABLE dispatch_table
+#endif
+
+#define CASE(opcode) case opcode: opcode##_label
+#define DISPATCH() \
+  do { \
+    TRACE_INSTRUCTION(); \
+    COUNT_INSTRUCTION(); \
+    goto *DISPATCH_TABLE[READ_BYTE()]; \
+  } while (false)
+#else
+#define CASE(opcode) case opcode
+#define DISPATCH() continue
+#endif // COMPUTED_GOTO
+
+  LOAD_FRAME();
+
+  for (;;) {
+    TRACE_INSTRUCTION();
+    COUNT_INSTRUCTION();
+
     uint8_t instruction = READ_BYTE();
     switch (instruction) {
-      case OP_CONSTANT: {
+      CASE(OP_CONSTANT): {
         value_t constant = READ_CONSTANT();
-        stack_push(constant);
-        break;
+        PUSH(constant);
+        DISPATCH();
       }
-      case OP_NIL: stack_push(NIL_VAL); break;
-      case OP_TRUE: stack_push(BOOL_VAL(true)); break;
-      case OP_FALSE: stack_push(BOOL_VAL(false)); break;
-      case OP_EQUAL: {
-        value_t b = stack_pop();
-        value_t a = stack_pop(); 
-        stack_push(BOOL_VAL(values_equal(a, b)));
-        break;
+      CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+      CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+      CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+      CASE(OP_EQUAL):
+      generic_equal: {
+        value_t b = POP();
+        value_t a = PEEK(0);
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          QUICKEN(OP_EQUAL_NUM);
+        }
+        PEEK(0) = BOOL_VAL(values_equal(a, b));
+        DISPATCH();
       }
-      case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS:    BINARY_OP(BOOL_VAL, <); break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(stack_peek(0))) {
-          runtime_error("operand must be a number");
-          return EXECUTE_RUNTIME_ERROR;
+      CASE(OP_GREATER): INT_BINARY_OP(BOOL_VAL, BOOL_VAL, >); DISPATCH();
+      CASE(OP_LESS):    INT_BINARY_OP(BOOL_VAL, BOOL_VAL, <); DISPATCH();
+      CASE(OP_NEGATE):
+        if (IS_INT(PEEK(0)) && AS_INT(PEEK(0)) != 0) {
+          // -0 is a double.
+          PEEK(0) = int64_to_value(-(int64_t)AS_INT(PEEK(0)));
+          DISPATCH();
         }
-        stack_push(NUMBER_VAL(-AS_NUMBER(stack_pop())));
-        break;
-      case OP_ADD:
-        if (IS_STRING(stack_peek(0)) && IS_STRING(stack_peek(1))) {
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("operand must be a number");
+        }
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        DISPATCH();
+      CASE(OP_ADD):
+      generic_add:
+        if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+          QUICKEN(OP_ADD_STR);
+          SAVE_STATE();
           concatenate_strings();
-        } else if (IS_NUMBER(stack_peek(0)) && IS_NUMBER(stack_peek(1))) {
-          BINARY_OP(NUMBER_VAL, +);
+          LOAD_STACK();
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+          QUICKEN(OP_ADD_NUM);
+          INT_BINARY_OP(int64_to_value, NUMBER_VAL, +);
         } else {
-          runtime_error("operands of + must be two numbers or two strings");
-          return EXECUTE_RUNTIME_ERROR;
+          RUNTIME_ERROR("operands of + must be two numbers or two strings");
         }
-        break;
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-      case OP_MODULO: {
-        if (!IS_NUMBER(stack_peek(0)) || !IS_NUMBER(stack_peek(1))) {
-          runtime_error("operands must be numbers");
-          return EXECUTE_RUNTIME_ERROR;
+        DISPATCH();
+      CASE(OP_SUBTRACT): INT_BINARY_OP(int64_to_value, NUMBER_VAL, -); DISPATCH();
+      CASE(OP_MULTIPLY):
+        if (ARE_INTS(PEEK(0), PEEK(1))) {
+          int32_t b = AS_INT(POP());
+          PEEK(0) = multiply_ints(AS_INT(PEEK(0)), b);
+          DISPATCH();
         }
-        int b = (int)AS_NUMBER(stack_pop());
-        int a = (int)AS_NUMBER(stack_pop());
-        double result = a % b;
-        stack_push(NUMBER_VAL((double)result));
-        break;
+        BINARY_OP(NUMBER_VAL, *);
+        DISPATCH();
+      CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+      CASE(OP_MODULO): {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          RUNTIME_ERROR("operands must be numbers");
+        }
+        int b = IS_INT(PEEK(0)) ? AS_INT(PEEK(0)) : (int)AS_NUMBER(PEEK(0));
+        int a = IS_INT(PEEK(1)) ? AS_INT(PEEK(1)) : (int)AS_NUMBER(PEEK(1));
+        stack_top--;
+        PEEK(0) = INT_VAL(a % b);
+        DISPATCH();
       }
-      case OP_NOT:
-        stack_push(BOOL_VAL(is_falsey(stack_pop())));
-        break;
-      case OP_PRINT:
-        value_print(stack_pop());
+      CASE(OP_BIT_AND):     BITWISE_OP(OP_BIT_AND); DISPATCH();
+      CASE(OP_BIT_OR):      BITWISE_OP(OP_BIT_OR); DISPATCH();
+      CASE(OP_BIT_XOR):     BITWISE_OP(OP_BIT_XOR); DISPATCH();
+      CASE(OP_SHIFT_LEFT):  BITWISE_OP(OP_SHIFT_LEFT); DISPATCH();
+      CASE(OP_SHIFT_RIGHT): BITWISE_OP(OP_SHIFT_RIGHT); DISPATCH();
+      CASE(OP_BIT_NOT): {
+        value_t result;
+        if (!bitwise_op(OP_BIT_NOT, PEEK(0), PEEK(0), &result)) {
+          RUNTIME_ERROR("operand must be an integer");
+        }
+        PEEK(0) = result;
+        DISPATCH();
+      }
+      CASE(OP_NOT):
+        PEEK(0) = BOOL_VAL(is_falsey(PEEK(0)));
+        DISPATCH();
+      CASE(OP_PRINT):
+        value_print(POP());
         printf("\n");
-        break;
-      case OP_POP:
-        stack_pop();
-        break;
-      case OP_DEFINE_GLOBAL: {
-        obj_string_t* name = READ_STRING();
-        table_set(&vm.globals, name, stack_peek(0));
-        stack_pop();
-        break;
+        DISPATCH();
+      CASE(OP_POP):
+        stack_top--;
+        DISPATCH();
+      CASE(OP_DEFINE_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        vm.globals.values[slot] = POP();
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
-        obj_string_t* name = READ_STRING();
-        value_t value;
-        if (!table_get(&vm.globals, name, &value)) {
-          runtime_error("undefined variable %s", name->chars);
-          return EXECUTE_RUNTIME_ERROR;
+      CASE(OP_GET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        value_t value = vm.globals.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("undefined variable %s", GLOBAL_NAME(slot)->chars);
         }
-        stack_push(value);
-        break;
+        PUSH(value);
+        DISPATCH();
       }
-      case OP_SET_GLOBAL: {
-        obj_string_t* name = READ_STRING();
-        if (table_set(&vm.globals, name, stack_peek(0))) {
-          table_delete(&vm.globals, name);
-          runtime_error("undefined variable %s", name->chars);
-          return EXECUTE_RUNTIME_ERROR;
+      CASE(OP_SET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(vm.globals.values[slot])) {
+          RUNTIME_ERROR("undefined variable %s", GLOBAL_NAME(slot)->chars);
         }
-        break;
+        vm.globals.values[slot] = PEEK(0);
+        DISPATCH();
       }
-      case OP_GET_LOCAL: {
+      CASE(OP_GET_LOCAL): {
         uint8_t slot = READ_BYTE();
-        stack_push(frame->slots[slot]);
-        break;
+        PUSH(slots[slot]);
+        DISPATCH();
       }
-      case OP_SET_LOCAL: {
+      CASE(OP_SET_LOCAL): {
         uint8_t slot = READ_BYTE();
-        frame->slots[slot] = stack_peek(0);
-        break;
+        slots[slot] = PEEK(0);
+        DISPATCH();
       }
-      case OP_GET_UPVALUE: {
+      CASE(OP_GET_UPVALUE): {
         uint8_t slot = READ_BYTE();
-        stack_push(*frame->closure->upvalues[slot]->location);
-        break;
+        PUSH(*frame->closure->upvalues[slot]->location);
+        DISPATCH();
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = stack_peek(0);
-        break;
+      CASE(OP_SET_UPVALUE): {
+        obj_upvalue_t* upvalue = frame->closure->upvalues[READ_BYTE()];
+        write_barrier_prepare(&upvalue->obj);
+        *upvalue->location = PEEK(0);
+        write_barrier(&upvalue->obj, PEEK(0));
+        DISPATCH();
       }
-      case OP_GET_SUPER: {
+      CASE(OP_GET_SUPER): {
         obj_string_t* name = READ_STRING();
-        obj_class_t* superclass = AS_CLASS(stack_pop());
+        obj_class_t* superclass = AS_CLASS(POP());
+        SAVE_STATE();
         if (!bind_method(superclass, name)) {
           return EXECUTE_RUNTIME_ERROR;
         }
-        break;
+        LOAD_STACK();
+        DISPATCH();
       }
-      case OP_RETURN: {
-        value_t result = stack_pop();
-        close_upvalues(frame->slots);
+      CASE(OP_RETURN): {
+        value_t result = POP();
+        close_upvalues(slots);
         vm.frame_count--;
         if (vm.frame_count == 0) {
-          stack_pop();
+          vm.stack_top = stack_top - 1;
           return EXECUTE_OK;
         }
 
-        vm.stack_top = frame->slots;
-        stack_push(result);
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+        stack_top = slots;
+        PUSH(result);
+        if (vm.frame_count == base_frame) {
+          vm.stack_top = stack_top;
+          return EXECUTE_OK;
+        }
+        LOAD_FRAME();
+        DISPATCH();
       }
-      case OP_JUMP: {
+      CASE(OP_JUMP): {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+        ip += offset;
+        DISPATCH();
       }
-      case OP_JUMP_IF_FALSE: {
+      CASE(OP_JUMP_IF_FALSE): {
         uint16_t offset = READ_SHORT();
-        if (is_falsey(stack_peek(0))) {
-          frame->ip += offset;
+        if (is_falsey(PEEK(0))) {
+          ip += offset;
         }
-        break;
+        DISPATCH();
       }
-      case OP_LOOP: {
+      CASE(OP_LOOP): {
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+#ifdef TRACE_LOOPS
+        loop_t* loop = &frame->closure->function->chunk.loops[READ_SHORT()];
+        ip -= offset;
+        if (loop->trace != NULL) {
+          SAVE_STATE();
+          if (trace_run(loop, frame) != EXECUTE_OK) {
+            return EXECUTE_RUNTIME_ERROR;
+          }
+          LOAD_STACK();
+          ip = frame->ip;
+        } else if (jit_options.enabled && ++loop->hotness == TRACE_HOT_LOOP) {
+          if (trace_start(loop, ip)) {
+            dispatch = record_table;
+          } else {
+            loop->hotness = 0;
+          }
+        }
+#else
+        ip += 2; // loop index, only used for tracing
+        ip -= offset;
+#endif
+        // Only the outermost loop knows that no caller in C holds on to
+        // objects.
+        if (vm.compact_pending && base_frame == 0) {
+          SAVE_STATE();
+          compact_heap();
+        }
+        DISPATCH();
       }
-      case OP_CALL: {
+      CASE(OP_CALL): {
         int arg_count = READ_BYTE();
-        if (!call_value(stack_peek(arg_count), arg_count)) {
+        value_t callee = PEEK(arg_count);
+        if (IS_CLOSURE(callee) && call_inline(AS_CLOSURE(callee)->function, arg_count, stack_top - arg_count - 1)) {
+          stack_top -= arg_count;
+          DISPATCH();
+        }
+        SAVE_STATE();
+        if (!call_value(PEEK(arg_count), arg_count)) {
           return EXECUTE_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+        LOAD_STACK();
+        ENTER_FRAME();
+        DISPATCH();
+      }
+      CASE(OP_TAIL_CALL): {
+        int arg_count = READ_BYTE();
+        value_t callee = PEEK(arg_count);
+        if (IS_CLOSURE(callee) && call_inline(AS_CLOSURE(callee)->function, arg_count, stack_top - arg_count - 1)) {
+          stack_top -= arg_count;
+          DISPATCH();
+        }
+        SAVE_STATE();
+        if (!tail_call_value(PEEK(arg_count), arg_count)) {
+          return EXECUTE_RUNTIME_ERROR;
+        }
+        LOAD_STACK();
+        ENTER_FRAME();
+        // A compiled callee has run to completion in the reused frame, and
+        // returned to whoever called it.
+        if (vm.frame_count == base_frame) {
+          vm.stack_top = stack_top;
+          return EXECUTE_OK;
+        }
+        DISPATCH();
       }
-      case OP_CLOSURE: {
+      CASE(OP_CLOSURE): {
         obj_function_t* function = AS_FUNCTION(READ_CONSTANT());
+        SAVE_STATE();
         obj_closure_t* closure = closure_new(function);
-        stack_push(OBJ_VAL(closure));
+        PUSH(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalue_count; i++) {
           uint8_t is_local = READ_BYTE();
           uint8_t index = READ_BYTE();
+          obj_upvalue_t* upvalue;
           if (is_local) {
-            closure->upvalues[i] = capture_upvalue(frame->slots + index);
+            vm.stack_top = stack_top;
+            upvalue = capture_upvalue(slots + index);
           } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
+            upvalue = frame->closure->upvalues[index];
           }
+          // Capturing can collect garbage, promoting the closure, or start
+          // marking.
+          write_barrier_prepare(&closure->obj);
+          closure->upvalues[i] = upvalue;
+          write_barrier_object(&closure->obj, &upvalue->obj);
         }
-        break;
+        DISPATCH();
       }
-      case OP_CLOSE_UPVALUE:
-        close_upvalues(vm.stack_top - 1);
-        stack_pop();
-        break;
-      case OP_CLASS:
-        stack_push(OBJ_VAL(class_new(READ_STRING())));
-        break;
-      case OP_METHOD:
-        define_method(READ_STRING());
-        break;
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(stack_peek(0))) {
-          runtime_error("only instances have properties");
-          return EXECUTE_RUNTIME_ERROR;
+      CASE(OP_CLOSE_UPVALUE):
+        close_upvalues(stack_top - 1);
+        stack_top--;
+        DISPATCH();
+      CASE(OP_CLASS): {
+        obj_string_t* name = READ_STRING();
+        SAVE_STATE();
+        PUSH(OBJ_VAL(class_new(name)));
+        DISPATCH();
+      }
+      CASE(OP_METHOD): {
+        obj_string_t* name = READ_STRING();
+        SAVE_STATE();
+        define_method(name);
+        LOAD_STACK();
+        DISPATCH();
+      }
+      CASE(OP_GET_PROPERTY): {
+        if (!IS_INSTANCE(PEEK(0))) {
+          RUNTIME_ERROR("only instances have properties");
         }
 
-        obj_instance_t* instance = AS_INSTANCE(stack_peek(0));
+        obj_instance_t* instance = AS_INSTANCE(PEEK(0));
         obj_string_t* name = READ_STRING();
-
-        value_t value;
-        if (table_get(&instance->fields, name, &value)) {
-          stack_pop();
-          stack_push(value);
-          break;
+        inline_cache_t* cache = READ_CACHE();
+        GET_PROPERTY(instance, name, cache);
+        DISPATCH();
+      }
+      CASE(OP_SET_PROPERTY): {
+        if (!IS_INSTANCE(PEEK(1))) {
+          RUNTIME_ERROR("only instances have properties");
         }
 
-        if (!bind_method(instance->klass, name)) {
+        obj_instance_t* instance = AS_INSTANCE(PEEK(1));
+        obj_string_t* name = READ_STRING();
+        inline_cache_t* cache = READ_CACHE();
+        cache_entry_t* entry = cache_lookup(cache, instance->klass, instance->shape);
+        if (entry != NULL && entry->slot < instance->field_capacity) {
+          write_barrier_prepare(&instance->obj);
+          instance->fields[entry->slot] = PEEK(0);
+          instance->shape = entry->new_shape;
+          write_barrier(&instance->obj, PEEK(0));
+          write_barrier_object(&instance->obj, &instance->shape->obj);
+        } else {
+          SAVE_STATE();
+          set_property(instance, name, PEEK(0), cache);
+        }
+        value_t value = POP();
+        PEEK(0) = value;
+        DISPATCH();
+      }
+      CASE(OP_INVOKE): {
+        obj_string_t* method = READ_STRING();
+        int arg_count = READ_BYTE();
+        inline_cache_t* cache = READ_CACHE();
+        value_t receiver = PEEK(arg_count);
+        if (IS_INSTANCE(receiver)) {
+          obj_instance_t* instance = AS_INSTANCE(receiver);
+          cache_entry_t* entry = cache_lookup(cache, instance->klass, instance->shape);
+          if (entry != NULL && entry->slot < 0) {
+            if (call_inline(entry->method->function, arg_count, stack_top - arg_count - 1)) {
+              stack_top -= arg_count;
+              DISPATCH();
+            }
+            SAVE_STATE();
+            if (!call(entry->method, arg_count)) {
+              return EXECUTE_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+          }
+        }
+        SAVE_STATE();
+        if (!invoke(method, arg_count, cache, false)) {
           return EXECUTE_RUNTIME_ERROR;
         }
-
-        break;
+        LOAD_STACK();
+        ENTER_FRAME();
+        DISPATCH();
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(stack_peek(1))) {
-          runtime_error("only instances have properties");
+      CASE(OP_SUPER_INVOKE): {
+        obj_string_t* method = READ_STRING();
+        int arg_count = READ_BYTE();
+        inline_cache_t* cache = READ_CACHE();
+        obj_class_t* superclass = AS_CLASS(POP());
+        SAVE_STATE();
+        if (!super_invoke(superclass, method, arg_count, cache, false)) {
           return EXECUTE_RUNTIME_ERROR;
         }
-
-        obj_instance_t* instance = AS_INSTANCE(stack_peek(1));
-        table_set(&instance->fields, READ_STRING(), stack_peek(0));
-        value_t value = stack_pop();
-        stack_pop();
-        stack_push(value);
-        break;
+        LOAD_STACK();
+        ENTER_FRAME();
+        DISPATCH();
       }
-      case OP_INVOKE: {
+      CASE(OP_TAIL_INVOKE): {
         obj_string_t* method = READ_STRING();
         int arg_count = READ_BYTE();
-        if (!invoke(method, arg_count)) {
+        inline_cache_t* cache = READ_CACHE();
+        value_t receiver = PEEK(arg_count);
+        obj_closure_t* cached = NULL;
+        if (IS_INSTANCE(receiver)) {
+          obj_instance_t* instance = AS_INSTANCE(receiver);
+          cache_entry_t* entry = cache_lookup(cache, instance->klass, instance->shape);
+          if (entry != NULL && entry->slot < 0) {
+            if (call_inline(entry->method->function, arg_count, stack_top - arg_count - 1)) {
+              stack_top -= arg_count;
+              DISPATCH();
+            }
+            cached = entry->method;
+          }
+        }
+        SAVE_STATE();
+        if (cached != NULL ? !tail_call(cached, arg_count) : !invoke(method, arg_count, cache, true)) {
           return EXECUTE_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+        LOAD_STACK();
+        ENTER_FRAME();
+        // As with OP_TAIL_CALL, a compiled callee may have returned already.
+        if (vm.frame_count == base_frame) {
+          vm.stack_top = stack_top;
+          return EXECUTE_OK;
+        }
+        DISPATCH();
       }
-      case OP_SUPER_INVOKE: {
+      CASE(OP_TAIL_SUPER_INVOKE): {
         obj_string_t* method = READ_STRING();
         int arg_count = READ_BYTE();
-        obj_class_t* superclass = AS_CLASS(stack_pop());
-        if (!invoke_from_class(superclass, method, arg_count)) {
+        inline_cache_t* cache = READ_CACHE();
+        obj_class_t* superclass = AS_CLASS(POP());
+        SAVE_STATE();
+        if (!super_invoke(superclass, method, arg_count, cache, true)) {
           return EXECUTE_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+        LOAD_STACK();
+        ENTER_FRAME();
+        if (vm.frame_count == base_frame) {
+          vm.stack_top = stack_top;
+          return EXECUTE_OK;
+        }
+        DISPATCH();
       }
-      case OP_INHERIT: {
-        value_t superclass = stack_peek(1);
+      CASE(OP_INHERIT): {
+        value_t superclass = PEEK(1);
         if (!IS_CLASS(superclass)) {
-          runtime_error("superclass must be a class");
-          return EXECUTE_RUNTIME_ERROR;
+          RUNTIME_ERROR("superclass must be a class");
         }
-        obj_class_t* subclass = AS_CLASS(stack_peek(0));
+        obj_class_t* subclass = AS_CLASS(PEEK(0));
+        SAVE_STATE();
+        write_barrier_prepare(&subclass->obj);
         table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-        stack_pop();
-        break;
+        subclass->initializer = AS_CLASS(superclass)->initializer;
+        remember_object(&subclass->obj);
+        subclass->method_version++;
+        stack_top--;
+        DISPATCH();
+      }
+      CASE(OP_GET_LOCAL_PROPERTY): {
+        value_t receiver = slots[READ_BYTE()];
+        if (!IS_INSTANCE(receiver)) {
+          RUNTIME_ERROR("only instances have properties");
+        }
+
+        obj_instance_t* instance = AS_INSTANCE(receiver);
+        obj_string_t* name = READ_STRING();
+        inline_cache_t* cache = READ_CACHE();
+        PUSH(receiver);
+        GET_PROPERTY(instance, name, cache);
+        DISPATCH();
+      }
+      CASE(OP_ADD_LOCALS): {
+        value_t a = slots[READ_BYTE()];
+        value_t b = slots[READ_BYTE()];
+        if (ARE_INTS(a, b)) {
+          PUSH(int64_to_value((int64_t)AS_INT(a) + AS_INT(b)));
+          DISPATCH();
+        }
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+          DISPATCH();
+        }
+        PUSH(a);
+        PUSH(b);
+        ADD_STRINGS();
+        DISPATCH();
+      }
+      CASE(OP_ADD_CONSTANT): {
+        value_t b = READ_CONSTANT();
+        if (ARE_INTS(PEEK(0), b)) {
+          PEEK(0) = int64_to_value((int64_t)AS_INT(PEEK(0)) + AS_INT(b));
+          DISPATCH();
+        }
+        if (IS_NUMBER(PEEK(0)) && IS_NUMBER(b)) {
+          PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(b));
+          DISPATCH();
+        }
+        PUSH(b);
+        ADD_STRINGS();
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT_CONSTANT): BINARY_OP_CONSTANT(int64_to_value, NUMBER_VAL, -); DISPATCH();
+      CASE(OP_LESS_CONSTANT):     BINARY_OP_CONSTANT(BOOL_VAL, BOOL_VAL, <); DISPATCH();
+      CASE(OP_POP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(POP())) {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+      CASE(OP_MOVE): {
+        uint8_t dst = READ_BYTE();
+        slots[dst] = slots[READ_BYTE()];
+        DISPATCH();
+      }
+      CASE(OP_LOAD_CONSTANT): {
+        uint8_t dst = READ_BYTE();
+        slots[dst] = READ_CONSTANT();
+        DISPATCH();
+      }
+      CASE(OP_ADD_RR): {
+        uint8_t dst = READ_BYTE();
+        value_t a = slots[READ_BYTE()];
+        value_t b = slots[READ_BYTE()];
+        REGISTER_ADD(dst, a, b);
+        DISPATCH();
+      }
+      CASE(OP_ADD_RK): {
+        uint8_t dst = READ_BYTE();
+        value_t a = slots[READ_BYTE()];
+        value_t b = READ_CONSTANT();
+        REGISTER_ADD(dst, a, b);
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT_RK): {
+        uint8_t dst = READ_BYTE();
+        value_t a = slots[READ_BYTE()];
+        value_t b = READ_CONSTANT();
+        if (ARE_INTS(a, b)) {
+          slots[dst] = int64_to_value((int64_t)AS_INT(a) - AS_INT(b));
+          DISPATCH();
+        }
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          RUNTIME_ERROR("operands must be numbers");
+        }
+        slots[dst] = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_NOT_LESS_RR): {
+        value_t a = slots[READ_BYTE()];
+        value_t b = slots[READ_BYTE()];
+        COMPARE_AND_JUMP(a, b, <);
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_NOT_LESS_RK): {
+        value_t a = slots[READ_BYTE()];
+        value_t b = READ_CONSTANT();
+        COMPARE_AND_JUMP(a, b, <);
+        DISPATCH();
+      }
+      // The quickened instructions check the types they were specialized
+      // for and otherwise go back to the generic instruction.
+      CASE(OP_ADD_NUM): {
+        if (ARE_INTS(PEEK(0), PEEK(1))) {
+          int64_t b = AS_INT(POP());
+          PEEK(0) = int64_to_value(AS_INT(PEEK(0)) + b);
+          DISPATCH();
+        }
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          goto generic_add;
+        }
+        double b = AS_NUMBER(POP());
+        PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+        DISPATCH();
+      }
+      CASE(OP_ADD_STR):
+        if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+          goto generic_add;
+        }
+        SAVE_STATE();
+        concatenate_strings();
+        LOAD_STACK();
+        DISPATCH();
+      CASE(OP_EQUAL_NUM): {
+        if (ARE_INTS(PEEK(0), PEEK(1))) {
+          int32_t b = AS_INT(POP());
+          PEEK(0) = BOOL_VAL(AS_INT(PEEK(0)) == b);
+          DISPATCH();
+        }
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          QUICKEN(OP_EQUAL);
+          goto generic_equal;
+        }
+        double b = AS_NUMBER(POP());
+        PEEK(0) = BOOL_VAL(AS_NUMBER(PEEK(0)) == b);
+        DISPATCH();
       }
     }
   }
 
   return EXECUTE_RUNTIME_ERROR;
 
+#ifdef TRACE_LOOPS
+record_instruction:
+  SAVE_STATE();
+  if (!trace_record(ip - 1)) {
+    dispatch = dispatch_table;
+  }
+  goto *dispatch_table[ip[-1]];
+#endif
+
+#undef DISPATCH
+#undef DISPATCH_TABLE
+#undef CASE
+#undef COUNT_INSTRUCTION
+#undef TRACE_INSTRUCTION
+#undef COMPARE_AND_JUMP
+#undef REGISTER_ADD
+#undef ADD_STRINGS
+#undef GET_PROPERTY
+#undef BINARY_OP_CONSTANT
 #undef BINARY_OP
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef READ_CACHE
+#undef GLOBAL_NAME
 #undef READ_STRING
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_BYTE
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef ENTER_FRAME
+#undef LOAD_STACK
+#undef SAVE_STATE
+#undef LOAD_FRAME
 }
 
+#if defined(COMPUTED_GOTO) && defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
 static void stack_reset() {
   vm.stack_top = vm.stack;
   vm.frame_count = 0;
   vm.open_upvalues = 0;
+#ifdef JIT
+  trace_reset();
+#endif
 }
 
 void stack_push(value_t value) {
@@ -420,17 +1116,58 @@ static bool is_falsey(value_t value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// The product of two ints, computed exactly. A zero product of a negative
+// number is -0, which only a double can hold.
+static inline value_t multiply_ints(int32_t a, int32_t b) {
+  int64_t product = (int64_t)a * b;
+  if (product == 0 && (a < 0 || b < 0)) {
+    return NUMBER_VAL(-0.0);
+  }
+  return int64_to_value(product);
+}
+
+// Applies a bitwise operator to a and b (just a for OP_BIT_NOT). Returns
+// false if they are not numbers that are integers fitting in 32 bits. Shift
+// counts are taken modulo 32.
+static bool bitwise_op(uint8_t op, value_t a, value_t b, value_t* result) {
+  int32_t x, y;
+  if (ARE_INTS(a, b)) {
+    x = AS_INT(a);
+    y = AS_INT(b);
+  } else if (IS_NUMBER(a) && IS_NUMBER(b) && num_is_int32(AS_NUMBER(a)) && num_is_int32(AS_NUMBER(b))) {
+    x = (int32_t)AS_NUMBER(a);
+    y = (int32_t)AS_NUMBER(b);
+  } else {
+    return false;
+  }
+
+  switch (op) {
+    case OP_BIT_AND:
+      *result = INT_VAL(x & y);
+      break;
+    case OP_BIT_OR:
+      *result = INT_VAL(x | y);
+      break;
+    case OP_BIT_XOR:
+      *result = INT_VAL(x ^ y);
+      break;
+    case OP_SHIFT_LEFT:
+      *result = INT_VAL((int32_t)((uint32_t)x << (y & 31)));
+      break;
+    case OP_SHIFT_RIGHT:
+      *result = INT_VAL(x >> (y & 31));
+      break;
+    default: // OP_BIT_NOT
+      *result = INT_VAL(~x);
+      break;
+  }
+  return true;
+}
+
 static void concatenate_strings() {
   obj_string_t* second = AS_STRING(stack_peek(0));
   obj_string_t* first = AS_STRING(stack_peek(1));
-
-  int length = first->length + second->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, first->chars, first->length);
-  memcpy(chars + first->length, second->chars, second->length);
-  chars[length] = '\0';
-
-  obj_string_t* result = string_take(chars, length);
+  obj_string_t* result = string_concatenate(first, second);
   stack_pop();
   stack_pop();
   stack_push(OBJ_VAL(result));
@@ -455,9 +1192,8 @@ static bool call_value(value_t callee, int arg_count) {
       case OBJ_CLASS: {
         obj_class_t* klass = AS_CLASS(callee);
         vm.stack_top[-arg_count - 1] = OBJ_VAL(instance_new(klass));
-        value_t initializer;
-        if (table_get(&klass->methods, vm.init_string, &initializer)) {
-          return call(AS_CLOSURE(initializer), arg_count);
+        if (klass->initializer != NULL) {
+          return call(klass->initializer, arg_count);
         } else if (arg_count != 0) {
           runtime_error("expected 0 arguments in class instantiation, got %d", arg_count);
           return false;
@@ -515,14 +1251,169 @@ static bool call(obj_closure_t* closure, int arg_count) {
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stack_top - arg_count - 1;
+  count_call(closure->function);
+  return true;
+}
+
+// Evaluates the body of function in place of calling it, if the compiler
+// found it simple enough (see recognize_inline()), with the callee or
+// receiver and the arguments at slots. The result replaces slots[0]. Returns
+// false, changing nothing, when the body is not inlinable or its operands are
+// not ones it handles without a frame; the ordinary call that follows then
+// also reports any error.
+static inline bool call_inline(obj_function_t* function, int arg_count, value_t* slots) {
+  inline_body_t* body = &function->inline_body;
+  if (body->kind == INLINE_NONE || arg_count != function->arity) {
+    return false;
+  }
+
+  value_t* constants = function->chunk.constants.values;
+  value_t a = (body->a & INLINE_CONSTANT) ? constants[body->a & 0xff] : slots[body->a];
+  switch (body->kind) {
+    case INLINE_OPERAND:
+      slots[0] = a;
+      return true;
+    case INLINE_FIELD: {
+      // Guarded by the getter's own cache, which its interpreted calls fill.
+      if (!IS_INSTANCE(a)) {
+        return false;
+      }
+      obj_instance_t* instance = AS_INSTANCE(a);
+      cache_entry_t* entry = cache_lookup(&function->chunk.caches[body->cache], instance->klass, instance->shape);
+      if (entry == NULL || entry->slot < 0) {
+        return false;
+      }
+      slots[0] = instance->fields[entry->slot];
+      return true;
+    }
+    case INLINE_BINARY: {
+      value_t b = (body->b & INLINE_CONSTANT) ? constants[body->b & 0xff] : slots[body->b];
+      if (body->op == OP_EQUAL) {
+        slots[0] = BOOL_VAL(values_equal(a, b));
+        return true;
+      }
+      if (ARE_INTS(a, b) && body->op != OP_DIVIDE) {
+        int64_t i = AS_INT(a);
+        int64_t j = AS_INT(b);
+        switch (body->op) {
+          case OP_GREATER:
+            slots[0] = BOOL_VAL(i > j);
+            break;
+          case OP_LESS:
+            slots[0] = BOOL_VAL(i < j);
+            break;
+          case OP_ADD:
+            slots[0] = int64_to_value(i + j);
+            break;
+          case OP_SUBTRACT:
+            slots[0] = int64_to_value(i - j);
+            break;
+          case OP_MULTIPLY:
+            slots[0] = multiply_ints((int32_t)i, (int32_t)j);
+            break;
+        }
+        return true;
+      }
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+      }
+      double x = AS_NUMBER(a);
+      double y = AS_NUMBER(b);
+      switch (body->op) {
+        case OP_GREATER:
+          slots[0] = BOOL_VAL(x > y);
+          break;
+        case OP_LESS:
+          slots[0] = BOOL_VAL(x < y);
+          break;
+        case OP_ADD:
+          slots[0] = NUMBER_VAL(x + y);
+          break;
+        case OP_SUBTRACT:
+          slots[0] = NUMBER_VAL(x - y);
+          break;
+        case OP_MULTIPLY:
+          slots[0] = NUMBER_VAL(x * y);
+          break;
+        case OP_DIVIDE:
+          slots[0] = NUMBER_VAL(x / y);
+          break;
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Like call_value(), but a Lox function replaces the current frame instead
+// of getting a new one, after the frame's upvalues are closed. Other callees
+// get an ordinary call, whose result the OP_RETURN after OP_TAIL_CALL
+// returns.
+static bool tail_call_value(value_t callee, int arg_count) {
+  if (IS_BOUND_METHOD(callee)) {
+    obj_bound_method_t* bound = AS_BOUND_METHOD(callee);
+    vm.stack_top[-arg_count - 1] = bound->receiver;
+    callee = OBJ_VAL(bound->method);
+  }
+  if (!IS_CLOSURE(callee)) {
+    return call_value(callee, arg_count);
+  }
+
+  return tail_call(AS_CLOSURE(callee), arg_count);
+}
+
+// Replaces the current frame with one for closure, whose receiver or callee
+// and arguments are on top of the stack.
+static bool tail_call(obj_closure_t* closure, int arg_count) {
+  if (arg_count != closure->function->arity) {
+    runtime_error("expected %d arguments but got %d", closure->function->arity, arg_count);
+    return false;
+  }
 
+  call_frame_t* frame = &vm.frames[vm.frame_count - 1];
+  close_upvalues(frame->slots);
+  memmove(frame->slots, vm.stack_top - arg_count - 1, sizeof(value_t) * (arg_count + 1));
+  vm.stack_top = frame->slots + arg_count + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  count_call(closure->function);
   return true;
 }
 
+// Counts a call of function, compiling it once it gets hot.
+static void count_call(obj_function_t* function) {
+#ifdef JIT
+  if (function->jit_code == NULL && ++function->call_count == JIT_CALL_THRESHOLD && jit_options.enabled) {
+    jit_compile(function);
+  }
+#else
+  (void)function; // unused
+#endif
+}
+
+// Returns the slot of the global variable name, allocating an undefined slot
+// the first time the name is seen.
+int global_slot(obj_string_t* name) {
+  value_t slot;
+  if (table_get(&vm.global_slots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+
+  int index = vm.globals.count;
+  stack_push(OBJ_VAL(name));
+  value_array_write(&vm.globals, UNDEFINED_VAL);
+  value_array_write(&vm.global_names, OBJ_VAL(name));
+  table_set(&vm.global_slots, name, NUMBER_VAL((double)index));
+  stack_pop();
+  return index;
+}
+
 static void native_define(const char* name, int arity, native_fn_t function) {
   stack_push(OBJ_VAL(string_copy(name, (int)strlen(name))));
   stack_push(OBJ_VAL(native_new(function, arity)));
-  table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = global_slot(AS_STRING(vm.stack[0]));
+  vm.globals.values[slot] = vm.stack[1];
   stack_pop();
   stack_pop();
 }
@@ -536,8 +1427,10 @@ static value_t native_clock(int arg_count, value_t* args) {
 static void close_upvalues(value_t* last) {
   while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
     obj_upvalue_t* upvalue = vm.open_upvalues;
+    write_barrier_prepare(&upvalue->obj);
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    write_barrier(&upvalue->obj, upvalue->closed);
     vm.open_upvalues = upvalue->next;
   }
 }
@@ -545,7 +1438,13 @@ static void close_upvalues(value_t* last) {
 static void define_method(obj_string_t* name) {
   value_t method = stack_peek(0);
   obj_class_t* klass = AS_CLASS(stack_peek(1));
+  write_barrier_prepare(&klass->obj);
   table_set(&klass->methods, name, method);
+  if (name == vm.init_string) {
+    klass->initializer = AS_CLOSURE(method);
+  }
+  write_barrier(&klass->obj, method);
+  klass->method_version++;
   stack_pop();
 }
 
@@ -562,28 +1461,383 @@ static bool bind_method(obj_class_t* klass, obj_string_t* name) {
   return true;
 }
 
-static bool invoke(obj_string_t* name, int arg_count) {
+// Slow path of OP_GET_PROPERTY for the instance on top of the stack, given
+// the cache entry that matched it, if any.
+static bool get_property(obj_instance_t* instance, obj_string_t* name, inline_cache_t* cache, cache_entry_t* entry) {
+  if (entry != NULL) {
+    obj_bound_method_t* bound = bound_method_new(stack_peek(0), entry->method);
+    vm.stack_top[-1] = OBJ_VAL(bound);
+    return true;
+  }
+
+  cache_fill_property(cache, instance, name);
+  value_t value;
+  if (instance_get_field(instance, name, &value)) {
+    vm.stack_top[-1] = value;
+    return true;
+  }
+  return bind_method(instance->klass, name);
+}
+
+static void set_property(obj_instance_t* instance, obj_string_t* name, value_t value, inline_cache_t* cache) {
+  obj_shape_t* shape = instance->shape;
+  instance_set_field(instance, name, value);
+  if (shape == NULL || instance->shape == NULL) {
+    return;
+  }
+
+  cache_entry_t* entry = cache_add(cache, instance->klass, shape);
+  if (entry != NULL) {
+    entry->new_shape = instance->shape;
+    entry->slot = shape_find_slot(instance->shape, name);
+  }
+}
+
+static bool invoke(obj_string_t* name, int arg_count, inline_cache_t* cache, bool tail) {
   value_t receiver = stack_peek(arg_count);
   if (!IS_INSTANCE(receiver)) {
     runtime_error("only instances have methods");
     return false;
   }
   obj_instance_t* instance = AS_INSTANCE(receiver);
+  cache_fill_property(cache, instance, name);
 
   value_t value;
-  if (table_get(&instance->fields, name, &value)) {
+  if (instance_get_field(instance, name, &value)) {
     vm.stack_top[-arg_count - 1] = value;
-    return call_value(value, arg_count);
+    return tail ? tail_call_value(value, arg_count) : call_value(value, arg_count);
   }
 
-  return invoke_from_class(instance->klass, name, arg_count);
+  return invoke_from_class(instance->klass, name, arg_count, tail);
 }
 
-static bool invoke_from_class(obj_class_t* klass, obj_string_t* name, int arg_count) {
+static bool invoke_from_class(obj_class_t* klass, obj_string_t* name, int arg_count, bool tail) {
   value_t method;
   if (!table_get(&klass->methods, name, &method)) {
     runtime_error("undefined property '%s'", name->chars);
     return false;
   }
-  return call(AS_CLOSURE(method), arg_count);
+  return tail ? tail_call(AS_CLOSURE(method), arg_count) : call(AS_CLOSURE(method), arg_count);
+}
+
+// OP_SUPER_INVOKE, with the receiver and arguments on the stack. The cache is
+// keyed on the superclass alone.
+static bool super_invoke(obj_class_t* superclass, obj_string_t* name, int arg_count, inline_cache_t* cache, bool tail) {
+  cache_entry_t* entry = cache_lookup(cache, superclass, NULL);
+  if (entry != NULL) {
+    return tail ? tail_call(entry->method, arg_count) : call(entry->method, arg_count);
+  }
+
+  // The cache is filled before the call, while the frame it belongs to is
+  // still the current one (see cache_add()).
+  value_t resolved;
+  if (table_get(&superclass->methods, name, &resolved)) {
+    entry = cache_add(cache, superclass, NULL);
+    if (entry != NULL) {
+      entry->slot = -1;
+      entry->method = AS_CLOSURE(resolved);
+    }
+  }
+  return invoke_from_class(superclass, name, arg_count, tail);
+}
+
+// Returns the entry of cache for the given receiver class and shape, or NULL
+// if there is none or the class's methods changed since it was filled.
+static inline cache_entry_t* cache_lookup(inline_cache_t* cache, obj_class_t* klass, obj_shape_t* shape) {
+  for (int i = 0; i < cache->count; i++) {
+    cache_entry_t* entry = &cache->entries[i];
+    if (entry->klass == klass && entry->shape == shape && entry->version == klass->method_version) {
+#ifdef DEBUG_INLINE_CACHE_STATS
+      vm.cache_hits++;
+#endif
+      return entry;
+    }
+  }
+#ifdef DEBUG_INLINE_CACHE_STATS
+  vm.cache_misses++;
+#endif
+  return NULL;
+}
+
+// Returns an entry for klass and shape to fill in, reusing a stale one for the
+// same key, or NULL if the site is megamorphic. cache must belong to the
+// function of the current frame, which the entry's references are recorded
+// against for the write barrier.
+static cache_entry_t* cache_add(inline_cache_t* cache, obj_class_t* klass, obj_shape_t* shape) {
+  write_barrier_prepare(&vm.frames[vm.frame_count - 1].closure->function->obj);
+  cache_entry_t* entry = NULL;
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].klass == klass && cache->entries[i].shape == shape) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+  if (entry == NULL) {
+    if (cache->count == INLINE_CACHE_WAYS) {
+      return NULL;
+    }
+    entry = &cache->entries[cache->count++];
+  }
+
+  entry->klass = klass;
+  entry->version = klass->method_version;
+  entry->shape = shape;
+  entry->new_shape = shape;
+  entry->slot = -1;
+  entry->method = NULL;
+  // The caller fills in more references, so the function is remembered
+  // whatever their age.
+  remember_object(&vm.frames[vm.frame_count - 1].closure->function->obj);
+  return entry;
+}
+
+// Caches what name resolves to on instance: a field slot or a method.
+static void cache_fill_property(inline_cache_t* cache, obj_instance_t* instance, obj_string_t* name) {
+  if (instance->shape == NULL) {
+    return;
+  }
+
+  int slot = shape_find_slot(instance->shape, name);
+  value_t method = NIL_VAL;
+  if (slot == -1 && !table_get(&instance->klass->methods, name, &method)) {
+    return;
+  }
+
+  cache_entry_t* entry = cache_add(cache, instance->klass, instance->shape);
+  if (entry != NULL) {
+    entry->slot = slot;
+    entry->method = slot == -1 ? AS_CLOSURE(method) : NULL;
+  }
+}
+
+#ifdef JIT
+// Runtime entry points for compiled code. Instructions the JIT does not
+// generate inline code for are handed over here together with a pointer to
+// their bytecode, so they share the interpreter's slow paths and errors.
+
+// Slow path of an arithmetic or comparison instruction whose operands are on
+// top of the stack and are not both numbers.
+bool jit_slow_op(uint8_t op) {
+  value_t b = stack_peek(0);
+  value_t a = stack_peek(1);
+  switch (op) {
+    case OP_NEGATE:
+      runtime_error("operand must be a number");
+      return false;
+    case OP_ADD:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        concatenate_strings();
+        return true;
+      }
+      runtime_error("operands of + must be two numbers or two strings");
+      return false;
+    case OP_MODULO:
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        int result = (int)AS_NUMBER(a) % (int)AS_NUMBER(b);
+        vm.stack_top--;
+        vm.stack_top[-1] = NUMBER_VAL((double)result);
+        return true;
+      }
+      runtime_error("operands must be numbers");
+      return false;
+    case OP_BIT_NOT:
+      if (!bitwise_op(op, b, b, &vm.stack_top[-1])) {
+        runtime_error("operand must be an integer");
+        return false;
+      }
+      return true;
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+      if (!bitwise_op(op, a, b, &vm.stack_top[-2])) {
+        runtime_error("operands must be integers");
+        return false;
+      }
+      vm.stack_top--;
+      return true;
+    default:
+      runtime_error("operands must be numbers");
+      return false;
+  }
+}
+
+bool jit_slow_instruction(uint8_t* instruction) {
+  call_frame_t* frame = &vm.frames[vm.frame_count - 1];
+  chunk_t* chunk = &frame->closure->function->chunk;
+  uint8_t* operands = instruction + 1;
+  int frame_count = vm.frame_count;
+
+  switch (*instruction) {
+    case OP_CALL: {
+      int arg_count = operands[0];
+      value_t callee = stack_peek(arg_count);
+      if (IS_CLOSURE(callee) && call_inline(AS_CLOSURE(callee)->function, arg_count, vm.stack_top - arg_count - 1)) {
+        vm.stack_top -= arg_count;
+        return true;
+      }
+      return call_value(stack_peek(arg_count), arg_count) && finish_call(frame_count);
+    }
+    // Compiled code runs its frame to completion, so the tail forms get an
+    // ordinary call. worth_compiling() keeps them out of compiled code anyway.
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE: {
+      obj_string_t* name = AS_STRING(chunk->constants.values[operands[0]]);
+      int arg_count = operands[1];
+      inline_cache_t* cache = &chunk->caches[(operands[2] << 8) | operands[3]];
+      value_t receiver = stack_peek(arg_count);
+      if (IS_INSTANCE(receiver)) {
+        obj_instance_t* instance = AS_INSTANCE(receiver);
+        cache_entry_t* entry = cache_lookup(cache, instance->klass, instance->shape);
+        if (entry != NULL && entry->slot < 0) {
+          if (call_inline(entry->method->function, arg_count, vm.stack_top - arg_count - 1)) {
+            vm.stack_top -= arg_count;
+            return true;
+          }
+          return call(entry->method, arg_count) && finish_call(frame_count);
+        }
+      }
+      return invoke(name, arg_count, cache, false) && finish_call(frame_count);
+    }
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_SUPER_INVOKE: {
+      obj_string_t* name = AS_STRING(chunk->constants.values[operands[0]]);
+      int arg_count = operands[1];
+      inline_cache_t* cache = &chunk->caches[(operands[2] << 8) | operands[3]];
+      obj_class_t* superclass = AS_CLASS(stack_pop());
+      return super_invoke(superclass, name, arg_count, cache, false) && finish_call(frame_count);
+    }
+    case OP_GET_SUPER: {
+      obj_string_t* name = AS_STRING(chunk->constants.values[operands[0]]);
+      obj_class_t* superclass = AS_CLASS(stack_pop());
+      return bind_method(superclass, name);
+    }
+    case OP_SET_UPVALUE: {
+      obj_upvalue_t* upvalue = frame->closure->upvalues[operands[0]];
+      write_barrier_prepare(&upvalue->obj);
+      *upvalue->location = stack_peek(0);
+      write_barrier(&upvalue->obj, stack_peek(0));
+      return true;
+    }
+    case OP_GET_PROPERTY:
+      return get_property_operands(chunk, operands);
+    case OP_GET_LOCAL_PROPERTY:
+      stack_push(frame->slots[operands[0]]);
+      return get_property_operands(chunk, operands + 1);
+    case OP_SET_PROPERTY: {
+      if (!IS_INSTANCE(stack_peek(1))) {
+        runtime_error("only instances have properties");
+        return false;
+      }
+      obj_instance_t* instance = AS_INSTANCE(stack_peek(1));
+      obj_string_t* name = AS_STRING(chunk->constants.values[operands[0]]);
+      inline_cache_t* cache = &chunk->caches[(operands[1] << 8) | operands[2]];
+      cache_entry_t* entry = cache_lookup(cache, instance->klass, instance->shape);
+      if (entry != NULL && entry->slot < instance->field_capacity) {
+        write_barrier_prepare(&instance->obj);
+        instance->fields[entry->slot] = stack_peek(0);
+        instance->shape = entry->new_shape;
+        write_barrier(&instance->obj, stack_peek(0));
+        write_barrier_object(&instance->obj, &instance->shape->obj);
+      } else {
+        set_property(instance, name, stack_peek(0), cache);
+      }
+      value_t value = stack_pop();
+      vm.stack_top[-1] = value;
+      return true;
+    }
+    case OP_CLOSURE: {
+      obj_function_t* function = AS_FUNCTION(chunk->constants.values[operands[0]]);
+      obj_closure_t* closure = closure_new(function);
+      stack_push(OBJ_VAL(closure));
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        uint8_t is_local = operands[1 + 2 * i];
+        uint8_t index = operands[2 + 2 * i];
+        obj_upvalue_t* upvalue;
+        if (is_local) {
+          upvalue = capture_upvalue(frame->slots + index);
+        } else {
+          upvalue = frame->closure->upvalues[index];
+        }
+        write_barrier_prepare(&closure->obj);
+        closure->upvalues[i] = upvalue;
+        write_barrier_object(&closure->obj, &upvalue->obj);
+      }
+      return true;
+    }
+    case OP_CLASS: {
+      obj_string_t* name = AS_STRING(chunk->constants.values[operands[0]]);
+      stack_push(OBJ_VAL(class_new(name)));
+      return true;
+    }
+    case OP_METHOD:
+      define_method(AS_STRING(chunk->constants.values[operands[0]]));
+      return true;
+    case OP_INHERIT: {
+      value_t superclass = stack_peek(1);
+      if (!IS_CLASS(superclass)) {
+        runtime_error("superclass must be a class");
+        return false;
+      }
+      obj_class_t* subclass = AS_CLASS(stack_peek(0));
+      write_barrier_prepare(&subclass->obj);
+      table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+      subclass->initializer = AS_CLASS(superclass)->initializer;
+      remember_object(&subclass->obj);
+      subclass->method_version++;
+      stack_pop();
+      return true;
+    }
+    default:
+      break;
+  }
+  runtime_error("instruction %d is not supported in compiled code", *instruction);
+  return false;
+}
+
+bool jit_undefined_global(int slot) {
+  runtime_error("undefined variable %s", AS_STRING(vm.global_names.values[slot])->chars);
+  return false;
+}
+
+void jit_close_upvalues(value_t* last) {
+  close_upvalues(last);
+}
+
+void jit_print(value_t value) {
+  value_print(value);
+  printf("\n");
+}
+
+// Runs the frame pushed by a call from compiled code, if there is one, until
+// it returns.
+static bool finish_call(int frame_count) {
+  if (vm.frame_count == frame_count) {
+    return true;
+  }
+  call_frame_t* frame = &vm.frames[vm.frame_count - 1];
+  if (frame->closure->function->jit_code != NULL) {
+    return jit_run(frame) == EXECUTE_OK;
+  }
+  return vm_run(frame_count) == EXECUTE_OK;
+}
+
+// OP_GET_PROPERTY on the value on top of the stack, given the instruction's
+// name and cache operands.
+static bool get_property_operands(chunk_t* chunk, uint8_t* operands) {
+  if (!IS_INSTANCE(stack_peek(0))) {
+    runtime_error("only instances have properties");
+    return false;
+  }
+  obj_instance_t* instance = AS_INSTANCE(stack_peek(0));
+  obj_string_t* name = AS_STRING(chunk->constants.values[operands[0]]);
+  inline_cache_t* cache = &chunk->caches[(operands[1] << 8) | operands[2]];
+  cache_entry_t* entry = cache_lookup(cache, instance->klass, instance->shape);
+  if (entry != NULL && entry->slot >= 0) {
+    vm.stack_top[-1] = instance->fields[entry->slot];
+    return true;
+  }
+  return get_property(instance, name, cache, entry);
 }
+#endif // JIT
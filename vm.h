@@ -15,6 +15,17 @@ typedef struct {
   value_t* slots;
 } call_frame_t;
 
+// A full collection either runs to completion in one pause or, when
+// incremental, marks a slice at a time between allocations. When concurrent,
+// a background thread marks while the program runs. Once marked, the dead
+// objects are swept a page at a time as the program allocates.
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_CONCURRENT,
+  GC_SWEEPING,
+} gc_phase_t;
+
 typedef struct {
   call_frame_t frames[FRAMES_MAX];
   int frame_count;
@@ -22,18 +33,47 @@ typedef struct {
   value_t stack[STACK_MAX];
   value_t* stack_top;
 
-  table_t globals;
+  // Global variables live in a dense array indexed by slots that the
+  // compiler resolves from their names. Slots of globals that have not been
+  // defined yet hold UNDEFINED_VAL.
+  table_t global_slots; // name -> slot index
+  value_array_t global_names;
+  value_array_t globals;
   table_t strings;
   obj_string_t* init_string;
+  obj_shape_t* empty_shape;
   obj_upvalue_t* open_upvalues;
 
   size_t bytes_allocated;
   size_t next_gc;
-  obj_t* objects;
+  // Objects that survived a collection are old, and new ones are young until
+  // the next collection. All of them live in the pages of slab.c, and the
+  // young ones are also listed here.
+  int young_count;
+  int young_capacity;
+  obj_t** young_objects;
+  size_t young_bytes; // allocated since the last collection or marking slice
+  gc_phase_t gc_phase;
+  bool gc_start_pending; // see gc_safe_point()
+  bool compact_pending; // see compact_heap()
 
   int gray_count;
   int gray_capacity;
   obj_t** gray_stack;
+
+  // Old objects that may reference young ones, recorded by write_barrier().
+  // While marking, such objects are pushed back onto the gray stack instead.
+  int remembered_count;
+  int remembered_capacity;
+  obj_t** remembered;
+
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+  uint64_t instruction_count;
+#endif
+#ifdef DEBUG_INLINE_CACHE_STATS
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+#endif
 } vm_t;
 
 typedef enum {
@@ -47,6 +87,7 @@ extern vm_t vm;
 void vm_init();
 void vm_free();
 execute_result_t execute(const char* source);
+int global_slot(obj_string_t* name);
 void stack_push(value_t value);
 value_t stack_pop();
 